@@ -11,3 +11,7 @@ cd target
 cmake -DCMAKE_BUILD_TYPE=Release ..
 cmake --build .
 mv src/da_proc ../bin
+mv src/da_validate ../bin
+mv src/da_sim ../bin
+mv src/da_replay ../bin
+mv src/da_microbench ../bin
@@ -0,0 +1,319 @@
+#ifndef MEMORY_ARENA
+#define MEMORY_ARENA
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <mutex>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.hpp"
+
+// Address space reserved for the arena, only backed by memory once touched
+#define ARENA_RESERVE_BYTES (1024ul * 1024 * 1024)
+#define ARENA_HUGE_PAGE_BYTES (2ul * 1024 * 1024)
+#define ARENA_PAGE_BYTES 4096ul
+// Size classes take memory from the arena in runs of this size
+#define ARENA_RUN_BYTES (64ul * 1024)
+#define ARENA_MAX_RUNS (ARENA_RESERVE_BYTES / ARENA_RUN_BYTES)
+#define ARENA_CLASSES 18
+// Larger blocks are left to malloc
+#define ARENA_MAX_BLOCK 4096
+// Most blocks moved at once between a thread's cache and its size class
+#define ARENA_BATCH 32
+// Memory a packet pins while in flight: message, payload, clock, buffer and
+// the bookkeeping around them
+#define ARENA_BYTES_PER_PACKET 512
+// Hosts usually share one machine, so each pre-faults at most this fraction
+// of the physical memory divided by the host count
+#define ARENA_MEMORY_SHARE 8
+
+static const size_t ARENA_CLASS_SIZES[ARENA_CLASSES] = {
+    16,  32,  48,  64,  80,   96,   112,  128,  192,
+    256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+
+typedef struct {
+  std::mutex mtx;
+  void *free_list = nullptr;
+  // unused tail of the run last taken by the class
+  char *cursor = nullptr;
+  char *end = nullptr;
+} arena_class_t;
+
+typedef struct {
+  void *head;
+  size_t count;
+} arena_cache_t;
+
+typedef struct {
+  long minor_faults;
+  long major_faults;
+  // -1 when the CPU does not expose its TLB counters to us
+  int64_t tlb_misses;
+} memory_counters_t;
+
+// Serves the small allocations of the pipeline (payloads, messages, clocks,
+// buffers, queue chunks and hash nodes) from one region backed by huge pages
+// and pre-faulted at startup, so the hot path neither faults pages in nor
+// spreads its working set over thousands of TLB entries. Tries hugetlbfs
+// pages first, then transparent huge pages, then plain pages. Blocks are
+// segregated by size class in runs, each thread keeps a small cache per
+// class, and freed blocks are reused but never handed back to the system
+class MemoryArena {
+
+private:
+  char *base;
+  char *limit;
+  std::atomic<size_t> next_run;
+  size_t runs;
+  size_t prefaulted;
+  bool huge_tlb;
+  uint8_t run_class[ARENA_MAX_RUNS];
+  arena_class_t classes[ARENA_CLASSES];
+
+  int tlb_fd;
+  memory_counters_t startup;
+
+  // blocks left in a thread's cache when it exits are lost to the arena
+  static inline thread_local arena_cache_t caches[ARENA_CLASSES];
+
+  static uint32_t class_of_size(size_t size) {
+    if (size <= 128) {
+      return static_cast<uint32_t>(size == 0 ? 0 : (size - 1) / 16);
+    }
+    uint32_t index = 8;
+    while (ARENA_CLASS_SIZES[index] < size) {
+      index++;
+    }
+    return index;
+  }
+
+  static size_t batch_of(uint32_t index) {
+    return std::min<size_t>(ARENA_BATCH,
+                            ARENA_RUN_BYTES / 4 / ARENA_CLASS_SIZES[index]);
+  }
+
+  static void push(arena_cache_t &cache, void *block) {
+    *static_cast<void **>(block) = cache.head;
+    cache.head = block;
+    cache.count++;
+  }
+
+  char *take_run(uint32_t index) {
+    size_t run = next_run++;
+    if (run >= runs) {
+      return nullptr;
+    }
+    run_class[run] = static_cast<uint8_t>(index);
+    return base + run * ARENA_RUN_BYTES;
+  }
+
+  bool refill(uint32_t index, arena_cache_t &cache) {
+    arena_class_t &size_class = classes[index];
+    size_t size = ARENA_CLASS_SIZES[index];
+    std::lock_guard<std::mutex> lock(size_class.mtx);
+
+    while (cache.count < batch_of(index)) {
+      if (size_class.free_list != nullptr) {
+        void *block = size_class.free_list;
+        size_class.free_list = *static_cast<void **>(block);
+        push(cache, block);
+        continue;
+      }
+      if (size_class.cursor + size > size_class.end) {
+        char *run = take_run(index);
+        if (run == nullptr) {
+          break;
+        }
+        size_class.cursor = run;
+        size_class.end = run + ARENA_RUN_BYTES;
+      }
+      push(cache, size_class.cursor);
+      size_class.cursor += size;
+    }
+    return cache.count > 0;
+  }
+
+  void flush(uint32_t index, arena_cache_t &cache) {
+    arena_class_t &size_class = classes[index];
+    std::lock_guard<std::mutex> lock(size_class.mtx);
+    for (size_t i = batch_of(index); i > 0; i--) {
+      void *block = cache.head;
+      cache.head = *static_cast<void **>(block);
+      cache.count--;
+      *static_cast<void **>(block) = size_class.free_list;
+      size_class.free_list = block;
+    }
+  }
+
+  static char *map_region(size_t bytes, int flags) {
+    void *region = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return region == MAP_FAILED ? nullptr : static_cast<char *>(region);
+  }
+
+  void open_tlb_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                  PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // threads spawned later are counted too
+    attr.inherit = 1;
+    tlb_fd = static_cast<int>(
+        syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+
+  void map_arena(size_t hosts, size_t packets) {
+    size_t physical = static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) *
+                      static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t wanted = std::min(hosts * packets * ARENA_BYTES_PER_PACKET,
+                             physical / ARENA_MEMORY_SHARE / hosts);
+    wanted = std::min(ARENA_RESERVE_BYTES,
+                      std::max(ARENA_HUGE_PAGE_BYTES, wanted));
+    wanted = (wanted + ARENA_HUGE_PAGE_BYTES - 1) / ARENA_HUGE_PAGE_BYTES *
+             ARENA_HUGE_PAGE_BYTES;
+
+    // hugetlbfs pages are reserved up front, so only map what we pre-fault
+    char *region = map_region(wanted, MAP_HUGETLB | MAP_POPULATE);
+    size_t reserved = wanted;
+    huge_tlb = region != nullptr;
+
+    if (!huge_tlb) {
+      // over-reserve to align the region on a huge page
+      reserved = ARENA_RESERVE_BYTES;
+      char *raw = map_region(reserved + ARENA_HUGE_PAGE_BYTES, MAP_NORESERVE);
+      if (raw == nullptr) {
+        if (DEBUG)
+          std::cout << "Could not map the memory arena, using malloc\n";
+        return;
+      }
+      uintptr_t address = reinterpret_cast<uintptr_t>(raw);
+      size_t skew = (ARENA_HUGE_PAGE_BYTES -
+                     address % ARENA_HUGE_PAGE_BYTES) %
+                    ARENA_HUGE_PAGE_BYTES;
+      region = raw + skew;
+      madvise(region, reserved, MADV_HUGEPAGE);
+      volatile char *pages = region;
+      for (size_t offset = 0; offset < wanted; offset += ARENA_PAGE_BYTES) {
+        pages[offset] = 0;
+      }
+    }
+
+    prefaulted = wanted;
+    runs = reserved / ARENA_RUN_BYTES;
+    limit = region + runs * ARENA_RUN_BYTES;
+    base = region;
+  }
+
+public:
+  constexpr MemoryArena()
+      : base(nullptr), limit(nullptr), next_run(0), runs(0), prefaulted(0),
+        huge_tlb(false), run_class(), classes(), tlb_fd(-1), startup() {}
+
+  // Maps the arena and pre-faults the memory `hosts` processes each with
+  // `packets` packets in flight are expected to need. Until then, and once
+  // the arena is exhausted, allocations fall back to malloc
+  void reserve(size_t hosts, size_t packets) {
+    open_tlb_counter();
+    if (MEMORY_ARENAS) {
+      map_arena(hosts, packets);
+    }
+    startup = counters();
+  }
+
+  // nullptr if the block has to come from malloc
+  void *allocate(size_t size) {
+    if (base == nullptr || size > ARENA_MAX_BLOCK) {
+      return nullptr;
+    }
+    uint32_t index = class_of_size(size);
+    arena_cache_t &cache = caches[index];
+    if (cache.head == nullptr && !refill(index, cache)) {
+      return nullptr;
+    }
+    void *block = cache.head;
+    cache.head = *static_cast<void **>(block);
+    cache.count--;
+    return block;
+  }
+
+  // false if the block does not belong to the arena
+  bool release(void *block) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(block);
+    if (address < reinterpret_cast<uintptr_t>(base) ||
+        address >= reinterpret_cast<uintptr_t>(limit)) {
+      return false;
+    }
+    uint32_t index = run_class[(address - reinterpret_cast<uintptr_t>(base)) /
+                               ARENA_RUN_BYTES];
+    arena_cache_t &cache = caches[index];
+    push(cache, block);
+    if (cache.count > 2 * batch_of(index)) {
+      flush(index, cache);
+    }
+    return true;
+  }
+
+  memory_counters_t counters() {
+    memory_counters_t now;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    now.minor_faults = usage.ru_minflt;
+    now.major_faults = usage.ru_majflt;
+    now.tlb_misses = -1;
+    uint64_t misses;
+    if (tlb_fd >= 0 && read(tlb_fd, &misses, sizeof(misses)) ==
+                           static_cast<ssize_t>(sizeof(misses))) {
+      now.tlb_misses = static_cast<int64_t>(misses);
+    }
+    return now;
+  }
+
+  // Page faults and dTLB misses at startup, and since then when `running`
+  void show(bool running) {
+    if (!DEBUG) {
+      return;
+    }
+    memory_counters_t now = counters();
+    if (!running) {
+      std::cout << "Memory arena: "
+                << (base == nullptr ? "off"
+                    : huge_tlb      ? "hugetlbfs pages"
+                                    : "transparent huge pages")
+                << ", " << (prefaulted >> 20) << " MB pre-faulted\n";
+      now = startup;
+    } else {
+      now.minor_faults -= startup.minor_faults;
+      now.major_faults -= startup.major_faults;
+      now.tlb_misses -= now.tlb_misses < 0 ? 0 : startup.tlb_misses;
+    }
+    std::cout << "Memory " << (running ? "while running" : "at startup")
+              << ": " << now.minor_faults << " minor faults, "
+              << now.major_faults << " major faults, dTLB misses ";
+    if (now.tlb_misses < 0) {
+      std::cout << "unavailable";
+    } else {
+      std::cout << now.tlb_misses;
+    }
+    if (running) {
+      std::cout << ", " << (std::min(next_run.load(), runs) *
+                            ARENA_RUN_BYTES >> 20)
+                << " MB of the arena in use";
+    }
+    std::cout << "\n";
+  }
+};
+
+extern MemoryArena memory_arena;
+
+#endif
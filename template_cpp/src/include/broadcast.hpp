@@ -9,9 +9,36 @@
 
 void best_effort_broadcast(tcp_handler_t *tcp_handler, payload_t *payload);
 
+// Sends a copy of `payload` to every peer, for payloads no one retransmits
+void broadcast_copies(tcp_handler_t *tcp_handler, payload_t *payload,
+                      SendClass send_class);
+
+SendClass broadcast_class(tcp_handler_t *tcp_handler, payload_t *payload);
+
+void delayed_relay(tcp_handler_t *tcp_handler, payload_t *payload);
+
+// Sends to the overlay targets at once and to every other peer as a delayed
+// relay, see overlay.hpp
+void overlay_broadcast(tcp_handler_t *tcp_handler, payload_t *payload);
+
 void uniform_reliable_broadcast(tcp_handler_t *tcp_handler, payload_t *payload,
                                 bool rebroadcast = true);
 
+// Library entry points. broadcast() URB-broadcasts a copy of `len` bytes at
+// `data` as the next message of this process, blocking while the sending
+// queue or the receivers are full; it returns false once the stack stops.
+// Only one thread may broadcast. A delivery callback set before the threads
+// start gets every delivery inline, instead of the deliverable queue
+bool broadcast(tcp_handler_t *tcp_handler, const char *data, size_t len);
+
+// Whether broadcast() would go through without blocking
+bool can_broadcast(tcp_handler_t *tcp_handler);
+
+void set_delivery_callback(tcp_handler_t *tcp_handler,
+                           DeliveryCallback callback);
+
+// Broadcasts `msgs_to_send_count` messages on every channel of the process,
+// taking turns between them; `enqueued_messages` counts them all
 void broadcast_messages(tcp_handler_t *tcp_handler, node_t *sender_node,
                         uint32_t *enqueued_messages,
                         uint32_t msgs_to_send_count);
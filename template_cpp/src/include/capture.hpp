@@ -0,0 +1,179 @@
+#ifndef PACKET_CAPTURE
+#define PACKET_CAPTURE
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "delivered_set.hpp"
+#include "protocol_clock.hpp"
+
+// Directory receiving one trace per process, named after its id, e.g.
+//   DA_CAPTURE=/tmp/traces
+#define CAPTURE_ENV "DA_CAPTURE"
+// "DATR" in a little-endian dump
+#define TRACE_MAGIC 0x52544144
+#define TRACE_VERSION 3
+// Records are buffered in memory and written out in chunks of this size
+#define CAPTURE_FLUSH_BYTES (1 << 20)
+// Arrival time in ns since the capture started, then the datagram length
+#define TRACE_RECORD_HEADER_SIZE 12
+
+using namespace std::chrono; // noqa
+
+// Trace layout, all words in host byte order:
+//  - magic, version, id of the capturing process, number of processes
+//  - per process in id order: its dependency count, then their ids
+//  - per datagram: uint64 arrival time, uint32 length, then its bytes
+// The header makes a trace self-contained: replaying it rebuilds the
+// capturing process' delivered set without the hosts and config files
+
+// Records every datagram a process receives, as handed to
+// decode_udp_payload: after FEC recovery and decompression
+class TraceWriter {
+
+private:
+  std::ofstream file;
+  std::vector<char> pending;
+  steady_clock::time_point start;
+  mutable std::mutex mtx;
+
+  void append_unsafe(const void *data, size_t len) {
+    const char *bytes = static_cast<const char *>(data);
+    pending.insert(pending.end(), bytes, bytes + len);
+  }
+
+  void write_unsafe() {
+    file.write(pending.data(), static_cast<std::streamsize>(pending.size()));
+    pending.clear();
+  }
+
+public:
+  // Captures nothing if `directory` is NULL or empty
+  TraceWriter(const char *directory, uint32_t process_id,
+              std::vector<node_t *> *nodes, CausalityMap *causality)
+      : file(), pending(), mtx() {
+    start = ProtocolClock::now();
+    if (directory == NULL || *directory == '\0') {
+      return;
+    }
+    std::string path =
+        std::string(directory) + "/" + std::to_string(process_id) + ".trace";
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      throw std::runtime_error("cannot write the trace " + path);
+    }
+
+    uint32_t header[4] = {TRACE_MAGIC, TRACE_VERSION, process_id,
+                          static_cast<uint32_t>(nodes->size())};
+    append_unsafe(header, sizeof(header));
+    for (uint32_t node_id = 1; node_id <= nodes->size(); node_id++) {
+      std::vector<uint32_t> &dependencies = (*causality)[node_id];
+      uint32_t count = static_cast<uint32_t>(dependencies.size());
+      append_unsafe(&count, sizeof(count));
+      append_unsafe(dependencies.data(), count * sizeof(uint32_t));
+    }
+    pending.reserve(CAPTURE_FLUSH_BYTES + IP_MAXPACKET);
+  }
+
+  ~TraceWriter() { flush(); }
+
+  bool is_enabled() { return file.is_open(); }
+
+  void record(const char *datagram, ssize_t len) {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t at_ns = static_cast<uint64_t>(
+        duration_cast<nanoseconds>(ProtocolClock::now() - start).count());
+    uint32_t length = static_cast<uint32_t>(len);
+    append_unsafe(&at_ns, sizeof(at_ns));
+    append_unsafe(&length, sizeof(length));
+    append_unsafe(datagram, length);
+    if (pending.size() >= CAPTURE_FLUSH_BYTES) {
+      write_unsafe();
+    }
+  }
+
+  void flush() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (file.is_open()) {
+      write_unsafe();
+      file.flush();
+    }
+  }
+};
+
+typedef struct {
+  uint64_t at_ns;
+  uint32_t len;
+  char *datagram;
+} trace_record_t;
+
+// Loads a whole trace in memory, so replaying it does not touch the disk
+class TraceReader {
+
+private:
+  std::vector<char> data;
+  size_t offset;
+
+  uint32_t read_word() {
+    uint32_t word;
+    if (offset + sizeof(word) > data.size()) {
+      throw std::runtime_error("truncated trace header");
+    }
+    memcpy(&word, data.data() + offset, sizeof(word));
+    offset += sizeof(word);
+    return word;
+  }
+
+public:
+  uint32_t process_id;
+  uint32_t processes;
+  CausalityMap causality;
+  CausalityMap reverse_causality;
+
+  explicit TraceReader(const std::string &path)
+      : data(), causality(), reverse_causality() {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("cannot read the trace " + path);
+    }
+    data.assign(std::istreambuf_iterator<char>(file),
+                std::istreambuf_iterator<char>());
+    offset = 0;
+
+    if (read_word() != TRACE_MAGIC || read_word() != TRACE_VERSION) {
+      throw std::runtime_error(path + " is not a trace of this version");
+    }
+    process_id = read_word();
+    processes = read_word();
+    for (uint32_t node_id = 1; node_id <= processes; node_id++) {
+      for (uint32_t count = read_word(); count > 0; count--) {
+        uint32_t dependency = read_word();
+        causality[node_id].push_back(dependency);
+        reverse_causality[dependency].push_back(node_id);
+      }
+    }
+  }
+
+  // Returns false at the end of the trace or on a truncated record
+  bool next(trace_record_t &record) {
+    if (offset + TRACE_RECORD_HEADER_SIZE > data.size()) {
+      return false;
+    }
+    memcpy(&record.at_ns, data.data() + offset, sizeof(record.at_ns));
+    memcpy(&record.len, data.data() + offset + 8, sizeof(record.len));
+    if (offset + TRACE_RECORD_HEADER_SIZE + record.len > data.size()) {
+      return false;
+    }
+    record.datagram = data.data() + offset + TRACE_RECORD_HEADER_SIZE;
+    offset += TRACE_RECORD_HEADER_SIZE + record.len;
+    return true;
+  }
+};
+
+#endif
@@ -11,10 +11,47 @@
 #include <sys/types.h>
 
 // Program flags
+#ifndef DEBUG
 #define DEBUG 1
+#endif
 #define DEBUG_V 0
 #define KEEP_ALIVE 1
+#ifndef DUMP_TO_FILE
 #define DUMP_TO_FILE 1
+#endif
+// Send the first copy of every broadcast once to an IP multicast group
+#ifndef MULTICAST_FANOUT
+#define MULTICAST_FANOUT 0
+#endif
+// Forward new packets along spanning trees (1) or by gossip (2) rather than
+// to every peer, see overlay.hpp
+#ifndef DISSEMINATION_OVERLAY
+#define DISSEMINATION_OVERLAY 0
+#endif
+// Protect datagrams with XOR parity, see fec.hpp
+#ifndef FEC_ENABLED
+#define FEC_ENABLED 0
+#endif
+// Batch datagrams with UDP GSO/GRO when the kernel supports it, see gso.hpp
+#ifndef UDP_OFFLOAD
+#define UDP_OFFLOAD 1
+#endif
+// Link I/O through io_uring instead of socket calls, see uring.hpp
+#ifndef IO_URING_BACKEND
+#define IO_URING_BACKEND 0
+#endif
+// Zero-copy sends for the io_uring backend
+#ifndef URING_SEND_ZC
+#define URING_SEND_ZC 0
+#endif
+// Compress datagram bodies when it saves bytes, see compression.hpp
+#ifndef WIRE_COMPRESSION
+#define WIRE_COMPRESSION 1
+#endif
+// Serve small allocations from a pre-faulted huge page arena, see arena.hpp
+#ifndef MEMORY_ARENAS
+#define MEMORY_ARENAS 1
+#endif
 #define MILLION 1000000
 
 #define IP_MAXPACKET 65535
@@ -0,0 +1,191 @@
+#ifndef LZ_CODEC
+#define LZ_CODEC
+
+#include <cstdint>
+#include <string.h>
+
+#include "common.hpp"
+
+// Bodies shorter than this are sent as they are
+#define COMPRESSION_MIN_BYTES 64
+// Shortest repetition worth a back-reference
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 10
+#define LZ_MAX_OFFSET 65535
+
+// LZ77 block codec in the spirit of LZ4: a sequence is a token holding the
+// literal and match lengths, the literals, then the 2 bytes offset of the
+// match. Lengths past 15 spill over in extra bytes of up to 255 each. Tuned
+// for datagram sized inputs: decimal sequence numbers and vector clocks with
+// many repeated zero bytes
+class LzCodec {
+
+private:
+  static uint32_t hash(const uint8_t *data) {
+    uint32_t word;
+    memcpy(&word, data, 4);
+    return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+  }
+
+  // Writes the spill-over of a length, false if it does not fit
+  static bool put_length(size_t len, uint8_t *&out, const uint8_t *out_end) {
+    for (; len >= 255; len -= 255) {
+      if (out == out_end) {
+        return false;
+      }
+      *out++ = 255;
+    }
+    if (out == out_end) {
+      return false;
+    }
+    *out++ = static_cast<uint8_t>(len);
+    return true;
+  }
+
+  static bool get_length(size_t &len, const uint8_t *&in,
+                         const uint8_t *in_end) {
+    uint8_t byte;
+    do {
+      if (in == in_end) {
+        return false;
+      }
+      byte = *in++;
+      len += byte;
+    } while (byte == 255);
+    return true;
+  }
+
+  static bool put_sequence(const uint8_t *literals, size_t literal_len,
+                           size_t offset, size_t match_len, uint8_t *&out,
+                           const uint8_t *out_end) {
+    if (out == out_end) {
+      return false;
+    }
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    uint8_t *token = out++;
+    *token = static_cast<uint8_t>(
+        (literal_len < 15 ? literal_len : 15) << 4 |
+        (match_code < 15 ? match_code : 15));
+
+    if (literal_len >= 15 && !put_length(literal_len - 15, out, out_end)) {
+      return false;
+    }
+    if (static_cast<size_t>(out_end - out) < literal_len) {
+      return false;
+    }
+    memcpy(out, literals, literal_len);
+    out += literal_len;
+
+    if (match_len == 0) {
+      return true; // the last sequence only has literals
+    }
+    if (out_end - out < 2) {
+      return false;
+    }
+    uint16_t offset16 = static_cast<uint16_t>(offset);
+    memcpy(out, &offset16, 2);
+    out += 2;
+    return match_code < 15 || put_length(match_code - 15, out, out_end);
+  }
+
+public:
+  // Compresses `len` bytes into at most `capacity` bytes. Returns the
+  // compressed size, or -1 if the output would not fit
+  static ssize_t compress(const char *source, size_t len, char *dest,
+                          size_t capacity) {
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(source);
+    const uint8_t *in_end = in + len;
+    uint8_t *out = reinterpret_cast<uint8_t *>(dest);
+    const uint8_t *out_end = out + capacity;
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *anchor = in;
+    const uint8_t *cursor = in + 1;
+    while (len >= LZ_MIN_MATCH &&
+           cursor <= in_end - LZ_MIN_MATCH) {
+      uint32_t slot = hash(cursor);
+      const uint8_t *candidate = in + table[slot];
+      table[slot] = static_cast<uint16_t>(cursor - in);
+
+      if (candidate >= cursor || cursor - candidate > LZ_MAX_OFFSET ||
+          memcmp(candidate, cursor, LZ_MIN_MATCH) != 0) {
+        cursor++;
+        continue;
+      }
+
+      size_t match_len = LZ_MIN_MATCH;
+      while (cursor + match_len < in_end &&
+             candidate[match_len] == cursor[match_len]) {
+        match_len++;
+      }
+      if (!put_sequence(anchor, static_cast<size_t>(cursor - anchor),
+                        static_cast<size_t>(cursor - candidate), match_len,
+                        out, out_end)) {
+        return -1;
+      }
+      cursor += match_len;
+      anchor = cursor;
+    }
+
+    if (!put_sequence(anchor, static_cast<size_t>(in_end - anchor), 0, 0, out,
+                      out_end)) {
+      return -1;
+    }
+    return out - reinterpret_cast<uint8_t *>(dest);
+  }
+
+  // Restores exactly `len` bytes into `dest`. Returns false if the input is
+  // malformed, e.g. corrupted on the wire
+  static bool decompress(const char *source, size_t source_len, char *dest,
+                         size_t len) {
+    const uint8_t *in = reinterpret_cast<const uint8_t *>(source);
+    const uint8_t *in_end = in + source_len;
+    uint8_t *out = reinterpret_cast<uint8_t *>(dest);
+    uint8_t *out_start = out;
+    const uint8_t *out_end = out + len;
+
+    while (in < in_end) {
+      uint8_t token = *in++;
+      size_t literal_len = token >> 4;
+      if (literal_len == 15 && !get_length(literal_len, in, in_end)) {
+        return false;
+      }
+      if (static_cast<size_t>(in_end - in) < literal_len ||
+          static_cast<size_t>(out_end - out) < literal_len) {
+        return false;
+      }
+      memcpy(out, in, literal_len);
+      in += literal_len;
+      out += literal_len;
+
+      if (in == in_end) {
+        break;
+      }
+      if (in_end - in < 2) {
+        return false;
+      }
+      uint16_t offset;
+      memcpy(&offset, in, 2);
+      in += 2;
+      size_t match_len = token & 0x0f;
+      if (match_len == 15 && !get_length(match_len, in, in_end)) {
+        return false;
+      }
+      match_len += LZ_MIN_MATCH;
+      if (offset == 0 || offset > out - out_start ||
+          static_cast<size_t>(out_end - out) < match_len) {
+        return false;
+      }
+      // byte by byte, the match may overlap what it copies
+      const uint8_t *match = out - offset;
+      for (size_t i = 0; i < match_len; i++) {
+        out[i] = match[i];
+      }
+      out += match_len;
+    }
+    return out == out_end;
+  }
+};
+
+#endif
@@ -1,14 +1,20 @@
 #ifndef DELIVERED_SET
 #define DELIVERED_SET
 
+#include <algorithm>
 #include <atomic>
+#include <functional>
+#include <iterator>
+#include <map>
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "common.hpp"
 #include "messages.hpp"
+#include "spill.hpp"
 
 typedef std::atomic<uint32_t> Counter;
 typedef uint32_t SenderID;
@@ -20,13 +26,51 @@ template <typename A> using Set = std::unordered_set<A>;
 
 typedef Map<SenderID, std::vector<uint32_t>> CausalityMap;
 
+// Gets a view of every delivered message, valid only during the call. Runs
+// under the delivery lock, so it must not call back into the stack
+typedef std::function<void(OwnerID, PacketID, const char *, size_t)>
+    DeliveryCallback;
+
+// Packets per owner a process buffers beyond what it delivered
+#define CREDIT_WINDOW (MILLION / 100)
+
 class DeliveredSet {
 
 private:
-  Map<SenderID, Map<OwnerID, Set<PacketID> *>> acked;
+  // packets held by a sender above its watermark, keyed as acked_up_to and
+  // only present while some arrived out of order
+  Map<uint32_t, Set<PacketID>> acked;
+  // first packet of `owner` not yet known to be held by `sender`, everything
+  // below it is compacted out of `acked`. Row-major by sender
+  std::vector<PacketID> acked_up_to;
+  // packets below it are held by every process but those the failure
+  // detector gave up on: a suspected process may only be slow and still
+  // needs what it lacks, a given up one would hold it back forever
+  Map<OwnerID, PacketID> stable_up_to;
+  // packets below it are held by every process, given up ones included
+  Map<OwnerID, PacketID> held_by_all_up_to;
+  // suspected processes do not hold back new broadcasts
+  Map<SenderID, bool> suspected;
+  Map<SenderID, bool> given_up;
+  // came back after retransmissions towards them were dropped, see
+  // FailureDetector
+  Map<SenderID, bool> catching_up;
+
+  // packets below it are held by a majority, i.e. it is the (n/2 + 1)-th
+  // largest of the owner's acked watermarks
+  Map<OwnerID, PacketID> urb_frontier;
+  // watermarks above the frontier and how many processes sit at each of them
+  Map<OwnerID, std::map<PacketID, uint32_t>> ahead_of_frontier;
+  Map<OwnerID, uint32_t> ahead_count;
 
-  Map<OwnerID, Map<PacketID, Counter>> acked_counter;
   Map<OwnerID, Map<PacketID, payload_t *>> undelivered;
+  // heap taken by the payloads in `undelivered`
+  size_t undelivered_bytes;
+
+  // how far each peer lets us send packets of each owner, row-major by peer
+  std::atomic<uint32_t> *peer_credit;
+  // a peer sent us a packet we had, our digest may not have reached it
+  std::atomic<bool> digest_requested;
 
   mutable std::mutex mtx;
   mutable std::mutex received_mtx;
@@ -36,94 +80,435 @@ private:
   // points where we have the first "hole" in delivered
   Map<OwnerID, Counter> received_up_to;
 
+  uint32_t pair_key(SenderID sender_id, OwnerID owner_id) {
+    return sender_id * (keys + 1) + owner_id;
+  }
+
+  PacketID &watermark(SenderID sender_id, OwnerID owner_id) {
+    return acked_up_to[pair_key(sender_id, owner_id)];
+  }
+
+  bool contains_unsafe(SenderID sender_id, OwnerID owner_id,
+                       PacketID packet_uid) {
+    if (packet_uid < watermark(sender_id, owner_id)) {
+      return true;
+    }
+    auto it = acked.find(pair_key(sender_id, owner_id));
+    return it != acked.end() && it->second.count(packet_uid) == 1;
+  }
+
   bool contains_unsafe(SenderID sender_id, payload_t *payload) {
-    return acked[sender_id][payload->owner_id]->count(payload->packet_uid) == 1;
+    return contains_unsafe(sender_id, payload->owner_id, payload->packet_uid);
+  }
+
+  // Records that `sender_id` holds the packet, returns false if already known
+  bool ack_unsafe(SenderID sender_id, OwnerID owner_id, PacketID packet_uid) {
+    if (contains_unsafe(sender_id, owner_id, packet_uid)) {
+      return false;
+    }
+
+    if (packet_uid == watermark(sender_id, owner_id)) {
+      advance_watermark_unsafe(sender_id, owner_id, packet_uid + 1);
+    } else {
+      acked[pair_key(sender_id, owner_id)].insert(packet_uid);
+    }
+    return true;
+  }
+
+  // Records that `sender_id` holds every packet of `owner_id` below `to`
+  void advance_watermark_unsafe(SenderID sender_id, OwnerID owner_id,
+                                PacketID to) {
+    PacketID &up_to = watermark(sender_id, owner_id);
+    PacketID previous = up_to;
+    if (to <= previous) {
+      return;
+    }
+
+    up_to = to;
+    auto found = acked.find(pair_key(sender_id, owner_id));
+    if (found != acked.end()) {
+      Set<PacketID> &packets = found->second;
+      if (to > previous + 1) {
+        for (auto it = packets.begin(); it != packets.end();) {
+          it = *it < to ? packets.erase(it) : std::next(it);
+        }
+      }
+      while (packets.erase(up_to) == 1) {
+        up_to++;
+      }
+      if (packets.empty()) {
+        acked.erase(found);
+      }
+    }
+
+    move_watermark_unsafe(owner_id, previous, up_to);
+    // below it if the sender was given up on for a while
+    if (previous <= stable_up_to[owner_id]) {
+      update_stability_unsafe(owner_id);
+    }
+  }
+
+  // Keeps the URB frontier of `owner_id` up to date when one process's
+  // watermark moves from `previous` to `current`
+  void move_watermark_unsafe(OwnerID owner_id, PacketID previous,
+                             PacketID current) {
+    PacketID frontier = urb_frontier[owner_id];
+    std::map<PacketID, uint32_t> &ahead = ahead_of_frontier[owner_id];
+    uint32_t &count = ahead_count[owner_id];
+
+    if (current <= frontier) {
+      return;
+    }
+    if (previous > frontier) {
+      auto it = ahead.find(previous);
+      if (--it->second == 0) {
+        ahead.erase(it);
+      }
+    } else {
+      count++;
+    }
+    ahead[current]++;
+
+    uint32_t majority = keys / 2 + 1;
+    if (count < majority) {
+      return;
+    }
+
+    // jump straight to the new majority-th largest watermark
+    uint32_t seen = 0;
+    for (auto it = ahead.rbegin(); it != ahead.rend(); ++it) {
+      seen += it->second;
+      if (seen >= majority) {
+        frontier = it->first;
+        break;
+      }
+    }
+    urb_frontier[owner_id] = frontier;
+
+    while (!ahead.empty() && ahead.begin()->first <= frontier) {
+      count -= ahead.begin()->second;
+      ahead.erase(ahead.begin());
+    }
+  }
+
+  // Advances the stable prefix of `owner_id`, never moving it back. Every
+  // watermark but those of given up processes is at or above it, so there is
+  // nothing to compact
+  void update_stability_unsafe(OwnerID owner_id) {
+    PacketID stable = UINT32_MAX;
+    PacketID held_by_all = UINT32_MAX;
+    for (uint32_t sender_id = 1; sender_id <= keys; sender_id++) {
+      PacketID up_to = watermark(sender_id, owner_id);
+      held_by_all = std::min(held_by_all, up_to);
+      if (!given_up[sender_id]) {
+        stable = std::min(stable, up_to);
+      }
+    }
+
+    if (stable > stable_up_to[owner_id]) {
+      stable_up_to[owner_id] = stable;
+    }
+    held_by_all_up_to[owner_id] = held_by_all;
+  }
+
+  bool can_deliver_next_unsafe(OwnerID owner_id) {
+    PacketID next = received_up_to[owner_id];
+    auto it = undelivered[owner_id].find(next);
+    if (it == undelivered[owner_id].end()) {
+      payload_t *spilled =
+          spill != nullptr ? spill->take(owner_id, next) : nullptr;
+      if (spilled == nullptr) {
+        return false;
+      }
+      // next in line, so it stays in memory from now on
+      it = undelivered[owner_id].emplace(next, spilled).first;
+      undelivered_bytes += SpillStore::footprint(spilled);
+    }
+    return can_lcb_deliver(it->second, owner_id);
+  }
+
+  // Delivers everything that became deliverable after a change to `owner_id`,
+  // following the processes it affects
+  void deliver_pending_unsafe(OwnerID owner_id) {
+    std::vector<OwnerID> affected = {owner_id};
+
+    while (!affected.empty()) {
+      OwnerID node_id = affected.back();
+      affected.pop_back();
+
+      if (!can_deliver_next_unsafe(node_id)) {
+        continue;
+      }
+
+      do {
+        uint32_t packet_uid = received_up_to[node_id];
+        payload_t *payload = undelivered[node_id][packet_uid];
+        undelivered[node_id].erase(packet_uid);
+        undelivered_bytes -= SpillStore::footprint(payload);
+
+        if (on_deliver) {
+          on_deliver(node_id, packet_uid, payload->buffer,
+                     static_cast<size_t>(payload->buff_size));
+          free_payload(payload);
+        } else {
+          deliverable->enqueue(payload);
+        }
+
+        received_up_to[node_id]++;
+        vector_clock[node_id]++;
+      } while (can_deliver_next_unsafe(node_id));
+
+      for (OwnerID dependant : (*reverse_causality)[node_id]) {
+        if (dependant != node_id) {
+          affected.push_back(dependant);
+        }
+      }
+    }
   }
 
 public:
   PayloadQueue *deliverable;
+  // replaces the deliverable queue when set
+  DeliveryCallback on_deliver;
+  // takes the blocked payloads beyond its threshold when set
+  SpillStore *spill;
   uint32_t *vector_clock;
   CausalityMap *causality;
   CausalityMap *reverse_causality;
 
   DeliveredSet(node_t *current_node_in, size_t keys_in)
-      : acked(), acked_counter(), undelivered(), mtx(), received_mtx() {
+      : acked(), acked_up_to(), stable_up_to(), held_by_all_up_to(),
+        suspected(), given_up(), catching_up(), urb_frontier(),
+        ahead_of_frontier(), ahead_count(), undelivered(), mtx(),
+        received_mtx() {
     keys = static_cast<uint32_t>(keys_in);
     current_node = current_node_in;
+    undelivered_bytes = 0;
+    digest_requested = false;
+    spill = nullptr;
     vector_clock = new uint32_t[keys + 1];
+    peer_credit = new std::atomic<uint32_t>[(keys + 1) * (keys + 1)];
+    // every sender starts with nothing
+    acked_up_to.assign((keys + 1) * (keys + 1), 1);
+
+    for (uint32_t i = 0; i < (keys + 1) * (keys + 1); i++) {
+      // every peer starts with nothing delivered
+      peer_credit[i] = 1 + CREDIT_WINDOW;
+    }
 
     for (uint32_t sender_id = 0; sender_id <= keys; sender_id++) {
-      for (uint32_t owner_id = 0; owner_id <= keys; owner_id++) {
-        // initialize delivered sets
-        Set<PacketID> *packets = new Set<PacketID>;
-        acked[sender_id][owner_id] = packets;
-      }
+      stable_up_to[sender_id] = 1;
+      held_by_all_up_to[sender_id] = 1;
+      urb_frontier[sender_id] = 1;
+      ahead_count[sender_id] = 0;
+      suspected[sender_id] = false;
+      given_up[sender_id] = false;
+      catching_up[sender_id] = false;
       received_up_to[sender_id] = 1;
       vector_clock[sender_id] = 0;
     }
   }
 
   ~DeliveredSet() {
-    for (uint32_t sender_id = 0; sender_id <= keys; sender_id++) {
-      for (uint32_t owner_id = 0; owner_id <= keys; owner_id++) {
-        delete acked[sender_id][owner_id];
-      }
-    }
     delete[] vector_clock;
+    delete[] peer_credit;
   }
 
   void insert(SenderID sender_id, payload_t *payload) {
     std::lock_guard<std::mutex> lock(mtx);
     payload_t *log_payload;
-    bool seen = contains_unsafe(sender_id, payload);
 
-    if (!seen) {
-      acked[sender_id][payload->owner_id]->insert(payload->packet_uid);
+    if (!ack_unsafe(sender_id, payload->owner_id, payload->packet_uid)) {
+      return;
+    }
 
-      if (payload->packet_uid < received_up_to[payload->owner_id]) {
-        return;
-      } else {
+    if (payload->packet_uid < received_up_to[payload->owner_id]) {
+      return;
+    }
 
-        acked_counter[payload->owner_id][payload->packet_uid]++;
+    OwnerID owner_id = payload->owner_id;
+    PacketID packet_uid = payload->packet_uid;
+    bool spilled = spill != nullptr && spill->contains(owner_id, packet_uid);
+    if (undelivered[owner_id].count(packet_uid) == 0 && !spilled) {
+      // the next packet in line is about to be delivered, keep it at hand
+      if (spill == nullptr || packet_uid == received_up_to[owner_id] ||
+          !spill->is_over(undelivered_bytes) || !spill->put(payload)) {
+        log_payload = new payload_t;
+        copy_payload(log_payload, payload);
+        undelivered[owner_id][packet_uid] = log_payload;
+        undelivered_bytes += SpillStore::footprint(log_payload);
+      }
+    }
 
-        if (acked_counter[payload->owner_id][payload->packet_uid] == 1) {
-          log_payload = new payload_t;
-          copy_payload(log_payload, payload, keys);
-          undelivered[payload->owner_id][payload->packet_uid] = log_payload;
-        }
+    deliver_pending_unsafe(payload->owner_id);
+  }
+
+  // Applies a digest of `sender_id`: for every owner, it holds all packets
+  // below `watermarks[owner]`
+  void insert_digest(SenderID sender_id, uint32_t *watermarks) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    for (uint32_t owner_id = 1; owner_id <= keys; owner_id++) {
+      if (watermarks[owner_id] <= watermark(sender_id, owner_id)) {
+        continue;
       }
+      advance_watermark_unsafe(sender_id, owner_id, watermarks[owner_id]);
+      deliver_pending_unsafe(owner_id);
+    }
+  }
+
+  // Fills `watermarks` with the contiguous prefix of packets seen per owner
+  void digest(uint32_t *watermarks) {
+    std::lock_guard<std::mutex> lock(mtx);
+    watermarks[0] = 0;
+    for (uint32_t owner_id = 1; owner_id <= keys; owner_id++) {
+      watermarks[owner_id] = watermark(current_node->id, owner_id);
     }
+  }
 
-    if (received_up_to[payload->owner_id] == payload->packet_uid) {
-      for (uint32_t affected_node_id : (*causality)[payload->owner_id]) {
-        while (can_lcb_deliver(payload->vector_clock,
-                               affected_node_id)) {
-          uint32_t packet_uid = received_up_to[affected_node_id];
+  void request_digest() { digest_requested = true; }
 
-          log_payload = undelivered[affected_node_id][packet_uid];
-          deliverable->enqueue(log_payload);
-          undelivered[affected_node_id].erase(packet_uid);
-          acked_counter[affected_node_id].erase(packet_uid);
+  // Whether a digest was requested since the last call
+  bool take_digest_request() { return digest_requested.exchange(false); }
 
-          received_up_to[affected_node_id]++;
-          vector_clock[affected_node_id]++;
-        }
+  // Runs `function` with no delivery in progress, e.g. so a snapshot of
+  // vector_clock and the broadcast logged after it see the same deliveries
+  template <typename Function> void with_deliveries_held(Function function) {
+    std::lock_guard<std::mutex> lock(mtx);
+    function();
+  }
+
+  bool is_stable(payload_t *payload) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return payload->packet_uid < stable_up_to[payload->owner_id];
+  }
+
+  // Unlike is_stable, also waits for the processes given up on
+  bool is_held_by_all(payload_t *payload) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return payload->packet_uid < held_by_all_up_to[payload->owner_id];
+  }
+
+  // Excludes (or re-includes) a process from the credit check of new
+  // broadcasts. Stability still waits for it, so nothing it may lack is
+  // ever dropped
+  void set_suspected(SenderID sender_id, bool is_suspected) {
+    std::lock_guard<std::mutex> lock(mtx);
+    suspected[sender_id] = is_suspected;
+  }
+
+  // Excludes (or re-includes) a process from stability, so the packets only
+  // it lacks stop being kept around. Back, it only waits for what is still
+  // kept somewhere, see FailureDetector
+  void set_given_up(SenderID sender_id, bool is_given_up) {
+    std::lock_guard<std::mutex> lock(mtx);
+    given_up[sender_id] = is_given_up;
+    if (is_given_up) {
+      for (OwnerID owner_id = 1; owner_id <= keys; owner_id++) {
+        update_stability_unsafe(owner_id);
       }
     }
   }
 
+  // First packet of `owner_id` not known to be held by every process
+  PacketID stable_frontier(OwnerID owner_id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return stable_up_to[owner_id];
+  }
+
+  // Has our packets `sender_id` lacks resent from the log once its digest
+  // shows which
+  void request_catch_up(SenderID sender_id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    catching_up[sender_id] = true;
+  }
+
+  // Whether a catch up of `sender_id` was requested since the last call
+  bool take_catch_up(SenderID sender_id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    bool requested = catching_up[sender_id];
+    catching_up[sender_id] = false;
+    return requested;
+  }
+
+  // Packets of `owner_id` we accept are below this limit, so undelivered
+  // holds at most CREDIT_WINDOW payloads per owner
+  uint32_t advertised_credit(OwnerID owner_id) {
+    return received_up_to[owner_id] + CREDIT_WINDOW;
+  }
+
+  bool within_credit(OwnerID owner_id, PacketID packet_uid) {
+    return packet_uid < advertised_credit(owner_id);
+  }
+
+  void update_credit(SenderID peer_id, OwnerID owner_id, uint32_t limit) {
+    std::atomic<uint32_t> &credit = peer_credit[peer_id * (keys + 1) + owner_id];
+    uint32_t current = credit;
+    while (current < limit && !credit.compare_exchange_weak(current, limit)) {
+    }
+  }
+
+  bool has_credit(SenderID peer_id, OwnerID owner_id, PacketID packet_uid) {
+    return packet_uid < peer_credit[peer_id * (keys + 1) + owner_id];
+  }
+
+  // Whether every non-suspected process, us included, accepts the packet
+  bool may_broadcast(OwnerID owner_id, PacketID packet_uid) {
+    if (!within_credit(owner_id, packet_uid)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    for (uint32_t peer_id = 1; peer_id <= keys; peer_id++) {
+      if (peer_id != current_node->id && !suspected[peer_id] &&
+          !has_credit(peer_id, owner_id, packet_uid)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   bool contains(SenderID sender_id, payload_t *payload) {
     std::lock_guard<std::mutex> lock(mtx);
     return contains_unsafe(sender_id, payload);
   }
 
-  bool can_lcb_deliver(uint32_t *recv_vector_clock, uint32_t node_id) {
+  // First packet of `owner_id` not known to be held by `sender_id`
+  PacketID held_up_to(SenderID sender_id, OwnerID owner_id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return watermark(sender_id, owner_id);
+  }
+
+  bool holds(SenderID sender_id, OwnerID owner_id, PacketID packet_uid) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return contains_unsafe(sender_id, owner_id, packet_uid);
+  }
+
+  bool can_lcb_deliver(payload_t *payload, uint32_t node_id) {
     bool lcb_happy = true;
-    for (uint32_t dependency : (*causality)[node_id]) {
-      // TODO: VC on left side
-      if (vector_clock[dependency] < recv_vector_clock[dependency]) {
-        lcb_happy = false;
-        break;
+    uint32_t *recv_vector_clock = payload->vector_clock;
+    if (payload->sparse_clock) {
+      // only the dependencies that grew since the owner's previous packet,
+      // FIFO covers the others: most packets carry no pair at all. Only
+      // called on the next packet in line, once the previous one delivered
+      for (uint32_t i = 0; i + 1 < payload->vc_len; i += 2) {
+        // decoding rejects ids outside the membership, never index past it
+        if (recv_vector_clock[i] > keys ||
+            vector_clock[recv_vector_clock[i]] < recv_vector_clock[i + 1]) {
+          lcb_happy = false;
+          break;
+        }
+      }
+    } else {
+      for (uint32_t dependency : (*causality)[node_id]) {
+        if (dependency >= payload->vc_len) {
+          lcb_happy = false;
+          break;
+        }
+        // TODO: VC on left side
+        if (vector_clock[dependency] < recv_vector_clock[dependency]) {
+          lcb_happy = false;
+          break;
+        }
       }
     }
     bool urb_happy = can_urb_deliver(node_id, received_up_to[node_id]);
@@ -134,7 +519,7 @@ public:
     if (packet_uid < received_up_to[owner_id]) {
       return true;
     }
-    return acked_counter[owner_id][packet_uid] > (keys / 2);
+    return packet_uid < urb_frontier[owner_id];
   }
 
   void mark_as_seen(payload_t *payload) { insert(current_node->id, payload); }
@@ -0,0 +1,265 @@
+#ifndef FAILURE_DETECTOR
+#define FAILURE_DETECTOR
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "common.hpp"
+#include "delivered_set.hpp"
+#include "messages.hpp"
+#include "protocol_clock.hpp"
+
+#define HEARTBEAT_INTERVAL_MS 100
+// Suspected peers are only probed at this rate
+#define PROBE_INTERVAL_MS 1000
+#define FD_INITIAL_TIMEOUT_MS 1000
+// Added to a peer's timeout every time it turns out to be falsely suspected
+#define FD_TIMEOUT_INCREMENT_MS 500
+// A peer suspected for this long is given up on: no retransmission waits for
+// it anymore, and if it comes back it only catches up on what the owners
+// still log
+#define FD_GIVE_UP_MS 5000
+// Retransmissions parked at most, past it the oldest ones are dropped and
+// their peers catch up from the owners' logs once they come back
+#define FD_PARK_LIMIT 4096
+// Parked retransmissions checked per heartbeat
+#define FD_PRUNE_BATCH 256
+
+using namespace std::chrono; // noqa
+
+// Frees a parked entry whose peers all got its packet in the meantime, e.g.
+// relayed by someone else, and returns whether it did
+typedef std::function<bool(retransmission_t *)> HeldCheck;
+
+// Eventually perfect failure detector: every datagram counts as a heartbeat,
+// a peer silent for longer than its timeout is suspected and the timeout
+// grows each time a suspicion turns out to be wrong. One per process, shared
+// by all of its channels
+class FailureDetector {
+
+private:
+  uint32_t keys;
+  // the delivered sets of every channel, told about suspicions
+  std::vector<DeliveredSet *> watchers;
+
+  std::atomic<int64_t> *last_heard_ms;
+  std::atomic<bool> *suspected;
+  std::atomic<bool> *given_up;
+  // retransmissions were dropped without the peer getting them
+  std::atomic<bool> *lost;
+  int64_t *timeout_ms;
+  // bumped whenever a peer gets suspected or cleared
+  std::atomic<uint32_t> version;
+
+  // retransmissions only suspected peers wait for, oldest first, resent once
+  // one of them comes back
+  std::deque<retransmission_t *> parked;
+  mutable std::mutex mtx;
+
+  static int64_t now_ms() {
+    return duration_cast<milliseconds>(ProtocolClock::now().time_since_epoch())
+        .count();
+  }
+
+  // Stops waiting for `node_id` in the parked retransmissions, and frees the
+  // ones that are left waiting for no one
+  void give_up_unsafe(uint32_t node_id) {
+    given_up[node_id] = true;
+    lost[node_id] = true;
+    version++;
+
+    auto kept = parked.begin();
+    for (retransmission_t *retransmission : parked) {
+      retransmission->pending[node_id] = false;
+      if (waits_for_anyone(retransmission)) {
+        *kept++ = retransmission;
+      } else {
+        free_retransmission(retransmission);
+      }
+    }
+    parked.erase(kept, parked.end());
+  }
+
+  static bool waits_for_anyone(retransmission_t *retransmission) {
+    return std::find(retransmission->pending.begin(),
+                     retransmission->pending.end(),
+                     true) != retransmission->pending.end();
+  }
+
+public:
+  explicit FailureDetector(size_t keys_in) : watchers(), parked(), mtx() {
+    keys = static_cast<uint32_t>(keys_in);
+    last_heard_ms = new std::atomic<int64_t>[keys + 1];
+    suspected = new std::atomic<bool>[keys + 1];
+    given_up = new std::atomic<bool>[keys + 1];
+    lost = new std::atomic<bool>[keys + 1];
+    timeout_ms = new int64_t[keys + 1];
+    version = 0;
+
+    int64_t now = now_ms();
+    for (uint32_t node_id = 0; node_id <= keys; node_id++) {
+      last_heard_ms[node_id] = now;
+      suspected[node_id] = false;
+      given_up[node_id] = false;
+      lost[node_id] = false;
+      timeout_ms[node_id] = FD_INITIAL_TIMEOUT_MS;
+    }
+  }
+
+  ~FailureDetector() {
+    for (retransmission_t *retransmission : parked) {
+      free_retransmission(retransmission);
+    }
+    delete[] last_heard_ms;
+    delete[] suspected;
+    delete[] given_up;
+    delete[] lost;
+    delete[] timeout_ms;
+  }
+
+  // Not thread safe, to be called before the threads start
+  void watch(DeliveredSet *delivered) { watchers.push_back(delivered); }
+
+  bool is_suspected(uint32_t node_id) { return suspected[node_id]; }
+
+  bool is_given_up(uint32_t node_id) { return given_up[node_id]; }
+
+  uint32_t membership_version() { return version; }
+
+  size_t parked_count() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return parked.size();
+  }
+
+  // Records liveness of `node_id`, returns the retransmissions parked for it
+  // if it was suspected until now
+  std::vector<retransmission_t *> heard_from(uint32_t node_id) {
+    last_heard_ms[node_id] = now_ms();
+    if (!suspected[node_id]) {
+      return {};
+    }
+
+    std::vector<retransmission_t *> resumed;
+    bool missed;
+    bool was_given_up;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!suspected[node_id]) {
+        return {};
+      }
+      suspected[node_id] = false;
+      was_given_up = given_up[node_id].exchange(false);
+      missed = lost[node_id].exchange(false);
+      version++;
+      timeout_ms[node_id] += FD_TIMEOUT_INCREMENT_MS;
+
+      auto kept = parked.begin();
+      for (retransmission_t *retransmission : parked) {
+        if (retransmission->pending[node_id]) {
+          resumed.push_back(retransmission);
+        } else {
+          *kept++ = retransmission;
+        }
+      }
+      parked.erase(kept, parked.end());
+    }
+
+    if (DEBUG)
+      std::cout << "Node " << node_id << " is alive again\n";
+    for (DeliveredSet *delivered : watchers) {
+      delivered->set_suspected(node_id, false);
+      if (was_given_up) {
+        delivered->set_given_up(node_id, false);
+      }
+      if (missed) {
+        delivered->request_catch_up(node_id);
+      }
+    }
+    return resumed;
+  }
+
+  // Suspects every peer whose timeout expired, and gives up on those
+  // suspected for FD_GIVE_UP_MS
+  void check(uint32_t current_node_id) {
+    int64_t now = now_ms();
+
+    for (uint32_t node_id = 1; node_id <= keys; node_id++) {
+      if (node_id == current_node_id || given_up[node_id]) {
+        continue;
+      }
+      bool suspecting = false;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        int64_t silent_ms = now - last_heard_ms[node_id];
+        if (!suspected[node_id] && silent_ms > timeout_ms[node_id]) {
+          suspected[node_id] = true;
+          suspecting = true;
+          version++;
+        } else if (suspected[node_id] &&
+                   silent_ms > timeout_ms[node_id] + FD_GIVE_UP_MS) {
+          give_up_unsafe(node_id);
+        } else {
+          continue;
+        }
+      }
+
+      if (DEBUG)
+        std::cout << (suspecting ? "Suspecting node " : "Giving up on node ")
+                  << node_id << "\n";
+      for (DeliveredSet *delivered : watchers) {
+        if (suspecting) {
+          delivered->set_suspected(node_id, true);
+        } else {
+          delivered->set_given_up(node_id, true);
+        }
+      }
+    }
+  }
+
+  // Holds a retransmission until one of the peers it waits for comes back.
+  // Returns false if one of them is not suspected anymore
+  bool park(retransmission_t *retransmission) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (uint32_t node_id = 1; node_id <= keys; node_id++) {
+      if (retransmission->pending[node_id] && !suspected[node_id]) {
+        return false;
+      }
+    }
+
+    if (parked.size() >= FD_PARK_LIMIT) {
+      retransmission_t *oldest = parked.front();
+      parked.pop_front();
+      for (uint32_t node_id = 1; node_id <= keys; node_id++) {
+        if (oldest->pending[node_id]) {
+          lost[node_id] = true;
+        }
+      }
+      free_retransmission(oldest);
+    }
+    parked.push_back(retransmission);
+    return true;
+  }
+
+  // Drops parked retransmissions their peers turned out to hold, checking
+  // FD_PRUNE_BATCH of them per call in turn. Anything else is kept for as
+  // long as its peers stay suspected
+  void prune_parked(const HeldCheck &held) {
+    std::lock_guard<std::mutex> lock(mtx);
+    size_t batch = std::min<size_t>(FD_PRUNE_BATCH, parked.size());
+    for (size_t checked = 0; checked < batch; checked++) {
+      retransmission_t *retransmission = parked.front();
+      parked.pop_front();
+      if (!held(retransmission)) {
+        parked.push_back(retransmission);
+      }
+    }
+  }
+};
+
+#endif
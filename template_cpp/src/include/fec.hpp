@@ -0,0 +1,264 @@
+#ifndef FEC_CODEC
+#define FEC_CODEC
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "protocol_clock.hpp"
+
+// sender id, group id, index in group, flags
+#define FEC_HEADER_SIZE 10
+#define FEC_FLAG_PARITY 0x01
+#define FEC_FLAG_MULTICAST 0x02
+
+// Bounds of the number of datagrams covered by one parity datagram
+#define FEC_MIN_GROUP 4
+#define FEC_MAX_GROUP 16
+// Sends per peer between two adaptations of the group size
+#define FEC_ADAPT_WINDOW 256
+// Partial groups older than this get their parity sent anyway
+#define FEC_FLUSH_MS 20
+// Groups per stream kept by the receiver waiting for their parity
+#define FEC_WINDOW_GROUPS 8
+
+using namespace std::chrono; // noqa
+
+typedef struct {
+  node_t *recipient;
+  uint32_t group_id;
+  uint8_t index;
+  uint8_t group_size;
+  std::vector<char> parity;
+  steady_clock::time_point group_start;
+  uint32_t sends;
+  uint32_t losses;
+} fec_stream_t;
+
+typedef struct {
+  uint8_t received;
+  bool done;
+  std::vector<char> parity;
+} fec_group_t;
+
+// XOR parity over groups of consecutive datagrams sent to the same peer: a
+// receiver missing exactly one datagram of a group rebuilds it from the
+// parity, without waiting for a retransmission
+class FecCodec {
+
+private:
+  uint32_t sender_id;
+  std::unordered_map<uint32_t, fec_stream_t> streams;
+  std::unordered_map<uint64_t, std::unordered_map<uint32_t, fec_group_t>>
+      groups;
+  mutable std::mutex send_mtx;
+  mutable std::mutex recv_mtx;
+
+  // XORs the length-prefixed datagram into `parity`
+  static void accumulate(std::vector<char> &parity, const char *datagram,
+                         uint16_t len) {
+    if (parity.size() < static_cast<size_t>(len) + 2) {
+      parity.resize(static_cast<size_t>(len) + 2, 0);
+    }
+    parity[0] = static_cast<char>(parity[0] ^ static_cast<char>(len & 0xff));
+    parity[1] = static_cast<char>(parity[1] ^ static_cast<char>(len >> 8));
+    for (uint16_t i = 0; i < len; i++) {
+      parity[i + 2] = static_cast<char>(parity[i + 2] ^ datagram[i]);
+    }
+  }
+
+  static void write_header(char *buffer, uint32_t sender, uint32_t group_id,
+                           uint8_t index, uint8_t flags) {
+    memcpy(buffer, &sender, 4);
+    memcpy(buffer + 4, &group_id, 4);
+    memcpy(buffer + 8, &index, 1);
+    memcpy(buffer + 9, &flags, 1);
+  }
+
+  static uint8_t stream_flags(node_t *recipient) {
+    return recipient->id == 0 ? FEC_FLAG_MULTICAST : 0;
+  }
+
+  // Roughly one loss per two groups, within the configured bounds
+  static uint8_t group_size_for(uint32_t sends, uint32_t losses) {
+    if (losses == 0) {
+      return FEC_MAX_GROUP;
+    }
+    uint32_t size = sends / (2 * losses);
+    return static_cast<uint8_t>(
+        std::min<uint32_t>(FEC_MAX_GROUP, std::max<uint32_t>(FEC_MIN_GROUP, size)));
+  }
+
+  // Writes the parity datagram of the stream's current group into `out` and
+  // starts the next group
+  ssize_t close_group_unsafe(fec_stream_t &stream, char *out) {
+    write_header(out, sender_id, stream.group_id, stream.index,
+                 static_cast<uint8_t>(FEC_FLAG_PARITY |
+                                      stream_flags(stream.recipient)));
+    memcpy(out + FEC_HEADER_SIZE, stream.parity.data(), stream.parity.size());
+    ssize_t len =
+        static_cast<ssize_t>(FEC_HEADER_SIZE + stream.parity.size());
+
+    stream.group_id++;
+    stream.index = 0;
+    stream.parity.clear();
+
+    if (stream.sends >= FEC_ADAPT_WINDOW) {
+      stream.group_size = group_size_for(stream.sends, stream.losses);
+      stream.sends = 0;
+      stream.losses = 0;
+    }
+    return len;
+  }
+
+public:
+  explicit FecCodec(uint32_t sender_id_in)
+      : streams(), groups(), send_mtx(), recv_mtx() {
+    sender_id = sender_id_in;
+  }
+
+  // Fills the FEC header in front of the `len` bytes long datagram at
+  // `buffer + FEC_HEADER_SIZE`, returns the length of the parity datagram
+  // written into `parity_out` if this closed a group, 0 otherwise
+  ssize_t encode(node_t *recipient, char *buffer, ssize_t len,
+                 char *parity_out) {
+    std::lock_guard<std::mutex> lock(send_mtx);
+    auto it = streams.find(recipient->id);
+    if (it == streams.end()) {
+      fec_stream_t stream;
+      stream.recipient = recipient;
+      stream.group_id = 0;
+      stream.index = 0;
+      stream.group_size = FEC_MAX_GROUP;
+      stream.sends = 0;
+      stream.losses = 0;
+      it = streams.emplace(recipient->id, stream).first;
+    }
+    fec_stream_t &stream = it->second;
+
+    if (stream.index == 0) {
+      stream.group_start = ProtocolClock::now();
+    }
+    write_header(buffer, sender_id, stream.group_id, stream.index,
+                 stream_flags(recipient));
+    accumulate(stream.parity, buffer + FEC_HEADER_SIZE,
+               static_cast<uint16_t>(len));
+    stream.index++;
+    stream.sends++;
+
+    if (stream.index < stream.group_size) {
+      return 0;
+    }
+    return close_group_unsafe(stream, parity_out);
+  }
+
+  // Feeds the loss estimate that drives the group size
+  void note_loss(uint32_t recipient_id) {
+    std::lock_guard<std::mutex> lock(send_mtx);
+    auto it = streams.find(recipient_id);
+    if (it != streams.end()) {
+      it->second.losses++;
+    }
+  }
+
+  // Closes groups that have been waiting for too long, so the tail of a burst
+  // is protected as well; `send` gets the recipient and the parity datagram
+  template <typename F> void flush(F send) {
+    std::vector<std::pair<node_t *, std::vector<char>>> parities;
+    char buffer[IP_MAXPACKET];
+    steady_clock::time_point now = ProtocolClock::now();
+    {
+      std::lock_guard<std::mutex> lock(send_mtx);
+      for (auto &entry : streams) {
+        fec_stream_t &stream = entry.second;
+        if (stream.index == 0 ||
+            now - stream.group_start < milliseconds(FEC_FLUSH_MS)) {
+          continue;
+        }
+        ssize_t len = close_group_unsafe(stream, buffer);
+        parities.emplace_back(stream.recipient,
+                              std::vector<char>(buffer, buffer + len));
+      }
+    }
+    for (auto &parity : parities) {
+      send(parity.first, parity.second.data(),
+           static_cast<ssize_t>(parity.second.size()));
+    }
+  }
+
+  // Strips the FEC header of the received datagram in `buffer`, moving the
+  // inner datagram to its front. A parity datagram is replaced by the datagram
+  // it recovers. Returns the inner length, or -1 if there is nothing to decode
+  ssize_t decode(char *buffer, ssize_t len) {
+    if (len < FEC_HEADER_SIZE) {
+      return -1;
+    }
+    uint32_t sender;
+    uint32_t group_id;
+    uint8_t index;
+    uint8_t flags;
+    memcpy(&sender, buffer, 4);
+    memcpy(&group_id, buffer + 4, 4);
+    memcpy(&index, buffer + 8, 1);
+    memcpy(&flags, buffer + 9, 1);
+
+    uint64_t stream_key = (static_cast<uint64_t>(sender) << 1) |
+                          ((flags & FEC_FLAG_MULTICAST) ? 1 : 0);
+    ssize_t inner_len = len - FEC_HEADER_SIZE;
+    char *inner = buffer + FEC_HEADER_SIZE;
+
+    std::lock_guard<std::mutex> lock(recv_mtx);
+    std::unordered_map<uint32_t, fec_group_t> &stream_groups =
+        groups[stream_key];
+
+    // forget groups whose parity will not come anymore
+    for (auto it = stream_groups.begin(); it != stream_groups.end();) {
+      bool stale = group_id >= FEC_WINDOW_GROUPS &&
+                   it->first < group_id - FEC_WINDOW_GROUPS;
+      it = stale ? stream_groups.erase(it) : std::next(it);
+    }
+    fec_group_t &group = stream_groups[group_id];
+
+    if (!(flags & FEC_FLAG_PARITY)) {
+      if (!group.done) {
+        accumulate(group.parity, inner, static_cast<uint16_t>(inner_len));
+        group.received++;
+      }
+      memmove(buffer, inner, static_cast<size_t>(inner_len));
+      return inner_len;
+    }
+
+    // for parity datagrams `index` is the size of the group
+    if (group.done || group.received + 1 != index) {
+      group.done = true;
+      return -1; // nothing lost, or too much lost
+    }
+    group.done = true;
+
+    std::vector<char> &recovered = group.parity;
+    recovered.resize(std::max(recovered.size(), static_cast<size_t>(inner_len)),
+                     0);
+    for (ssize_t i = 0; i < inner_len; i++) {
+      recovered[i] = static_cast<char>(recovered[i] ^ inner[i]);
+    }
+    uint16_t recovered_len =
+        static_cast<uint16_t>(static_cast<uint8_t>(recovered[0]) |
+                              (static_cast<uint8_t>(recovered[1]) << 8));
+    if (static_cast<size_t>(recovered_len) + 2 > recovered.size()) {
+      return -1;
+    }
+
+    if (DEBUG)
+      std::cout << "FEC recovered a datagram from " << sender << "\n";
+    memcpy(buffer, recovered.data() + 2, recovered_len);
+    return recovered_len;
+  }
+};
+
+#endif
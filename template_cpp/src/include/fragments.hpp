@@ -0,0 +1,177 @@
+#ifndef FRAGMENTER
+#define FRAGMENTER
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "common.hpp"
+#include "messages.hpp"
+#include "protocol_clock.hpp"
+
+// Datagrams carrying a fragment stay below the Ethernet MTU, FEC included
+#define FRAGMENT_DATAGRAM_SIZE 1400
+// index, count and total size of the serialized payload
+#define FRAGMENT_HEADER_SIZE 12
+#define FRAGMENT_CHUNK_SIZE                                                    \
+  (FRAGMENT_DATAGRAM_SIZE - PAYLOAD_META_SIZE - FRAGMENT_HEADER_SIZE)
+// Largest serialized payload accepted for reassembly
+#define FRAGMENT_MAX_TOTAL (64 * MILLION)
+// State of a message untouched for this long is dropped
+#define FRAGMENT_TIMEOUT_MS 10000
+
+using namespace std::chrono; // noqa
+
+// peer, owner, packet uid
+typedef std::tuple<uint32_t, uint32_t, uint32_t> FragmentKey;
+
+typedef struct {
+  std::vector<bool> acked;
+  steady_clock::time_point touched;
+} fragment_progress_t;
+
+typedef struct {
+  std::vector<char> data;
+  std::vector<bool> received;
+  uint32_t missing;
+  steady_clock::time_point touched;
+} reassembly_t;
+
+// Splits payloads larger than a datagram into fragments. Receivers ack every
+// fragment, so retransmissions only resend the missing ones, and write them
+// straight at their offset in a buffer sized for the whole payload
+class Fragmenter {
+
+private:
+  std::map<FragmentKey, fragment_progress_t> sent;
+  std::map<FragmentKey, reassembly_t> partial;
+  mutable std::mutex send_mtx;
+  mutable std::mutex recv_mtx;
+
+  template <typename T> static void sweep_unsafe(std::map<FragmentKey, T> &map) {
+    steady_clock::time_point now = ProtocolClock::now();
+    for (auto it = map.begin(); it != map.end();) {
+      bool stale = now - it->second.touched > milliseconds(FRAGMENT_TIMEOUT_MS);
+      it = stale ? map.erase(it) : std::next(it);
+    }
+  }
+
+public:
+  Fragmenter() : sent(), partial(), send_mtx(), recv_mtx() {}
+
+  static bool is_fragmented(payload_t *payload) {
+    return !payload->is_ack && !payload->is_nack && !payload->is_digest &&
+           !payload->is_heartbeat &&
+           encoded_size(payload) > FRAGMENT_DATAGRAM_SIZE;
+  }
+
+  static ssize_t encoded_size(payload_t *payload) {
+    return PAYLOAD_META_SIZE + payload->buff_size + payload->vc_len * 4;
+  }
+
+  static uint32_t fragment_count(ssize_t total) {
+    return static_cast<uint32_t>((total + FRAGMENT_CHUNK_SIZE - 1) /
+                                 FRAGMENT_CHUNK_SIZE);
+  }
+
+  // Fragments of `payload` the recipient has not acked yet
+  std::vector<uint32_t> missing(uint32_t recipient_id, payload_t *payload,
+                                uint32_t count) {
+    std::lock_guard<std::mutex> lock(send_mtx);
+    FragmentKey key(recipient_id, payload->owner_id, payload->packet_uid);
+    fragment_progress_t &progress = sent[key];
+    progress.touched = ProtocolClock::now();
+    if (progress.acked.size() != count) {
+      progress.acked.assign(count, false);
+    }
+
+    std::vector<uint32_t> indexes;
+    for (uint32_t index = 0; index < count; index++) {
+      if (!progress.acked[index]) {
+        indexes.push_back(index);
+      }
+    }
+    return indexes;
+  }
+
+  void acked(uint32_t recipient_id, payload_t *ack) {
+    uint32_t index;
+    if (ack->buff_size < 4) {
+      return;
+    }
+    memcpy(&index, ack->buffer, 4);
+
+    std::lock_guard<std::mutex> lock(send_mtx);
+    auto it = sent.find(FragmentKey(recipient_id, ack->owner_id,
+                                    ack->packet_uid));
+    if (it != sent.end() && index < it->second.acked.size()) {
+      it->second.acked[index] = true;
+    }
+  }
+
+  void forget(uint32_t recipient_id, payload_t *payload) {
+    std::lock_guard<std::mutex> lock(send_mtx);
+    sent.erase(FragmentKey(recipient_id, payload->owner_id,
+                           payload->packet_uid));
+  }
+
+  // Adds a received fragment, fills `whole` with the serialized payload once
+  // every fragment arrived. Returns false until then
+  bool add(payload_t *fragment, std::vector<char> &whole) {
+    uint32_t index, count, total;
+    if (fragment->buff_size < FRAGMENT_HEADER_SIZE) {
+      return false;
+    }
+    memcpy(&index, fragment->buffer, 4);
+    memcpy(&count, fragment->buffer + 4, 4);
+    memcpy(&total, fragment->buffer + 8, 4);
+    const char *chunk = fragment->buffer + FRAGMENT_HEADER_SIZE;
+    size_t chunk_len =
+        static_cast<size_t>(fragment->buff_size - FRAGMENT_HEADER_SIZE);
+    size_t offset = static_cast<size_t>(index) * FRAGMENT_CHUNK_SIZE;
+
+    if (total > FRAGMENT_MAX_TOTAL || count != fragment_count(total) ||
+        index >= count || offset + chunk_len > total) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(recv_mtx);
+    FragmentKey key(fragment->sender_id, fragment->owner_id,
+                    fragment->packet_uid);
+    reassembly_t &reassembly = partial[key];
+    reassembly.touched = ProtocolClock::now();
+    if (reassembly.data.size() != total) {
+      reassembly.data.assign(total, 0);
+      reassembly.received.assign(count, false);
+      reassembly.missing = count;
+    }
+    if (reassembly.received[index]) {
+      return false;
+    }
+    reassembly.received[index] = true;
+    reassembly.missing--;
+    memcpy(reassembly.data.data() + offset, chunk, chunk_len);
+
+    if (reassembly.missing > 0) {
+      return false;
+    }
+    whole.swap(reassembly.data);
+    partial.erase(key);
+    return true;
+  }
+
+  // Drops state of messages abandoned by their sender or receiver
+  void sweep() {
+    {
+      std::lock_guard<std::mutex> lock(send_mtx);
+      sweep_unsafe(sent);
+    }
+    std::lock_guard<std::mutex> lock(recv_mtx);
+    sweep_unsafe(partial);
+  }
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef GSO_BATCHER
+#define GSO_BATCHER
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <netinet/udp.h>
+#include <stdexcept>
+
+#include "common.hpp"
+#include "udp.hpp"
+#include "uring.hpp"
+
+// Kernel limit on the segments of one send
+#define GSO_MAX_SEGMENTS 64
+// Larger datagrams would need IP fragmentation on an Ethernet link
+#define GSO_MAX_SEGMENT_SIZE 1472
+// UDP payload limit of the whole batch, IPv4 and UDP headers excluded
+#define GSO_MAX_BYTES (IP_MAXPACKET - 28)
+
+// Collects consecutive datagrams towards the same peer into one buffer the
+// kernel splits back into equal-sized segments (UDP_SEGMENT). A shorter
+// datagram can only close a batch. Without kernel support every datagram is
+// sent on its own. Batches go through the io_uring backend when it is active
+class GsoBatcher {
+
+private:
+  int sockfd;
+  UringLink *uring;
+  bool supported;
+  node_t *recipient;
+  uint16_t segment_size;
+  uint32_t segments;
+  ssize_t len;
+  bool closed;
+  char buffer[IP_MAXPACKET];
+  mutable std::mutex mtx;
+
+  // Returns false if the peer is unreachable
+  static bool check_sent(ssize_t sent, ssize_t expected) {
+    if (sent == expected) {
+      return true;
+    }
+    if (errno == ENOTCONN || errno == ENETUNREACH || errno == EHOSTUNREACH) {
+      return false;
+    }
+    std::cout << "\nERRNO: " << errno << "\n";
+    throw std::runtime_error("sendto error");
+  }
+
+  ssize_t transmit_unsafe(node_t *receiver, const char *datagram,
+                          ssize_t datagram_len, uint16_t gso_size = 0) {
+    if (uring->is_active()) {
+      return uring->queue_send(receiver, datagram, datagram_len, gso_size);
+    }
+    return send_udp_packet(sockfd, receiver, datagram, datagram_len, gso_size);
+  }
+
+  void flush_unsafe() {
+    if (segments == 0) {
+      return;
+    }
+    uint16_t gso_size = segments > 1 ? segment_size : 0;
+    ssize_t sent = transmit_unsafe(recipient, buffer, len, gso_size);
+
+    if (sent < 0 && gso_size > 0 && (errno == EIO || errno == EINVAL)) {
+      // the device cannot segment, e.g. no checksum offload
+      supported = false;
+      if (DEBUG)
+        std::cout << "UDP GSO unavailable, sending datagrams one by one\n";
+      for (ssize_t offset = 0; offset < len; offset += segment_size) {
+        ssize_t size = std::min<ssize_t>(segment_size, len - offset);
+        check_sent(transmit_unsafe(recipient, buffer + offset, size), size);
+      }
+    } else {
+      check_sent(sent, len);
+    }
+
+    segments = 0;
+    len = 0;
+    closed = false;
+  }
+
+public:
+  GsoBatcher(int sockfd_in, UringLink *uring_in) : mtx() {
+    sockfd = sockfd_in;
+    uring = uring_in;
+    recipient = nullptr;
+    segment_size = 0;
+    segments = 0;
+    len = 0;
+    closed = false;
+
+    int gso_size = 0;
+    socklen_t option_len = sizeof(gso_size);
+    supported = UDP_OFFLOAD && getsockopt(sockfd, SOL_UDP, UDP_SEGMENT,
+                                          &gso_size, &option_len) == 0;
+    if (DEBUG && UDP_OFFLOAD && !supported)
+      std::cout << "UDP GSO is not supported by the kernel\n";
+  }
+
+  bool is_supported() { return supported; }
+
+  // Queues the datagram, sending the pending batch first if the datagram
+  // cannot join it. Returns false if the peer is unreachable
+  bool send(node_t *receiver, const char *datagram, ssize_t datagram_len) {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    if (!supported || datagram_len > GSO_MAX_SEGMENT_SIZE) {
+      flush_unsafe(); // keep the order of the datagrams
+      return check_sent(transmit_unsafe(receiver, datagram, datagram_len),
+                        datagram_len);
+    }
+
+    if (segments > 0 &&
+        (receiver != recipient || closed || datagram_len > segment_size ||
+         segments == GSO_MAX_SEGMENTS || len + datagram_len > GSO_MAX_BYTES)) {
+      flush_unsafe();
+    }
+    if (segments == 0) {
+      recipient = receiver;
+      segment_size = static_cast<uint16_t>(datagram_len);
+    }
+
+    memcpy(buffer + len, datagram, static_cast<size_t>(datagram_len));
+    len += datagram_len;
+    segments++;
+    closed = datagram_len < segment_size;
+    return true;
+  }
+
+  // Hands the pending batch to the kernel
+  void flush() {
+    std::lock_guard<std::mutex> lock(mtx);
+    flush_unsafe();
+    if (uring->is_active()) {
+      uring->submit_sends();
+    }
+  }
+};
+
+#endif
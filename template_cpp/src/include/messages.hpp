@@ -1,7 +1,9 @@
 #ifndef _MESSAGES_H_
 #define _MESSAGES_H_
 
+#include <atomic>
 #include <chrono>
+#include <ostream>
 #include <string>
 #include <utility>
 #include <vector>
@@ -11,7 +13,19 @@
 
 using namespace std::chrono; // noqa
 
-#define PAYLOAD_META_SIZE 13
+// uid, sender, owner, flags, credit, clock length and channel
+#define PAYLOAD_META_SIZE 21
+
+// Bits of the flags byte in the payload header
+#define FLAG_ACK 0x01
+#define FLAG_DIGEST 0x02
+#define FLAG_HEARTBEAT 0x04
+#define FLAG_SPARSE_CLOCK 0x08
+#define FLAG_FRAGMENT 0x10
+// the body after the header is LZ compressed, see compression.hpp
+#define FLAG_COMPRESSED 0x20
+// lists packet ids of the owner the sender is missing, see nack.hpp
+#define FLAG_NACK 0x40
 
 struct tcp_handler_s;
 
@@ -21,30 +35,80 @@ typedef struct {
   uint32_t packet_uid;
   uint32_t sender_id;
   bool is_ack = false;
+  bool is_digest = false;
+  bool is_heartbeat = false;
+  bool is_nack = false;
+  // a slice of a larger payload, see fragments.hpp
+  bool is_fragment = false;
+  // on ACKs, the receiver's credit limit for packets of this owner
+  uint32_t credit = 0;
+  // broadcast channel of the payload, see tcp_handler_t::channels
+  uint16_t channel_id = 0;
+  // one value per process if dense, otherwise (process, value) pairs over
+  // the dependencies of the owner that grew since its previous packet;
+  // vc_len counts the words either way
+  bool sparse_clock = false;
+  uint32_t vc_len = 0;
   uint32_t *vector_clock;
   char *buffer;
 } payload_t;
 
+// A packet on its way to the peers that do not hold it yet. Its sends towards
+// each of them share the one payload, and it goes back to the
+// retransmission queue once none of them is queued anymore
 typedef struct {
   payload_t *payload;
-  node_t *recipient;
+  // by peer id, the peers not known to hold the packet
+  std::vector<bool> pending;
+  // by peer id, the peers it was never sent to, e.g. held back relays
+  std::vector<bool> unsent;
   steady_clock::time_point sending_time;
-  bool first_send = false;
+  // rounds a delayed relay was held back for other repairers, see overlay.hpp
+  uint32_t deferrals = 0;
+  // its queued sends, plus one while someone schedules them
+  std::atomic<uint32_t> in_flight{0};
+} retransmission_t;
+
+typedef struct {
+  payload_t *payload;
+  node_t *recipient;
+  // set if the payload is borrowed from a retransmission entry
+  retransmission_t *retransmission = nullptr;
 } message_t;
 
-typedef SafeQueue<message_t *> MessagesQueue;
+typedef SafeQueue<retransmission_t *> RetransmissionQueue;
 typedef SafeQueue<payload_t *> PayloadQueue;
 
 std::string buff_as_str(char *buffer, ssize_t size);
 
 ssize_t encode_udp_payload(struct tcp_handler_s *h, payload_t *payload,
                            char *buffer, ssize_t buff_size);
-void decode_udp_payload(struct tcp_handler_s *h, payload_t *payload,
+// Returns false, leaving nothing allocated, for a datagram that is truncated
+// or names processes or clock entries outside the membership
+bool decode_udp_payload(struct tcp_handler_s *h, payload_t *payload,
                         char *buffer, size_t datagram_len);
+bool is_valid_payload(struct tcp_handler_s *h, payload_t *payload,
+                      ssize_t buff_size, const char *clock);
+ssize_t encode_fragment(payload_t *payload, const char *whole, uint32_t total,
+                        uint32_t index, char *buffer);
 
-void copy_payload(payload_t *dest, payload_t *source, uint32_t vc_size);
+void copy_payload(payload_t *dest, payload_t *source);
+// Sets the clock of a new packet to the dependencies that grew past
+// `carried`, the clock of the owner's previous packets, and updates it. A
+// packet broadcast with nothing delivered in between carries an empty clock
+void project_vector_clock(payload_t *payload, uint32_t *vector_clock,
+                          std::vector<uint32_t> &dependencies,
+                          uint32_t vc_size, uint32_t *carried);
+void clear_vector_clock(payload_t *payload);
+void show_payload_clock(payload_t *payload);
 void free_payload(payload_t *payload);
 void free_message(message_t *message);
+void free_retransmission(retransmission_t *retransmission);
+// Writes and frees the queued broadcasts ("b M") then deliveries ("d P M")
+// in the format of the output file, leaving the last `until_size` deliveries
+// queued
+void write_output(std::ostream &output, PayloadQueue *broadcasted,
+                  PayloadQueue *deliverable, uint32_t until_size);
 
 void show_payload(payload_t *payload, struct tcp_handler_s *h);
 
@@ -0,0 +1,135 @@
+#ifndef NACK_RELIABILITY
+#define NACK_RELIABILITY
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "common.hpp"
+#include "delivered_set.hpp"
+#include "messages.hpp"
+
+// Packet ids carried by one NACK
+#define NACK_MAX_UIDS 256
+// Without ACKs a peer's digest only shows the prefix it holds, so on timeout
+// only packets this close to that prefix are resent: the first one covers a
+// lost NACK, the others a lost tail. The rest wait for the prefix to move
+#define NACK_TAIL_WINDOW 16
+// Packets an owner sends after a skipped one before it is NACKed: several
+// sender or receiver threads, or the network, may swap a few of them
+#define NACK_REORDER_WINDOW 8
+// Packets kept past stability for processes the failure detector gave up
+// on, what they lack beyond it is lost to them if they ever come back
+#define SENT_LOG_LIMIT (MILLION / 10)
+
+// Spots the packets an owner sent us first-hand that never arrived: the
+// owner sends its packets to each peer in id order, so an id skipped between
+// two arrivals was lost on the way, is still queued behind a retransmission,
+// or was overtaken by a few later ones. It is only reported once the owner
+// got NACK_REORDER_WINDOW packets further without it showing up
+class GapDetector {
+
+private:
+  // highest packet id received from each owner itself
+  std::vector<PacketID> highest;
+  // ids each owner skipped, not reported yet
+  std::vector<std::set<PacketID>> skipped_ids;
+  mutable std::mutex mtx;
+
+public:
+  explicit GapDetector(size_t keys)
+      : highest(keys + 1, 0), skipped_ids(keys + 1), mtx() {}
+
+  // Records `packet_uid` from its owner, returns the ids skipped long enough
+  // ago to count as lost
+  std::vector<PacketID> skipped(OwnerID owner_id, PacketID packet_uid) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::set<PacketID> &waiting = skipped_ids[owner_id];
+    waiting.erase(packet_uid);
+    for (PacketID uid = highest[owner_id] + 1; uid < packet_uid; uid++) {
+      waiting.insert(waiting.end(), uid);
+    }
+    highest[owner_id] = std::max(highest[owner_id], packet_uid);
+
+    std::vector<PacketID> missing;
+    while (!waiting.empty() &&
+           *waiting.begin() + NACK_REORDER_WINDOW <= highest[owner_id]) {
+      missing.push_back(*waiting.begin());
+      waiting.erase(waiting.begin());
+    }
+    return missing;
+  }
+};
+
+// Our own packets, kept until stable so NACKed ones, or the ones a peer
+// missed while it was given up on, can be resent
+class SentLog {
+
+private:
+  std::map<PacketID, payload_t *> packets;
+  mutable std::mutex mtx;
+
+public:
+  SentLog() : packets(), mtx() {}
+
+  ~SentLog() {
+    for (auto &entry : packets) {
+      free_payload(entry.second);
+    }
+  }
+
+  void record(payload_t *payload) {
+    payload_t *copy = new payload_t;
+    copy_payload(copy, payload);
+    std::lock_guard<std::mutex> lock(mtx);
+    packets[payload->packet_uid] = copy;
+  }
+
+  // A copy of the packet, nullptr if it is not kept anymore
+  payload_t *copy(PacketID packet_uid) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = packets.find(packet_uid);
+    if (it == packets.end()) {
+      return nullptr;
+    }
+    payload_t *copy = new payload_t;
+    copy_payload(copy, it->second);
+    return copy;
+  }
+
+  // Copies of the packets from `packet_uid` on that are still kept
+  std::vector<payload_t *> copy_from(PacketID packet_uid) {
+    std::lock_guard<std::mutex> lock(mtx);
+    std::vector<payload_t *> copies;
+    for (auto it = packets.lower_bound(packet_uid); it != packets.end(); ++it) {
+      payload_t *copy = new payload_t;
+      copy_payload(copy, it->second);
+      copies.push_back(copy);
+    }
+    return copies;
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return packets.size();
+  }
+
+  // Drops the packets every process has. Those only given up processes lack
+  // are kept for their catch up, SENT_LOG_LIMIT of them at most
+  void prune(DeliveredSet *delivered) {
+    std::lock_guard<std::mutex> lock(mtx);
+    while (!packets.empty()) {
+      payload_t *oldest = packets.begin()->second;
+      if (!delivered->is_held_by_all(oldest) &&
+          (packets.size() <= SENT_LOG_LIMIT || !delivered->is_stable(oldest))) {
+        break;
+      }
+      free_payload(oldest);
+      packets.erase(packets.begin());
+    }
+  }
+};
+
+#endif
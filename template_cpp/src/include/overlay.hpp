@@ -0,0 +1,159 @@
+#ifndef DISSEMINATION_OVERLAY_H
+#define DISSEMINATION_OVERLAY_H
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "failure_detector.hpp"
+
+// Children per tree node, or peers pushed to per gossip round
+#ifndef OVERLAY_FANOUT
+#define OVERLAY_FANOUT 4
+#endif
+// Retransmission rounds the other processes wait for the designated
+// repairers of a peer before relaying to it themselves
+#define OVERLAY_FALLBACK_ROUNDS 4
+
+enum OverlayMode {
+  OVERLAY_OFF = 0, // every process relays to every peer
+  OVERLAY_TREE,
+  OVERLAY_GOSSIP
+};
+
+static const char *const OVERLAY_NAMES[] = {"off", "tree", "gossip"};
+
+// Picks the peers a process forwards a new packet to straight away, so each
+// process sends O(fanout) copies instead of O(n):
+//  - tree: a `fanout`-ary spanning tree rooted at the owner, laid over the
+//    live processes in id order starting from the owner
+//  - gossip: `fanout` live peers drawn at random
+// Every other peer still gets a delayed relay, sent only if its digests do
+// not show the packet in time, which keeps URB's guarantees when the overlay
+// misses someone. So that a miss does not draw a relay from every process at
+// once, the `fanout` live processes preceding a peer in id order repair it
+// first and the others only after OVERLAY_FALLBACK_ROUNDS more rounds.
+// Suspected processes are left out, so the trees rebuild around crashed ones
+class Overlay {
+
+private:
+  OverlayMode mode;
+  uint32_t fanout;
+  node_t *current_node;
+  std::vector<node_t *> *nodes;
+  FailureDetector *detector;
+
+  // non-suspected processes sorted by id, ourselves included
+  std::vector<node_t *> live;
+  uint32_t live_version;
+  std::mt19937 random;
+  mutable std::mutex mtx;
+
+  void rebuild_unsafe() {
+    uint32_t version = detector->membership_version();
+    if (version == live_version && !live.empty()) {
+      return;
+    }
+    live.clear();
+    for (node_t *node : *nodes) {
+      if (node == current_node || !detector->is_suspected(node->id)) {
+        live.push_back(node);
+      }
+    }
+    std::sort(live.begin(), live.end(),
+              [](node_t *a, node_t *b) { return a->id < b->id; });
+    live_version = version;
+  }
+
+  size_t live_index_unsafe(uint32_t node_id) {
+    return static_cast<size_t>(
+        std::lower_bound(live.begin(), live.end(), node_id,
+                         [](node_t *node, uint32_t id) {
+                           return node->id < id;
+                         }) -
+        live.begin());
+  }
+
+  std::vector<node_t *> tree_children_unsafe(uint32_t owner_id) {
+    size_t count = live.size();
+    // a suspected owner hands the root over to the next live process
+    size_t root = live_index_unsafe(owner_id) % count;
+    size_t position = (live_index_unsafe(current_node->id) + count - root) %
+                      count;
+
+    std::vector<node_t *> children;
+    for (size_t child = position * fanout + 1;
+         child <= position * fanout + fanout && child < count; child++) {
+      children.push_back(live[(root + child) % count]);
+    }
+    return children;
+  }
+
+  std::vector<node_t *> gossip_peers_unsafe(uint32_t owner_id) {
+    std::vector<node_t *> candidates;
+    for (node_t *node : live) {
+      if (node != current_node && node->id != owner_id) {
+        candidates.push_back(node);
+      }
+    }
+    size_t picks = std::min<size_t>(fanout, candidates.size());
+    // partial Fisher-Yates shuffle
+    for (size_t i = 0; i < picks; i++) {
+      std::uniform_int_distribution<size_t> pick(i, candidates.size() - 1);
+      std::swap(candidates[i], candidates[pick(random)]);
+    }
+    candidates.resize(picks);
+    return candidates;
+  }
+
+public:
+  Overlay(OverlayMode mode_in, uint32_t fanout_in, node_t *current_node_in,
+          std::vector<node_t *> *nodes_in, FailureDetector *detector_in)
+      : live(), random(current_node_in->id), mtx() {
+    mode = mode_in;
+    fanout = std::max(1u, fanout_in);
+    current_node = current_node_in;
+    nodes = nodes_in;
+    detector = detector_in;
+    live_version = 0;
+  }
+
+  static OverlayMode parse_mode(const std::string &name) {
+    for (uint32_t i = 0; i <= OVERLAY_GOSSIP; i++) {
+      if (name == OVERLAY_NAMES[i]) {
+        return static_cast<OverlayMode>(i);
+      }
+    }
+    throw std::runtime_error("unknown overlay: " + name);
+  }
+
+  // A multicast fan-out already costs a single send
+  bool is_enabled() { return mode != OVERLAY_OFF && !MULTICAST_FANOUT; }
+
+  // Whether we are among the first processes to repair `peer_id`
+  bool repairs(uint32_t peer_id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    rebuild_unsafe();
+    size_t count = live.size();
+    size_t distance = (live_index_unsafe(peer_id) + count -
+                       live_index_unsafe(current_node->id)) %
+                      count;
+    return distance <= fanout;
+  }
+
+  // Peers to send a packet of `owner_id` to as soon as we first see it
+  std::vector<node_t *> targets(uint32_t owner_id) {
+    std::lock_guard<std::mutex> lock(mtx);
+    rebuild_unsafe();
+    if (mode == OVERLAY_TREE) {
+      return tree_children_unsafe(owner_id);
+    }
+    return gossip_peers_unsafe(owner_id);
+  }
+};
+
+#endif
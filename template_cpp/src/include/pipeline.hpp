@@ -0,0 +1,205 @@
+#ifndef PIPELINE_CONFIG
+#define PIPELINE_CONFIG
+
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+
+// Environment variables describing the thread layout, stages separated by
+// ';', e.g.
+//   DA_THREADS="receiver=2"         threads per stage
+//   DA_AFFINITY="receiver=0-1;sender=2,3"  CPUs a stage may run on
+//   DA_BUSY_POLL="receiver;sender"  stages spinning instead of blocking
+//   DA_FUSE="sender+retransmitter"  stages sharing a single thread
+#define PIPELINE_THREADS_ENV "DA_THREADS"
+#define PIPELINE_AFFINITY_ENV "DA_AFFINITY"
+#define PIPELINE_BUSY_POLL_ENV "DA_BUSY_POLL"
+#define PIPELINE_FUSE_ENV "DA_FUSE"
+// The retransmitter has always spun until the next retransmission is due
+#define PIPELINE_DEFAULT_BUSY_POLL "retransmitter"
+
+enum Stage {
+  STAGE_RECEIVER = 0,
+  STAGE_SENDER,
+  STAGE_RETRANSMITTER,
+  STAGE_ENQUEUER,
+  STAGE_WRITER,
+  STAGE_HEARTBEAT,
+  STAGE_DIGESTER,
+  STAGE_MULTICAST,
+  STAGES
+};
+
+static const char *const STAGE_NAMES[STAGES] = {
+    "receiver", "sender",    "retransmitter", "enqueuer",
+    "writer",   "heartbeat", "digester",      "multicast"};
+
+// Stages whose work can be split between several threads
+#define SCALABLE_STAGES                                                        \
+  (1u << STAGE_RECEIVER | 1u << STAGE_SENDER | 1u << STAGE_MULTICAST)
+// Only the stages polling the link and the queues can share a thread
+#define FUSABLE_STAGES                                                         \
+  (1u << STAGE_RECEIVER | 1u << STAGE_SENDER | 1u << STAGE_RETRANSMITTER)
+
+typedef struct {
+  uint32_t threads = 1;
+  std::vector<int> cpus;
+  bool busy_poll = false;
+  bool fused = false;
+} stage_config_t;
+
+// Runtime layout of the processing pipeline: how many threads serve each
+// stage, where they run, whether they spin or block when idle, and which
+// stages are fused into one thread looping over all of them
+class PipelineConfig {
+
+private:
+  stage_config_t stages[STAGES];
+  // one bitmask of stages per fused thread
+  std::vector<uint32_t> fused_groups;
+
+  static Stage parse_stage(const std::string &name) {
+    for (uint32_t i = 0; i < STAGES; i++) {
+      if (name == STAGE_NAMES[i]) {
+        return static_cast<Stage>(i);
+      }
+    }
+    throw std::runtime_error("unknown pipeline stage: " + name);
+  }
+
+  static std::vector<std::string> split(const std::string &spec, char delim) {
+    std::vector<std::string> parts;
+    std::istringstream stream(spec);
+    std::string part;
+    while (std::getline(stream, part, delim)) {
+      if (!part.empty()) {
+        parts.push_back(part);
+      }
+    }
+    return parts;
+  }
+
+  // "0-3,6" as in taskset
+  static std::vector<int> parse_cpus(const std::string &list) {
+    std::vector<int> cpus;
+    for (const std::string &range : split(list, ',')) {
+      size_t dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+      if (first < 0 || last < first || last >= CPU_SETSIZE) {
+        throw std::runtime_error("invalid CPU range: " + range);
+      }
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    }
+    return cpus;
+  }
+
+  // Calls `apply` with the stage and value of every "stage=value" entry
+  template <typename F> static void parse_assignments(const char *env, F apply) {
+    const char *spec = getenv(env);
+    if (spec == NULL) {
+      return;
+    }
+    for (const std::string &entry : split(spec, ';')) {
+      size_t equal = entry.find('=');
+      if (equal == std::string::npos) {
+        throw std::runtime_error(std::string(env) + ": expected stage=value");
+      }
+      apply(parse_stage(entry.substr(0, equal)), entry.substr(equal + 1));
+    }
+  }
+
+public:
+  PipelineConfig() : fused_groups() {}
+
+  // Reads the layout from the environment, throws on a malformed one
+  void load() {
+    parse_assignments(PIPELINE_THREADS_ENV,
+                      [&](Stage stage, const std::string &value) {
+                        int threads = std::stoi(value);
+                        if (!(SCALABLE_STAGES & 1u << stage) || threads < 1) {
+                          throw std::runtime_error(
+                              "invalid thread count for stage: " +
+                              std::string(STAGE_NAMES[stage]));
+                        }
+                        stages[stage].threads = static_cast<uint32_t>(threads);
+                      });
+    parse_assignments(PIPELINE_AFFINITY_ENV,
+                      [&](Stage stage, const std::string &value) {
+                        stages[stage].cpus = parse_cpus(value);
+                      });
+
+    const char *busy_poll = getenv(PIPELINE_BUSY_POLL_ENV);
+    for (const std::string &name :
+         split(busy_poll ? busy_poll : PIPELINE_DEFAULT_BUSY_POLL, ';')) {
+      stages[parse_stage(name)].busy_poll = true;
+    }
+
+    const char *fuse = getenv(PIPELINE_FUSE_ENV);
+    for (const std::string &group : split(fuse ? fuse : "", ';')) {
+      uint32_t mask = 0;
+      for (const std::string &name : split(group, '+')) {
+        Stage stage = parse_stage(name);
+        if (!(FUSABLE_STAGES & 1u << stage) || stages[stage].fused) {
+          throw std::runtime_error("cannot fuse stage: " + name);
+        }
+        stages[stage].fused = true;
+        mask |= 1u << stage;
+      }
+      fused_groups.push_back(mask);
+    }
+  }
+
+  uint32_t threads(Stage stage) {
+    return stages[stage].fused ? 0 : stages[stage].threads;
+  }
+
+  bool busy_poll(Stage stage) { return stages[stage].busy_poll; }
+
+  const std::vector<uint32_t> &fused() { return fused_groups; }
+
+  // Pins the calling thread to the CPUs of the stages in `mask`, if any
+  void pin(uint32_t mask) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    bool pinned = false;
+    for (uint32_t i = 0; i < STAGES; i++) {
+      if (!(mask & 1u << i)) {
+        continue;
+      }
+      for (int cpu : stages[i].cpus) {
+        CPU_SET(cpu, &set);
+        pinned = true;
+      }
+    }
+    if (pinned &&
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 &&
+        DEBUG)
+      std::cout << "Could not pin the thread, running unpinned\n";
+  }
+
+  void pin(Stage stage) { pin(1u << stage); }
+
+  void show() {
+    if (DEBUG) {
+      std::cout << "Pipeline:";
+      for (uint32_t i = 0; i < STAGES; i++) {
+        std::cout << " " << STAGE_NAMES[i] << " x" << threads(static_cast<Stage>(i))
+                  << (stages[i].busy_poll ? " polling" : "")
+                  << (stages[i].cpus.empty() ? "" : " pinned") << ",";
+      }
+      std::cout << " fused threads " << fused_groups.size() << "\n";
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef PROTOCOL_CLOCK
+#define PROTOCOL_CLOCK
+
+#include <chrono>
+
+using namespace std::chrono; // noqa
+
+// Time as seen by the protocol timers: retransmissions, failure detection,
+// FEC and fragment timeouts. The simulator substitutes its virtual time, see
+// tools/simulate.cpp
+class ProtocolClock {
+
+private:
+  inline static const steady_clock::time_point *virtual_now = nullptr;
+
+public:
+  static steady_clock::time_point now() {
+    return virtual_now != nullptr ? *virtual_now : steady_clock::now();
+  }
+
+  // Reads the time from `now` from here on, nullptr restores the real clock
+  static void use_virtual_time(const steady_clock::time_point *now) {
+    virtual_now = now;
+  }
+};
+
+#endif
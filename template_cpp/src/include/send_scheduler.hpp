@@ -0,0 +1,162 @@
+#ifndef SEND_SCHEDULER
+#define SEND_SCHEDULER
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+
+#include "messages.hpp"
+
+// Bytes a peer may send per round within its class
+#define DRR_QUANTUM 1500
+
+enum SendClass {
+  SEND_CONTROL = 0, // ACKs and digests, always served first
+  SEND_RETRANSMISSION,
+  SEND_RELAY,
+  SEND_DATA,
+  SEND_CLASSES
+};
+
+// Messages served in a row by each class once control is empty
+static const uint32_t SEND_CLASS_WEIGHTS[SEND_CLASSES] = {1, 4, 2, 1};
+static const char *const SEND_CLASS_NAMES[SEND_CLASSES] = {
+    "control", "retransmission", "relay", "data"};
+
+typedef struct {
+  std::queue<message_t *> messages;
+  int64_t deficit = 0;
+  bool active = false;
+} peer_queue_t;
+
+typedef struct {
+  std::unordered_map<uint32_t, peer_queue_t> peers;
+  std::deque<uint32_t> active_peers;
+  std::atomic<uint32_t> depth;
+} send_class_t;
+
+// Sending queue split into priority classes: control traffic goes first, the
+// others share the link by weight, and within a class peers are served by
+// deficit round-robin so one busy peer cannot starve the rest
+class SendScheduler {
+private:
+  send_class_t classes[SEND_CLASSES];
+  uint32_t current_class = SEND_RETRANSMISSION;
+  uint32_t served_in_turn = 0;
+  mutable std::mutex mtx;
+  std::condition_variable cond_var;
+  std::atomic<uint32_t> q_size = 0;
+
+  static int64_t cost(message_t *message) {
+    return PAYLOAD_META_SIZE + message->payload->buff_size;
+  }
+
+  message_t *dequeue_from_unsafe(send_class_t &send_class) {
+    while (true) {
+      uint32_t peer_id = send_class.active_peers.front();
+      peer_queue_t &peer = send_class.peers[peer_id];
+      message_t *message = peer.messages.front();
+
+      if (peer.deficit < cost(message)) {
+        peer.deficit += DRR_QUANTUM;
+        send_class.active_peers.pop_front();
+        send_class.active_peers.push_back(peer_id);
+        continue;
+      }
+
+      peer.deficit -= cost(message);
+      peer.messages.pop();
+      if (peer.messages.empty()) {
+        peer.deficit = 0;
+        peer.active = false;
+        send_class.active_peers.pop_front();
+      }
+      send_class.depth--;
+      return message;
+    }
+  }
+
+  // Weighted round-robin over the non-control classes
+  send_class_t &next_class_unsafe() {
+    if (classes[SEND_CONTROL].depth > 0) {
+      return classes[SEND_CONTROL];
+    }
+    while (classes[current_class].depth == 0 ||
+           served_in_turn >= SEND_CLASS_WEIGHTS[current_class]) {
+      current_class++;
+      if (current_class == SEND_CLASSES) {
+        current_class = SEND_RETRANSMISSION;
+      }
+      served_in_turn = 0;
+    }
+    served_in_turn++;
+    return classes[current_class];
+  }
+
+public:
+  SendScheduler() : mtx(), cond_var() {
+    for (send_class_t &send_class : classes) {
+      send_class.depth = 0;
+    }
+  }
+
+  ~SendScheduler() {}
+
+  uint32_t size() { return q_size; }
+
+  uint32_t depth(SendClass send_class) { return classes[send_class].depth; }
+
+  void enqueue(message_t *message, SendClass send_class) {
+    std::lock_guard<std::mutex> lock(mtx);
+    send_class_t &target = classes[send_class];
+    peer_queue_t &peer = target.peers[message->recipient->id];
+
+    peer.messages.push(message);
+    if (!peer.active) {
+      peer.active = true;
+      target.active_peers.push_back(message->recipient->id);
+    }
+    target.depth++;
+    q_size++;
+    cond_var.notify_one();
+  }
+
+  message_t *dequeue() {
+    std::unique_lock<std::mutex> lock(mtx);
+
+    while (q_size == 0) {
+      cond_var.wait(lock);
+    }
+
+    message_t *message = dequeue_from_unsafe(next_class_unsafe());
+    q_size--;
+    return message;
+  }
+
+  // Does not wait, returns nullptr if every class is empty
+  message_t *try_dequeue() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (q_size == 0) {
+      return nullptr;
+    }
+    message_t *message = dequeue_from_unsafe(next_class_unsafe());
+    q_size--;
+    return message;
+  }
+
+  void show_depths() {
+    if (DEBUG) {
+      std::cout << "Sending queue depths:";
+      for (uint32_t i = 0; i < SEND_CLASSES; i++) {
+        std::cout << " " << SEND_CLASS_NAMES[i] << " " << classes[i].depth;
+      }
+      std::cout << "\n";
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef SPILL_STORE
+#define SPILL_STORE
+
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "messages.hpp"
+
+// Memory the undelivered payloads may take before new ones are spilled, in
+// MB, 0 never spills
+#define SPILL_THRESHOLD_ENV "DA_SPILL_MB"
+#define SPILL_DEFAULT_MB 512
+// Segment files go to $TMPDIR, or here
+#define SPILL_DEFAULT_DIR "/tmp"
+#define SPILL_SEGMENT_BYTES (64ul << 20)
+// owner, packet uid, sender, sparse clock flag, clock length, buffer size
+#define SPILL_RECORD_HEADER_SIZE 24
+#define SPILL_RECORD_ALIGN 8
+
+typedef struct {
+  uint32_t segment;
+  uint32_t offset;
+} spill_ref_t;
+
+// Overflow tier of the delivered set: payloads causally blocked for long
+// (say, on a paused process) are appended to a memory-mapped segment file
+// instead of staying on the heap, and paged back in one at a time when they
+// are next in line for delivery. The file is unlinked as soon as it is
+// created; segments whose records were all paged back are unmapped and
+// punched out of it, and it is truncated whenever nothing is spilled.
+// Not thread-safe, it lives under the lock of the delivered set
+class SpillStore {
+
+private:
+  size_t threshold;
+  int fd;
+  std::vector<char *> segments;
+  // records of each segment not paged back yet
+  std::vector<uint32_t> live;
+  uint32_t append_offset;
+  // segment and offset of every spilled packet, by owner
+  std::unordered_map<uint32_t, std::map<uint32_t, spill_ref_t>> index;
+  size_t spilled;
+  uint64_t spilled_total;
+
+  static uint32_t record_size(payload_t *payload) {
+    size_t size = SPILL_RECORD_HEADER_SIZE + payload->vc_len * 4 +
+                  static_cast<size_t>(payload->buff_size);
+    return static_cast<uint32_t>((size + SPILL_RECORD_ALIGN - 1) /
+                                 SPILL_RECORD_ALIGN * SPILL_RECORD_ALIGN);
+  }
+
+  bool open_file() {
+    const char *directory = getenv("TMPDIR");
+    std::string pattern = std::string(directory != NULL && *directory != '\0'
+                                          ? directory
+                                          : SPILL_DEFAULT_DIR) +
+                          "/da_spill_XXXXXX";
+    std::vector<char> path(pattern.begin(), pattern.end());
+    path.push_back('\0');
+    fd = mkstemp(path.data());
+    if (fd < 0) {
+      return false;
+    }
+    unlink(path.data());
+    return true;
+  }
+
+  bool add_segment() {
+    if (fd < 0 && !open_file()) {
+      return false;
+    }
+    if (!segments.empty() && segments.back() != nullptr) {
+      // written out, only read back once deliverable
+      msync(segments.back(), SPILL_SEGMENT_BYTES, MS_ASYNC);
+      madvise(segments.back(), SPILL_SEGMENT_BYTES, MADV_DONTNEED);
+    }
+    off_t offset = static_cast<off_t>(segments.size() * SPILL_SEGMENT_BYTES);
+    if (ftruncate(fd, offset + static_cast<off_t>(SPILL_SEGMENT_BYTES)) != 0) {
+      return false;
+    }
+    void *segment = mmap(nullptr, SPILL_SEGMENT_BYTES, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, offset);
+    if (segment == MAP_FAILED) {
+      return false;
+    }
+    segments.push_back(static_cast<char *>(segment));
+    live.push_back(0);
+    append_offset = 0;
+    return true;
+  }
+
+  void release_segment(uint32_t segment) {
+    munmap(segments[segment], SPILL_SEGMENT_BYTES);
+    segments[segment] = nullptr;
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              static_cast<off_t>(segment * SPILL_SEGMENT_BYTES),
+              static_cast<off_t>(SPILL_SEGMENT_BYTES));
+  }
+
+  void reset() {
+    for (char *segment : segments) {
+      if (segment != nullptr) {
+        munmap(segment, SPILL_SEGMENT_BYTES);
+      }
+    }
+    segments.clear();
+    live.clear();
+    if (ftruncate(fd, 0) != 0 && DEBUG) {
+      std::cout << "Could not truncate the spill file\n";
+    }
+  }
+
+public:
+  explicit SpillStore(size_t threshold_bytes)
+      : segments(), live(), index() {
+    threshold = threshold_bytes;
+    fd = -1;
+    append_offset = 0;
+    spilled = 0;
+    spilled_total = 0;
+  }
+
+  ~SpillStore() {
+    if (fd >= 0) {
+      reset();
+      close(fd);
+    }
+  }
+
+  // Reads SPILL_THRESHOLD_ENV, in bytes
+  static size_t threshold_from_env() {
+    const char *value = getenv(SPILL_THRESHOLD_ENV);
+    if (value == NULL || *value == '\0') {
+      return static_cast<size_t>(SPILL_DEFAULT_MB) << 20;
+    }
+    try {
+      return static_cast<size_t>(std::stoul(value)) << 20;
+    } catch (std::logic_error &) {
+      throw std::runtime_error(std::string(SPILL_THRESHOLD_ENV) +
+                               ": expected a size in MB");
+    }
+  }
+
+  // Heap footprint of an undelivered payload
+  static size_t footprint(payload_t *payload) {
+    return sizeof(payload_t) + static_cast<size_t>(payload->buff_size) +
+           payload->vc_len * 4;
+  }
+
+  bool is_over(size_t memory_bytes) {
+    return threshold > 0 && memory_bytes > threshold;
+  }
+
+  bool contains(uint32_t owner_id, uint32_t packet_uid) {
+    auto it = index.find(owner_id);
+    return it != index.end() && it->second.count(packet_uid) == 1;
+  }
+
+  // Appends a copy of `payload`, returns false if it has to stay in memory
+  bool put(payload_t *payload) {
+    uint32_t size = record_size(payload);
+    if (size > SPILL_SEGMENT_BYTES) {
+      return false;
+    }
+    if ((segments.empty() || append_offset + size > SPILL_SEGMENT_BYTES) &&
+        !add_segment()) {
+      if (DEBUG)
+        std::cout << "Could not grow the spill file, keeping payloads on "
+                     "the heap\n";
+      return false;
+    }
+
+    uint32_t segment = static_cast<uint32_t>(segments.size() - 1);
+    char *record = segments[segment] + append_offset;
+    uint32_t sparse = payload->sparse_clock;
+    uint32_t buff_size = static_cast<uint32_t>(payload->buff_size);
+    memcpy(record, &payload->owner_id, 4);
+    memcpy(record + 4, &payload->packet_uid, 4);
+    memcpy(record + 8, &payload->sender_id, 4);
+    memcpy(record + 12, &sparse, 4);
+    memcpy(record + 16, &payload->vc_len, 4);
+    memcpy(record + 20, &buff_size, 4);
+    memcpy(record + SPILL_RECORD_HEADER_SIZE, payload->vector_clock,
+           payload->vc_len * 4);
+    memcpy(record + SPILL_RECORD_HEADER_SIZE + payload->vc_len * 4,
+           payload->buffer, buff_size);
+
+    index[payload->owner_id][payload->packet_uid] = {segment, append_offset};
+    append_offset += size;
+    live[segment]++;
+    spilled++;
+    spilled_total++;
+    return true;
+  }
+
+  // Pages a spilled payload back in, nullptr if it was not spilled
+  payload_t *take(uint32_t owner_id, uint32_t packet_uid) {
+    auto owner = index.find(owner_id);
+    if (owner == index.end()) {
+      return nullptr;
+    }
+    auto it = owner->second.find(packet_uid);
+    if (it == owner->second.end()) {
+      return nullptr;
+    }
+    spill_ref_t ref = it->second;
+    owner->second.erase(it);
+
+    const char *record = segments[ref.segment] + ref.offset;
+    uint32_t sparse, buff_size;
+    payload_t *payload = new payload_t;
+    memcpy(&payload->owner_id, record, 4);
+    memcpy(&payload->packet_uid, record + 4, 4);
+    memcpy(&payload->sender_id, record + 8, 4);
+    memcpy(&sparse, record + 12, 4);
+    memcpy(&payload->vc_len, record + 16, 4);
+    memcpy(&buff_size, record + 20, 4);
+    payload->sparse_clock = sparse != 0;
+    payload->buff_size = buff_size;
+    payload->vector_clock = new uint32_t[payload->vc_len];
+    payload->buffer = new char[buff_size];
+    memcpy(payload->vector_clock, record + SPILL_RECORD_HEADER_SIZE,
+           payload->vc_len * 4);
+    memcpy(payload->buffer,
+           record + SPILL_RECORD_HEADER_SIZE + payload->vc_len * 4,
+           buff_size);
+
+    spilled--;
+    if (spilled == 0) {
+      reset();
+    } else if (--live[ref.segment] == 0 &&
+               ref.segment + 1 < segments.size()) {
+      release_segment(ref.segment);
+    }
+    return payload;
+  }
+
+  void show() {
+    if (DEBUG)
+      std::cout << "Spill store: " << spilled_total << " payloads spilled, "
+                << spilled << " still on disk\n";
+  }
+};
+
+#endif
@@ -2,44 +2,223 @@
 #define _TCP_H_
 
 #include <atomic>
+#include <functional>
 #include <utility>
 #include <vector>
 
+#include "capture.hpp"
 #include "common.hpp"
 #include "delivered_set.hpp"
+#include "failure_detector.hpp"
+#include "fec.hpp"
+#include "fragments.hpp"
+#include "gso.hpp"
 #include "messages.hpp"
+#include "nack.hpp"
+#include "overlay.hpp"
+#include "pipeline.hpp"
+#include "protocol_clock.hpp"
+#include "send_scheduler.hpp"
 #include "udp.hpp"
+#include "uring.hpp"
 
 #define MAX_PACKET_WAIT_MS 100
 #define SENDING_CHUNK_SIZE (MILLION / 10)
 #define RETRANSMISSION_OFFSET_MS 300
 
+// Relays are held back and dropped once the peer is known to have the packet
+#define RELAY_SUPPRESSION 1
+#define DIGEST_INTERVAL_MS 20
+// Resend an unchanged digest every N rounds in case the last one was lost,
+// unless a peer shows it missed it by sending us a packet we had
+#define DIGEST_REFRESH_ROUNDS 50
+
+// Chooses the link reliability at startup, "ack" (default) or "nack"
+#define RELIABILITY_ENV "DA_RELIABILITY"
+// Number of broadcast channels a process serves over its socket, 1 default
+#define CHANNELS_ENV "DA_CHANNELS"
+// Channel ids take two bytes of the payload header
+#define MAX_CHANNELS 65536
+
+// Work items a fused thread handles per stage before moving on
+#define FUSED_ROUND_SIZE 64
+// How long an idle fused thread blocks before polling its stages again
+#define FUSED_IDLE_WAIT_MS 1
+
 using namespace std::chrono;
 
+enum Reliability {
+  // receivers ACK every packet, unacked ones are resent after a timeout
+  RELIABILITY_ACK = 0,
+  // receivers NACK gaps in what owners send them, digests show the rest
+  RELIABILITY_NACK
+};
+
+// The stack of one broadcast channel. Channels of a process have their own
+// delivered set, causality and broadcast state, but share the socket, the
+// sending and retransmission queues, the threads serving them, the failure
+// detector and its heartbeats, the GSO, io_uring and FEC state and the
+// capture
 typedef struct tcp_handler_s {
   int sockfd;
+  int multicast_sockfd;
+  node_t *group_node;
   std::atomic<bool> *finito;
   node_t *current_node;
   std::vector<node_t *> *nodes;
   DeliveredSet *delivered;
-  MessagesQueue *sending_queue;
-  MessagesQueue *retrans_queue;
+  FailureDetector *detector;
+  FecCodec *fec;
+  Fragmenter *fragments;
+  GsoBatcher *gso;
+  Overlay *overlay;
+  UringLink *uring;
+  PipelineConfig *pipeline;
+  Reliability reliability;
+  // only used with RELIABILITY_NACK
+  GapDetector *gaps;
+  SentLog *sent_log;
+  SendScheduler *sending_queue;
+  RetransmissionQueue *retrans_queue;
   PayloadQueue *broadcasted_queue;
+  // uid of the last message this process broadcast
+  uint32_t broadcast_seq;
+  // dependencies the messages broadcast so far already carry
+  std::vector<uint32_t> broadcast_clock;
+  // id every payload of this channel carries
+  uint16_t channel_id;
+  // every channel of the process by id, nullptr if this one is alone
+  std::vector<tcp_handler_s *> *channels;
+  // records every received datagram when set, see capture.hpp
+  TraceWriter *capture;
+  // carries payloads instead of the socket when set, see tools/simulate.cpp
+  std::function<bool(node_t *, payload_t *)> simulated_link;
 } tcp_handler_t;
 
+// State of a thread reading a socket
+typedef struct {
+  int sockfd;
+  int poll_fd;
+  gro_batch_t *batch;
+} receiver_t;
+
+// How a stage waits for work
+enum WaitMode {
+  WAIT_NONE = 0, // return at once, for fused stages
+  WAIT_SLEEP,
+  WAIT_SPIN
+};
+
 void keep_receiving_messages(tcp_handler_t *tcp_handler);
 
+void keep_receiving_multicast_messages(tcp_handler_t *tcp_handler);
+
+void receive_messages(tcp_handler_t *tcp_handler, int sockfd);
+
+void init_receiver(tcp_handler_t *tcp_handler, receiver_t *receiver,
+                   int sockfd);
+
+// Handles one datagram, waiting up to `wait_ms` for it. Returns false if
+// there was none
+bool receive_message(tcp_handler_t *tcp_handler, receiver_t *receiver,
+                     int wait_ms);
+
+// Hands a received payload to the stack of its channel, and takes its
+// ownership
+void dispatch_payload(tcp_handler_t *tcp_handler, payload_t *payload);
+
+// Processes a received payload and takes its ownership
+void handle_payload(tcp_handler_t *tcp_handler, payload_t *payload);
+
+void send_ack(tcp_handler_t *tcp_handler, payload_t *payload);
+
+// Reads RELIABILITY_ENV, throws on an unknown mode
+Reliability reliability_from_env();
+
+// Reads CHANNELS_ENV, throws unless it is between 1 and MAX_CHANNELS
+uint32_t channels_from_env();
+
+// Reports the packets its owner skipped before `payload`, if any
+void send_nacks(tcp_handler_t *tcp_handler, payload_t *payload);
+
+// Resends the packets a peer NACKed
+void resend_nacked(tcp_handler_t *tcp_handler, payload_t *nack);
+
+// Resends the packets of ours `peer_id` missed while it was given up on,
+// those still in the log
+void catch_up(tcp_handler_t *tcp_handler, uint32_t peer_id);
+
+bool reassemble_fragment(tcp_handler_t *tcp_handler, payload_t **payload);
+
 void keep_sending_messages_from_queue(tcp_handler_t *tcp_handler);
 
+// Sends the next message of the sending queue. Returns false if there was
+// none and `wait` is off
+bool send_queued_message(tcp_handler_t *tcp_handler, bool wait);
+
 void keep_retransmitting_messages(tcp_handler_t *tcp_handler);
 
+// Queues the sends of the next retransmission once it is due. Without
+// waiting, an entry that is not due yet is kept in `pending`
+bool retransmit_message(tcp_handler_t *tcp_handler,
+                        retransmission_t **pending, WaitMode wait);
+
+// Clears the peers that hold the packet, or were given up on, from
+// `retransmission` and frees it if none is left. Returns whether it did
+bool drop_if_held(tcp_handler_t *tcp_handler,
+                  retransmission_t *retransmission);
+
+// Loops over the receiver, retransmitter and sender stages set in `stages`
+void run_fused_stages(tcp_handler_t *tcp_handler, uint32_t stages);
+
+// Takes one copy of `payload` for every peer that does not have it yet, all
+// of them unsent. The caller holds the entry until it releases it
+retransmission_t *new_retransmission(tcp_handler_t *tcp_handler,
+                                     payload_t *payload);
+
+// Queues a send of the entry's payload to `recipient`, or to every peer for
+// the group node
+void enqueue_send(tcp_handler_t *tcp_handler, retransmission_t *retransmission,
+                  node_t *recipient, SendClass send_class);
+
+// Drops a hold on the entry. The last one moves it to the retransmission
+// queue, due RETRANSMISSION_OFFSET_MS from now
+void release_retransmission(tcp_handler_t *tcp_handler,
+                            retransmission_t *retransmission);
+
+void keep_sending_digests(tcp_handler_t *tcp_handler);
+
+// Broadcasts our digest if it changed since `last_sent` or a peer sent us a
+// packet we had, or anyway every DIGEST_REFRESH_ROUNDS rounds
+void send_digest(tcp_handler_t *tcp_handler, std::vector<uint32_t> &last_sent,
+                 uint32_t round);
+
+void keep_sending_heartbeats(tcp_handler_t *tcp_handler);
+
+// Heartbeats every peer once for the whole process and runs the periodic
+// housekeeping of every channel
+void send_heartbeats(tcp_handler_t *tcp_handler, uint32_t round);
+
 bool should_start_retransmission(steady_clock::time_point sending_start);
 
+bool is_data_message(tcp_handler_t *h, message_t *message);
+
 void construct_message(message_t *message, payload_t *payload,
                        node_t *recipient);
 
 void construct_payload(tcp_handler_t *h, payload_t *payload, node_t *sender,
-                       uint32_t seq_num);
+                       uint32_t seq_num, const char *data, size_t len);
+
+void construct_ack_payload(tcp_handler_t *h, payload_t *ack,
+                           payload_t *payload);
+
+void construct_nack_payload(tcp_handler_t *h, payload_t *nack,
+                            OwnerID owner_id, const PacketID *uids,
+                            size_t count);
+
+void construct_digest_payload(tcp_handler_t *h, payload_t *payload);
+
+void construct_heartbeat_payload(tcp_handler_t *h, payload_t *payload);
 
 inline uint32_t causal_links_count(struct tcp_handler_s *h, uint32_t node_id) {
   return static_cast<uint32_t>(h->delivered->causality[node_id].size());
@@ -49,18 +228,24 @@ inline uint32_t my_causal_links_count(struct tcp_handler_s *h) {
   return causal_links_count(h, h->current_node->id);
 }
 
-inline uint32_t vector_clock_size(tcp_handler_t *h) {
-  return static_cast<uint32_t>(h->nodes->size() + 1);
+// The stack of channel `channel_id`, nullptr if the process does not serve it
+inline tcp_handler_t *channel_of(tcp_handler_t *h, uint32_t channel_id) {
+  if (h->channels == nullptr) {
+    return channel_id == h->channel_id ? h : nullptr;
+  }
+  return channel_id < h->channels->size() ? (*h->channels)[channel_id]
+                                          : nullptr;
 }
 
-inline void show_vector_clock(uint32_t *vector_clock, uint32_t vc_size) {
-  if (DEBUG) {
-    std::cout << "Vector clock: ";
-    for (uint32_t i = 0; i < vc_size; i++) {
-      std::cout << vector_clock[i] << " ";
-    }
-    std::cout << "\n";
+inline std::vector<tcp_handler_t *> all_channels(tcp_handler_t *h) {
+  if (h->channels == nullptr) {
+    return {h};
   }
+  return *h->channels;
+}
+
+inline uint32_t vector_clock_size(tcp_handler_t *h) {
+  return static_cast<uint32_t>(h->nodes->size() + 1);
 }
 
 #endif
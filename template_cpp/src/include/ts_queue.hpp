@@ -39,6 +39,18 @@ public:
     q_size--;
     return value;
   }
+
+  // Does not wait, returns false if the queue is empty
+  bool try_dequeue(T &value) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (q.empty()) {
+      return false;
+    }
+    value = q.front();
+    q.pop();
+    q_size--;
+    return true;
+  }
 };
 
 #endif
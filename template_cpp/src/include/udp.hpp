@@ -4,6 +4,20 @@
 #include <vector>
 
 #include "common.hpp"
+#include "messages.hpp"
+
+// Group joined by every process when MULTICAST_FANOUT is on
+#define MULTICAST_GROUP "239.255.11.1"
+#define MULTICAST_PORT 11999
+#define MULTICAST_NODE_ID 0
+
+// Received buffer, holding several datagrams when the kernel coalesced them
+typedef struct {
+  char buffer[IP_MAXPACKET];
+  ssize_t len = 0;
+  ssize_t offset = 0;
+  uint16_t segment_size = 0;
+} gro_batch_t;
 
 struct tcp_handler_s;
 
@@ -12,14 +26,23 @@ size_t get_node_idx_by_id(std::vector<node_t *> *nodes, uint32_t id);
 bool send_udp_payload(struct tcp_handler_s *h, int sockfd, node_t *receiver,
                       payload_t *payload, ssize_t size);
 ssize_t receive_udp_payload(struct tcp_handler_s *h, int sockfd,
-                            payload_t *payload);
+                            gro_batch_t *batch, payload_t *payload);
 
 ssize_t send_udp_packet(int sockfd, node_t *receiver, const char *buffer,
-                        ssize_t buff_len);
-ssize_t receive_udp_packet(int sockfd, char *buffer, ssize_t buff_len);
+                        ssize_t buff_len, uint16_t segment_size = 0);
+ssize_t receive_udp_packet(int sockfd, char *buffer, ssize_t buff_len,
+                           uint16_t *segment_size);
+int readable_fd(struct tcp_handler_s *h, int sockfd);
+
+inline bool has_pending_segments(gro_batch_t *batch) {
+  return batch->offset < batch->len;
+}
 
 int select_socket(int sockfd, int secs, int milisecs);
 int init_socket();
 int bind_socket(unsigned short port);
+void enable_udp_gro(int sockfd);
+int bind_multicast_socket(node_t *group, in_addr_t interface);
+void enable_multicast_sending(int sockfd, in_addr_t interface);
 
 #endif
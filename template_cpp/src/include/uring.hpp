@@ -0,0 +1,473 @@
+#ifndef URING_LINK
+#define URING_LINK
+
+#include <algorithm>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "common.hpp"
+
+#define URING_ENTRIES 256
+// Registered buffers sends are staged in, one datagram or GSO batch each
+#define URING_SEND_SLOTS 64
+// Provided buffers multishot receives land in, a power of two
+#define URING_RECV_BUFFERS 64
+// Room for the recvmsg header, address and control message in front of a
+// coalesced datagram
+#define URING_RECV_BUFFER_SIZE (IP_MAXPACKET + 128)
+#define URING_BUFFER_GROUP 0
+
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *ring_ptr;
+  size_t ring_size;
+  size_t sqes_size;
+  unsigned to_submit;
+} uring_t;
+
+typedef struct {
+  struct sockaddr_in addr;
+  struct msghdr msg;
+  struct iovec iov;
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  char *data;
+} uring_send_slot_t;
+
+// io_uring link backend: one ring with a multishot recvmsg feeding from a
+// provided buffer ring, one ring sends are queued on from registered buffers
+// and submitted in batches. Talks to the kernel directly, there is no
+// liburing in the build. Inactive if the kernel refuses any of it, in which
+// case the socket calls of udp.cpp are used
+class UringLink {
+
+private:
+  int sockfd;
+  bool active;
+  bool fixed_sends;
+
+  uring_t recv_ring;
+  struct io_uring_buf *buf_ring;
+  char *recv_buffers;
+  struct msghdr recv_msg;
+  bool recv_armed;
+  mutable std::mutex recv_mtx;
+
+  uring_t send_ring;
+  char *send_buffers;
+  uring_send_slot_t slots[URING_SEND_SLOTS];
+  std::vector<uint32_t> free_slots;
+
+  static int enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+  }
+
+  static int register_ring(int fd, unsigned opcode, void *arg,
+                           unsigned nr_args) {
+    return static_cast<int>(
+        syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+  }
+
+  static bool setup_ring(uring_t &ring, unsigned entries) {
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    bzero(&ring, sizeof(ring));
+    ring.fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring.fd < 0) {
+      return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+      close(ring.fd);
+      ring.fd = -1;
+      return false;
+    }
+
+    ring.entries = params.sq_entries;
+    ring.ring_size = std::max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.ring_ptr = mmap(nullptr, ring.ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    void *sqes_ptr = mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.ring_ptr == MAP_FAILED || sqes_ptr == MAP_FAILED) {
+      close(ring.fd);
+      ring.fd = -1;
+      return false;
+    }
+
+    char *base = static_cast<char *>(ring.ring_ptr);
+    ring.sq_head = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+    ring.sq_tail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+    ring.sq_mask = reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+    ring.sq_array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+    ring.cq_head = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+    ring.cq_tail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+    ring.cq_mask = reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+    ring.cqes =
+        reinterpret_cast<struct io_uring_cqe *>(base + params.cq_off.cqes);
+    ring.sqes = static_cast<struct io_uring_sqe *>(sqes_ptr);
+    return true;
+  }
+
+  static void close_ring(uring_t &ring) {
+    if (ring.fd < 0) {
+      return;
+    }
+    munmap(ring.sqes, ring.sqes_size);
+    munmap(ring.ring_ptr, ring.ring_size);
+    close(ring.fd);
+    ring.fd = -1;
+  }
+
+  // Next free submission entry, or nullptr if the queue is full
+  static struct io_uring_sqe *get_sqe(uring_t &ring) {
+    unsigned tail = *ring.sq_tail;
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring.entries) {
+      return nullptr;
+    }
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    bzero(sqe, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    return sqe;
+  }
+
+  // Publishes the entry returned by the last get_sqe
+  static void commit_sqe(uring_t &ring) {
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+  }
+
+  static int submit(uring_t &ring, unsigned wait_nr) {
+    if (ring.to_submit == 0 && wait_nr == 0) {
+      return 0;
+    }
+    int submitted = enter(ring.fd, ring.to_submit, wait_nr,
+                          wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (submitted > 0) {
+      ring.to_submit -= std::min(ring.to_submit,
+                                 static_cast<unsigned>(submitted));
+    }
+    return submitted;
+  }
+
+  static struct io_uring_cqe *peek_cqe(uring_t &ring) {
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      return nullptr;
+    }
+    return &ring.cqes[head & *ring.cq_mask];
+  }
+
+  static void cqe_seen(uring_t &ring) {
+    __atomic_store_n(ring.cq_head, *ring.cq_head + 1, __ATOMIC_RELEASE);
+  }
+
+  // The tail of a buffer ring overlays the reserved field of its first entry
+  void recycle_buffer_unsafe(uint16_t bid) {
+    uint16_t tail = __atomic_load_n(&buf_ring[0].resv, __ATOMIC_RELAXED);
+    struct io_uring_buf &buf = buf_ring[tail & (URING_RECV_BUFFERS - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(recv_buffers +
+                                          bid * URING_RECV_BUFFER_SIZE);
+    buf.len = URING_RECV_BUFFER_SIZE;
+    buf.bid = bid;
+    __atomic_store_n(&buf_ring[0].resv, static_cast<uint16_t>(tail + 1),
+                     __ATOMIC_RELEASE);
+  }
+
+  bool setup_receive() {
+    if (!setup_ring(recv_ring, URING_ENTRIES)) {
+      return false;
+    }
+
+    void *ring_mem =
+        mmap(nullptr, URING_RECV_BUFFERS * sizeof(struct io_uring_buf),
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_mem == MAP_FAILED) {
+      return false;
+    }
+    buf_ring = static_cast<struct io_uring_buf *>(ring_mem);
+    recv_buffers = new char[URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE];
+
+    struct io_uring_buf_reg reg;
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (register_ring(recv_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      return false;
+    }
+    for (uint16_t bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+      recycle_buffer_unsafe(bid);
+    }
+
+    // only the lengths matter, the kernel lays both out in the buffer
+    bzero(&recv_msg, sizeof(recv_msg));
+    recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    recv_msg.msg_controllen = CMSG_SPACE(sizeof(int));
+    return arm_receive_unsafe();
+  }
+
+  bool arm_receive_unsafe() {
+    struct io_uring_sqe *sqe = get_sqe(recv_ring);
+    if (sqe == nullptr) {
+      return false;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd;
+    sqe->addr = reinterpret_cast<uint64_t>(&recv_msg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    commit_sqe(recv_ring);
+    recv_armed = submit(recv_ring, 0) >= 0;
+    return recv_armed;
+  }
+
+  bool setup_send() {
+    if (!setup_ring(send_ring, URING_ENTRIES)) {
+      return false;
+    }
+
+    send_buffers = new char[URING_SEND_SLOTS * IP_MAXPACKET];
+    struct iovec iovecs[URING_SEND_SLOTS];
+    for (uint32_t slot = 0; slot < URING_SEND_SLOTS; slot++) {
+      slots[slot].data = send_buffers + slot * IP_MAXPACKET;
+      iovecs[slot].iov_base = slots[slot].data;
+      iovecs[slot].iov_len = IP_MAXPACKET;
+      free_slots.push_back(slot);
+    }
+    // without registered buffers sends still work, they are just pinned on
+    // every call
+    fixed_sends = register_ring(send_ring.fd, IORING_REGISTER_BUFFERS, iovecs,
+                                URING_SEND_SLOTS) == 0;
+    return true;
+  }
+
+  // Frees the slots of completed sends. Failed sends are dropped, the
+  // retransmissions of the perfect link cover for them like for a loss
+  void reap_sends_unsafe() {
+    struct io_uring_cqe *cqe;
+    while ((cqe = peek_cqe(send_ring)) != nullptr) {
+      uint32_t slot = static_cast<uint32_t>(cqe->user_data);
+      int res = cqe->res;
+      uint32_t flags = cqe->flags;
+      cqe_seen(send_ring);
+
+      if (res < 0 && !(flags & IORING_CQE_F_NOTIF)) {
+        if (res == -EINVAL && fixed_sends) {
+          fixed_sends = false; // the kernel predates fixed buffer sends
+        }
+        if (DEBUG)
+          std::cout << "io_uring send failed: " << -res << "\n";
+      }
+      // zero-copy sends hold their buffer until the notification
+      if (!(flags & IORING_CQE_F_MORE)) {
+        free_slots.push_back(slot);
+      }
+    }
+  }
+
+  uint32_t acquire_slot_unsafe() {
+    reap_sends_unsafe();
+    while (free_slots.empty()) {
+      submit(send_ring, 1);
+      reap_sends_unsafe();
+    }
+    uint32_t slot = free_slots.back();
+    free_slots.pop_back();
+    return slot;
+  }
+
+public:
+  explicit UringLink(int sockfd_in) : recv_mtx(), free_slots() {
+    sockfd = sockfd_in;
+    active = false;
+    fixed_sends = false;
+    recv_ring.fd = -1;
+    send_ring.fd = -1;
+    buf_ring = nullptr;
+    recv_buffers = nullptr;
+    send_buffers = nullptr;
+    recv_armed = false;
+
+    if (!IO_URING_BACKEND) {
+      return;
+    }
+    active = setup_receive() && setup_send();
+    if (!active) {
+      std::cout << "io_uring is not available, using socket calls\n";
+      close_ring(recv_ring);
+      close_ring(send_ring);
+    } else if (DEBUG) {
+      std::cout << "Using the io_uring backend"
+                << (fixed_sends ? " with registered buffers" : "") << "\n";
+    }
+  }
+
+  ~UringLink() {
+    close_ring(recv_ring);
+    close_ring(send_ring);
+    if (buf_ring != nullptr) {
+      munmap(buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    delete[] recv_buffers;
+    delete[] send_buffers;
+  }
+
+  bool is_active() { return active; }
+
+  // Readable whenever receive() has something to return
+  int receive_fd() { return recv_ring.fd; }
+
+  // Queues a datagram, or a GSO batch if `segment_size` is set. Nothing
+  // reaches the kernel before submit_sends(). Senders must be serialized,
+  // GsoBatcher does it
+  ssize_t queue_send(node_t *receiver, const char *buffer, ssize_t buff_len,
+                     uint16_t segment_size) {
+    uint32_t slot_id = acquire_slot_unsafe();
+    uring_send_slot_t &slot = slots[slot_id];
+    memcpy(slot.data, buffer, static_cast<size_t>(buff_len));
+
+    bzero(&slot.addr, sizeof(slot.addr));
+    slot.addr.sin_family = AF_INET;
+    slot.addr.sin_port = htons(receiver->port);
+    slot.addr.sin_addr.s_addr = receiver->ip;
+
+    struct io_uring_sqe *sqe = get_sqe(send_ring);
+    if (sqe == nullptr) {
+      submit(send_ring, 0);
+      sqe = get_sqe(send_ring);
+    }
+    sqe->fd = sockfd;
+    sqe->user_data = slot_id;
+
+    if (segment_size > 0) {
+      // the segment size only fits in a control message
+      slot.iov.iov_base = slot.data;
+      slot.iov.iov_len = static_cast<size_t>(buff_len);
+      bzero(&slot.msg, sizeof(slot.msg));
+      bzero(slot.control, sizeof(slot.control));
+      slot.msg.msg_name = &slot.addr;
+      slot.msg.msg_namelen = sizeof(slot.addr);
+      slot.msg.msg_iov = &slot.iov;
+      slot.msg.msg_iovlen = 1;
+      slot.msg.msg_control = slot.control;
+      slot.msg.msg_controllen = sizeof(slot.control);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&slot.msg);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+
+      sqe->opcode = URING_SEND_ZC ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+      sqe->addr = reinterpret_cast<uint64_t>(&slot.msg);
+      sqe->len = 1;
+    } else {
+      sqe->opcode = URING_SEND_ZC ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+      sqe->addr = reinterpret_cast<uint64_t>(slot.data);
+      sqe->len = static_cast<uint32_t>(buff_len);
+      sqe->addr2 = reinterpret_cast<uint64_t>(&slot.addr);
+      sqe->addr_len = sizeof(slot.addr);
+      if (fixed_sends) {
+        sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+        sqe->buf_index = static_cast<uint16_t>(slot_id);
+      }
+    }
+    commit_sqe(send_ring);
+    return buff_len;
+  }
+
+  // Hands every queued send to the kernel in a single call
+  void submit_sends() {
+    submit(send_ring, 0);
+    reap_sends_unsafe();
+  }
+
+  // Copies the next received buffer into `buffer`, possibly several
+  // coalesced datagrams of `segment_size` bytes. Returns -1 with EAGAIN if
+  // nothing arrived
+  ssize_t receive(char *buffer, ssize_t buff_len, uint16_t *segment_size) {
+    std::lock_guard<std::mutex> lock(recv_mtx);
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = peek_cqe(recv_ring)) != nullptr) {
+      int res = cqe->res;
+      uint32_t flags = cqe->flags;
+      cqe_seen(recv_ring);
+
+      if (!(flags & IORING_CQE_F_MORE)) {
+        recv_armed = false; // ran out of buffers, or an error
+      }
+      if (res < 0 || !(flags & IORING_CQE_F_BUFFER)) {
+        continue;
+      }
+
+      uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+      char *base = recv_buffers + bid * URING_RECV_BUFFER_SIZE;
+      struct io_uring_recvmsg_out out;
+      memcpy(&out, base, sizeof(out));
+      char *control = base + sizeof(out) + recv_msg.msg_namelen;
+      char *payload = control + recv_msg.msg_controllen;
+
+      ssize_t len = std::min<ssize_t>(out.payloadlen, buff_len);
+      memcpy(buffer, payload, static_cast<size_t>(len));
+
+      *segment_size = static_cast<uint16_t>(len);
+      struct msghdr control_msg;
+      bzero(&control_msg, sizeof(control_msg));
+      control_msg.msg_control = control;
+      control_msg.msg_controllen = out.controllen;
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&control_msg); cmsg != NULL;
+           cmsg = CMSG_NXTHDR(&control_msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+          int gso_size;
+          memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+          if (gso_size > 0) {
+            *segment_size = static_cast<uint16_t>(gso_size);
+          }
+        }
+      }
+
+      recycle_buffer_unsafe(bid);
+      if (!recv_armed) {
+        arm_receive_unsafe();
+      }
+      if (out.flags & MSG_TRUNC) {
+        continue;
+      }
+      return len;
+    }
+
+    if (!recv_armed) {
+      arm_receive_unsafe();
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+};
+
+#endif
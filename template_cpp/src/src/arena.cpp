@@ -0,0 +1,58 @@
+#include <new>
+
+#include "arena.hpp"
+
+MemoryArena memory_arena;
+
+#if MEMORY_ARENAS
+// Every allocation of the process goes through the arena once it is mapped,
+// the blocks it does not serve through malloc
+
+static void *allocate(size_t size) {
+  void *block = memory_arena.allocate(size);
+  if (block == nullptr) {
+    block = malloc(size == 0 ? 1 : size);
+  }
+  return block;
+}
+
+static void release(void *block) {
+  if (block != nullptr && !memory_arena.release(block)) {
+    free(block);
+  }
+}
+
+void *operator new(size_t size) {
+  void *block = allocate(size);
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size);
+}
+
+void operator delete(void *block) noexcept { release(block); }
+
+void operator delete[](void *block) noexcept { release(block); }
+
+void operator delete(void *block, size_t) noexcept { release(block); }
+
+void operator delete[](void *block, size_t) noexcept { release(block); }
+
+void operator delete(void *block, const std::nothrow_t &) noexcept {
+  release(block);
+}
+
+void operator delete[](void *block, const std::nothrow_t &) noexcept {
+  release(block);
+}
+#endif
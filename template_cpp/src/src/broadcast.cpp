@@ -1,4 +1,7 @@
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "broadcast.hpp"
 #include "messages.hpp"
@@ -6,20 +9,85 @@
 #include "udp.hpp"
 
 void best_effort_broadcast(tcp_handler_t *tcp_handler, payload_t *payload) {
+  SendClass send_class = broadcast_class(tcp_handler, payload);
+
+  if (payload->is_digest) {
+    broadcast_copies(tcp_handler, payload, send_class);
+    return;
+  }
+
+  retransmission_t *retransmission = new_retransmission(tcp_handler, payload);
+  if (MULTICAST_FANOUT) {
+    enqueue_send(tcp_handler, retransmission, tcp_handler->group_node,
+                 send_class);
+  } else {
+    for (node_t *node : *tcp_handler->nodes) {
+      if (DEBUG_V)
+        std::cout << "Broadcasting to " << node->id << "\n";
+      // peers that look crashed get it once they are heard of again
+      if (retransmission->pending[node->id] &&
+          !tcp_handler->detector->is_suspected(node->id)) {
+        enqueue_send(tcp_handler, retransmission, node, send_class);
+      }
+    }
+  }
+  release_retransmission(tcp_handler, retransmission);
+}
+
+void broadcast_copies(tcp_handler_t *tcp_handler, payload_t *payload,
+                      SendClass send_class) {
+  if (MULTICAST_FANOUT) {
+    payload_t *group_payload = new payload_t;
+    copy_payload(group_payload, payload);
+    message_t *message = new message_t;
+    message->recipient = tcp_handler->group_node;
+    message->payload = group_payload;
+    tcp_handler->sending_queue->enqueue(message, send_class);
+    return;
+  }
+
   for (node_t *node : *tcp_handler->nodes) {
-    if (DEBUG_V)
-      std::cout << "Broadcasting to " << node->id << "\n";
-    if (node->id == tcp_handler->current_node->id) {
-      continue; // don't send to yourself
+    if (node->id == tcp_handler->current_node->id ||
+        tcp_handler->detector->is_suspected(node->id)) {
+      continue; // don't send to yourself, nor to crashed peers
     }
     payload_t *broadcast_payload = new payload_t;
-    uint32_t vc_size = vector_clock_size(tcp_handler);
-    copy_payload(broadcast_payload, payload, vc_size);
+    copy_payload(broadcast_payload, payload);
     message_t *message = new message_t;
     message->recipient = node;
     message->payload = broadcast_payload;
-    tcp_handler->sending_queue->enqueue(message);
+    tcp_handler->sending_queue->enqueue(message, send_class);
+  }
+}
+
+SendClass broadcast_class(tcp_handler_t *tcp_handler, payload_t *payload) {
+  if (payload->is_digest) {
+    return SEND_CONTROL;
+  }
+  if (payload->owner_id == tcp_handler->current_node->id) {
+    return SEND_DATA;
+  }
+  return SEND_RELAY;
+}
+
+void delayed_relay(tcp_handler_t *tcp_handler, payload_t *payload) {
+  // parked in the retransmission queue, relays are only sent if the peer has
+  // not acknowledged the packet nor reported it in a digest by then
+  release_retransmission(tcp_handler,
+                         new_retransmission(tcp_handler, payload));
+}
+
+void overlay_broadcast(tcp_handler_t *tcp_handler, payload_t *payload) {
+  SendClass send_class = broadcast_class(tcp_handler, payload);
+  retransmission_t *retransmission = new_retransmission(tcp_handler, payload);
+
+  for (node_t *node : tcp_handler->overlay->targets(payload->owner_id)) {
+    if (retransmission->pending[node->id]) {
+      enqueue_send(tcp_handler, retransmission, node, send_class);
+    }
   }
+  // the rest only hear of it if their digests do not show it in time
+  release_retransmission(tcp_handler, retransmission);
 }
 
 void uniform_reliable_broadcast(tcp_handler_t *tcp_handler, payload_t *payload,
@@ -33,36 +101,89 @@ void uniform_reliable_broadcast(tcp_handler_t *tcp_handler, payload_t *payload,
     }
 
     tcp_handler->delivered->mark_as_seen(payload);
-    best_effort_broadcast(tcp_handler, payload);
+    if (RELAY_SUPPRESSION && tcp_handler->overlay->is_enabled()) {
+      // repairs rely on the digests of the relay suppression
+      overlay_broadcast(tcp_handler, payload);
+    } else if (RELAY_SUPPRESSION && rebroadcast) {
+      delayed_relay(tcp_handler, payload);
+    } else {
+      best_effort_broadcast(tcp_handler, payload);
+    }
   }
   if (rebroadcast) {
     free_payload(payload);
   }
 }
 
-void broadcast_messages(tcp_handler_t *tcp_handler, node_t *sender_node,
-                        uint32_t *enqueued_messages,
-                        uint32_t msgs_to_send_count) {
-  payload_t *payload;
-  payload_t *log_payload;
+bool broadcast(tcp_handler_t *tcp_handler, const char *data, size_t len) {
+  node_t *sender_node = tcp_handler->current_node;
+  uint32_t seq_num = tcp_handler->broadcast_seq + 1;
 
-  while (*enqueued_messages < msgs_to_send_count && (!*tcp_handler->finito)) {
-    if (tcp_handler->sending_queue->size() < SENDING_CHUNK_SIZE) {
+  while (!can_broadcast(tcp_handler) && !*tcp_handler->finito) {
+    // sending queue or receivers are full - wait for them to drain
+    std::this_thread::sleep_for(milliseconds(1));
+  }
+  if (*tcp_handler->finito) {
+    return false;
+  }
+  tcp_handler->broadcast_seq = seq_num;
 
-      uint32_t enqueue_until = std::min(
-          *enqueued_messages + (SENDING_CHUNK_SIZE / 10), msgs_to_send_count);
+  payload_t *payload = new payload_t;
+  // logged along with the clock snapshot, so the output never shows a
+  // delivery before a broadcast that did not depend on it
+  tcp_handler->delivered->with_deliveries_held([&]() {
+    construct_payload(tcp_handler, payload, sender_node, seq_num, data, len);
+    if (DUMP_TO_FILE) {
+      payload_t *logged = new payload_t;
+      copy_payload(logged, payload);
+      tcp_handler->broadcasted_queue->enqueue(logged);
+    }
+  });
+  tcp_handler->sent_log->record(payload);
+  uniform_reliable_broadcast(tcp_handler, payload, false);
+  free_payload(payload);
+  return true;
+}
 
-      while (*enqueued_messages < enqueue_until) {
-        (*enqueued_messages)++;
+bool can_broadcast(tcp_handler_t *tcp_handler) {
+  return tcp_handler->sending_queue->depth(SEND_DATA) < SENDING_CHUNK_SIZE &&
+         tcp_handler->delivered->may_broadcast(tcp_handler->current_node->id,
+                                               tcp_handler->broadcast_seq + 1);
+}
 
-        payload = new payload_t;
+void set_delivery_callback(tcp_handler_t *tcp_handler,
+                           DeliveryCallback callback) {
+  tcp_handler->delivered->on_deliver = callback;
+}
 
-        construct_payload(tcp_handler, payload, sender_node,
-                          *enqueued_messages);
+void broadcast_messages(tcp_handler_t *tcp_handler, node_t *sender_node,
+                        uint32_t *enqueued_messages,
+                        uint32_t msgs_to_send_count) {
+  std::vector<tcp_handler_t *> channels = all_channels(tcp_handler);
+  std::vector<uint32_t> enqueued(channels.size(), 0);
+  uint32_t total = msgs_to_send_count * static_cast<uint32_t>(channels.size());
+
+  while (*enqueued_messages < total && (!*tcp_handler->finito)) {
+    bool progress = false;
+    for (size_t index = 0; index < channels.size(); index++) {
+      // a channel out of credit waits its turn instead of blocking the rest
+      if (enqueued[index] >= msgs_to_send_count ||
+          !can_broadcast(channels[index])) {
+        continue;
+      }
+      std::string msg_content = std::to_string(enqueued[index] + 1);
 
-        uniform_reliable_broadcast(tcp_handler, payload, false);
-        tcp_handler->broadcasted_queue->enqueue(payload);
+      if (!broadcast(channels[index], msg_content.c_str(),
+                     msg_content.length())) {
+        return;
       }
+      enqueued[index]++;
+      (*enqueued_messages)++;
+      progress = true;
+    }
+    if (!progress) {
+      // sending queue or receivers are full - wait for them to drain
+      std::this_thread::sleep_for(milliseconds(1));
     }
   }
 }
@@ -5,94 +5,175 @@
 #include <iostream>
 #include <signal.h>
 #include <sstream>
+#include <string>
 #include <sys/types.h>
 #include <thread>
+#include <vector>
 
+#include "arena.hpp"
 #include "broadcast.hpp"
 #include "common.hpp"
 #include "delivered_set.hpp"
+#include "failure_detector.hpp"
 #include "messages.hpp"
 #include "parser.hpp"
+#include "pipeline.hpp"
 #include "tcp.hpp"
 #include "udp.hpp"
 
 /* #define DUMP_WHEN_ABOVE (MILLION / 5) */
 #define DUMP_WHEN_ABOVE 0
 #define DUMPING_CHUNK (MILLION / 10)
-#define RECEIVER_THREADS_COUNT 1
 
 uint32_t msgs_to_send_count;
 uint32_t enqueued_messages = 0;
 std::atomic<bool> finito = false;
 node_t *myself_node;
 
-tcp_handler_t tcp_handler;
+// What every channel shares, copied into their stacks
+tcp_handler_t transport;
+PipelineConfig pipeline;
 
 std::thread enqueuer_thread;
 std::thread retransmiter_thread;
 std::thread writer_thread;
-std::thread sender_thread;
-std::thread receiver_thread_pool[RECEIVER_THREADS_COUNT];
+std::thread digester_thread;
+std::thread heartbeat_thread;
+std::vector<std::thread> sender_threads;
+std::vector<std::thread> receiver_threads;
+std::vector<std::thread> multicast_receiver_threads;
+std::vector<std::thread> fused_threads;
+
+// The stack of one broadcast channel, on the transport of the process. Its
+// broadcasts and deliveries go to an output file of its own
+struct channel_s {
+  PayloadQueue deliverable;
+  PayloadQueue broadcasted_queue;
+  CausalityMap causality;
+  CausalityMap reverse_causality;
+  DeliveredSet delivered;
+  SpillStore spill;
+  Fragmenter fragments;
+  GapDetector gaps;
+  SentLog sent_log;
+  Overlay overlay;
+  tcp_handler_t handler;
+  std::string output_path;
+
+  channel_s(uint16_t id, const CausalityMap &causality_in,
+            const CausalityMap &reverse_causality_in, size_t spill_bytes,
+            std::string output_path_in)
+      : deliverable(), broadcasted_queue(), causality(causality_in),
+        reverse_causality(reverse_causality_in),
+        delivered(transport.current_node, transport.nodes->size()),
+        spill(spill_bytes), fragments(), gaps(transport.nodes->size()),
+        sent_log(),
+        overlay(static_cast<OverlayMode>(DISSEMINATION_OVERLAY),
+                OVERLAY_FANOUT, transport.current_node, transport.nodes,
+                transport.detector),
+        handler(transport), output_path(output_path_in) {
+    delivered.deliverable = &deliverable;
+    delivered.causality = &causality;
+    delivered.reverse_causality = &reverse_causality;
+    delivered.spill = &spill;
+    transport.detector->watch(&delivered);
+
+    handler.channel_id = id;
+    handler.delivered = &delivered;
+    handler.fragments = &fragments;
+    handler.gaps = &gaps;
+    handler.sent_log = &sent_log;
+    handler.overlay = &overlay;
+    handler.broadcasted_queue = &broadcasted_queue;
+    handler.broadcast_seq = 0;
+  }
+};
+typedef struct channel_s channel_t;
 
-const char *output_path;
+std::vector<channel_t *> channels;
+// their stacks by channel id, see tcp_handler_t::channels
+std::vector<tcp_handler_t *> channel_handlers;
 
 static bool all_delivered() {
-  return enqueued_messages >= msgs_to_send_count &&
-         tcp_handler.sending_queue->size() == 0 &&
-         tcp_handler.retrans_queue->size() == 0;
+  return enqueued_messages >= msgs_to_send_count * channels.size() &&
+         transport.sending_queue->size() == 0 &&
+         transport.retrans_queue->size() == 0;
+}
+
+// Channel 0 writes to the output path, channel K to "channelK-" followed by
+// its file name, so the name still ends with the process id
+static std::string channel_output_path(const std::string &path,
+                                       uint32_t channel_id) {
+  if (channel_id == 0) {
+    return path;
+  }
+  size_t slash = path.find_last_of('/');
+  size_t name = slash == std::string::npos ? 0 : slash + 1;
+  return path.substr(0, name) + "channel" + std::to_string(channel_id) + "-" +
+         path.substr(name);
+}
+
+// Starts `function` on a new thread pinned as the stages in `stages`
+template <typename Function, typename... Args>
+static std::thread spawn(uint32_t stages, Function function, Args... args) {
+  return std::thread([=]() {
+    pipeline.pin(stages);
+    function(args...);
+  });
 }
 
 static void join_threads() {
-  for (int i = 0; i < RECEIVER_THREADS_COUNT; i++) {
-    receiver_thread_pool[i].join();
+  for (std::thread &thread : receiver_threads) {
+    thread.join();
+  }
+  for (std::thread &thread : multicast_receiver_threads) {
+    thread.join();
+  }
+  for (std::thread &thread : sender_threads) {
+    thread.join();
+  }
+  for (std::thread &thread : fused_threads) {
+    thread.join();
   }
 
-  sender_thread.join();
-  retransmiter_thread.join();
+  if (retransmiter_thread.joinable())
+    retransmiter_thread.join();
   writer_thread.join();
   enqueuer_thread.join();
+  if (RELAY_SUPPRESSION)
+    digester_thread.join();
+  heartbeat_thread.join();
 }
 
-static void dump_to_output(uint32_t until_size = 0) {
+static void dump_to_output(channel_t *channel, uint32_t until_size = 0) {
   if (DEBUG)
     std::cout << "Dumping to file...\n";
 
-  std::ofstream output_file(output_path, std::ios_base::app);
+  std::ofstream output_file(channel->output_path, std::ios_base::app);
 
   uint32_t zero = 0; // ensuring types match in max
   until_size = std::max(until_size, zero);
 
-  while (tcp_handler.broadcasted_queue->size() > until_size) {
-    payload_t *payload = tcp_handler.broadcasted_queue->dequeue();
-
-    output_file << "b " << buff_as_str(payload->buffer, payload->buff_size)
-                << "\n";
-    free_payload(payload);
-  }
-
-  while (tcp_handler.delivered->deliverable->size() > until_size) {
-    payload_t *payload = tcp_handler.delivered->deliverable->dequeue();
-
-    output_file << "d " << payload->owner_id << " "
-                << buff_as_str(payload->buffer, payload->buff_size) << "\n";
-    free_payload(payload);
-  }
+  write_output(output_file, &channel->broadcasted_queue,
+               &channel->deliverable, until_size);
 
   output_file.close();
 }
 
 static void keep_dumping_to_output() {
-  while (!*tcp_handler.finito) {
-    uint32_t current_size = tcp_handler.delivered->deliverable->size();
+  while (!*transport.finito) {
+    for (channel_t *channel : channels) {
+      uint32_t current_size = channel->deliverable.size();
 
-    uint32_t until_size = current_size - DUMPING_CHUNK;
+      uint32_t until_size = current_size - DUMPING_CHUNK;
 
-    if (until_size > current_size) {
-      until_size = 0;
-    }
+      if (until_size > current_size) {
+        until_size = 0;
+      }
 
-    if ((current_size > DUMP_WHEN_ABOVE) && DUMP_TO_FILE) {
-      dump_to_output(until_size);
+      if ((current_size > DUMP_WHEN_ABOVE) && DUMP_TO_FILE) {
+        dump_to_output(channel, until_size);
+      }
     }
   }
 }
@@ -112,7 +193,17 @@ static void stop(int) {
     std::cout << "Dumping...\n";
 
   if (DUMP_TO_FILE)
-    dump_to_output();
+    for (channel_t *channel : channels) {
+      dump_to_output(channel);
+    }
+
+  if (transport.capture != nullptr)
+    transport.capture->flush();
+
+  memory_arena.show(true);
+  for (channel_t *channel : channels) {
+    channel->spill.show();
+  }
 
   if (DEBUG)
     std::cout << "Joining...\n";
@@ -122,8 +213,8 @@ static void stop(int) {
   if (DEBUG)
     std::cout << "Releasing memory...\n";
 
-  for (size_t index = 0; index < tcp_handler.nodes->size(); ++index) {
-    node_t *node = (*tcp_handler.nodes)[index];
+  for (size_t index = 0; index < transport.nodes->size(); ++index) {
+    node_t *node = (*transport.nodes)[index];
     delete node;
   }
 
@@ -139,6 +230,8 @@ int main(int argc, char **argv) {
 
   Parser parser(argc, argv);
   parser.parse();
+  pipeline.load();
+  pipeline.show();
 
   auto hosts = parser.hosts();
   std::vector<node_t *> nodes;
@@ -151,22 +244,15 @@ int main(int argc, char **argv) {
     nodes.push_back(node);
   }
 
-  output_path = parser.outputPath();
-
-  // clean output file
-  std::ofstream output_file;
-  output_file.open(output_path, std::ofstream::out | std::ofstream::trunc);
-  output_file.close();
+  uint32_t channel_count = channels_from_env();
 
   std::ifstream configFile(parser.configPath());
   uint32_t receiver_id;
   bool should_send_messages = true;
   node_t *receiver_node;
 
-  MessagesQueue sending_queue;
-  MessagesQueue retrans_queue;
-  PayloadQueue deliverable;
-  PayloadQueue broadcasted_queue;
+  SendScheduler sending_queue;
+  RetransmissionQueue retrans_queue;
   CausalityMap causality;
   CausalityMap reverse_causality;
 
@@ -199,45 +285,117 @@ int main(int argc, char **argv) {
 
   configFile.close();
 
+  // every channel has packets in flight
+  memory_arena.reserve(nodes.size(),
+                       std::min<uint32_t>(msgs_to_send_count, CREDIT_WINDOW) *
+                           channel_count);
+  memory_arena.show(false);
+
   uint32_t my_id = static_cast<uint32_t>(parser.id());
   myself_node = nodes[get_node_idx_by_id(&nodes, my_id)];
 
-  DeliveredSet delivered = DeliveredSet(myself_node, nodes.size());
-  delivered.deliverable = &deliverable;
-  delivered.causality = &causality;
-  delivered.reverse_causality = &reverse_causality;
-
-  tcp_handler.sockfd = bind_socket(myself_node->port);
-  tcp_handler.finito = &finito;
-  tcp_handler.current_node = myself_node;
-  tcp_handler.nodes = &nodes;
-
-  tcp_handler.sending_queue = &sending_queue;
-  tcp_handler.retrans_queue = &retrans_queue;
-  tcp_handler.broadcasted_queue = &broadcasted_queue;
-  tcp_handler.delivered = &delivered;
+  FecCodec fec = FecCodec(myself_node->id);
+  FailureDetector detector = FailureDetector(nodes.size());
+  TraceWriter capture = TraceWriter(getenv(CAPTURE_ENV), myself_node->id,
+                                    &nodes, &causality);
+
+  transport.sockfd = bind_socket(myself_node->port);
+  UringLink uring = UringLink(transport.sockfd);
+  GsoBatcher gso = GsoBatcher(transport.sockfd, &uring);
+
+  node_t group_node;
+  group_node.id = MULTICAST_NODE_ID;
+  group_node.ip = inet_addr(MULTICAST_GROUP);
+  group_node.port = htons(MULTICAST_PORT);
+  transport.group_node = &group_node;
+
+  if (MULTICAST_FANOUT) {
+    enable_multicast_sending(transport.sockfd, myself_node->ip);
+    transport.multicast_sockfd =
+        bind_multicast_socket(&group_node, myself_node->ip);
+  }
+  transport.finito = &finito;
+  transport.current_node = myself_node;
+  transport.nodes = &nodes;
+
+  transport.sending_queue = &sending_queue;
+  transport.retrans_queue = &retrans_queue;
+  transport.fec = &fec;
+  transport.detector = &detector;
+  transport.gso = &gso;
+  transport.uring = &uring;
+  transport.pipeline = &pipeline;
+  transport.reliability = reliability_from_env();
+  transport.capture = capture.is_enabled() ? &capture : nullptr;
+  transport.channels = channel_count > 1 ? &channel_handlers : nullptr;
+
+  // channels split the spill threshold, and share the config
+  size_t spill_bytes = SpillStore::threshold_from_env() / channel_count;
+  for (uint32_t channel_id = 0; channel_id < channel_count; channel_id++) {
+    channel_t *channel = new channel_t(
+        static_cast<uint16_t>(channel_id), causality, reverse_causality,
+        spill_bytes, channel_output_path(parser.outputPath(), channel_id));
+    // clean output file
+    std::ofstream output_file;
+    output_file.open(channel->output_path,
+                     std::ofstream::out | std::ofstream::trunc);
+    output_file.close();
+
+    channels.push_back(channel);
+    channel_handlers.push_back(&channel->handler);
+  }
+  // the threads start from channel 0 and find the others through it
+  tcp_handler_t *tcp_handler = &channels[0]->handler;
 
   if (DEBUG)
     std::cout << "Spawning threads...\n";
 
   // Spawn threads for receiving messages
-  for (int i = 0; i < RECEIVER_THREADS_COUNT; i++) {
-    receiver_thread_pool[i] =
-        std::thread(keep_receiving_messages, &tcp_handler);
+  for (uint32_t i = 0; i < pipeline.threads(STAGE_RECEIVER); i++) {
+    receiver_threads.push_back(
+        spawn(1u << STAGE_RECEIVER, keep_receiving_messages, tcp_handler));
   }
 
-  // Spawn thread for sending messages
-  sender_thread = std::thread(keep_sending_messages_from_queue, &tcp_handler);
+  if (MULTICAST_FANOUT)
+    for (uint32_t i = 0; i < pipeline.threads(STAGE_MULTICAST); i++) {
+      multicast_receiver_threads.push_back(
+          spawn(1u << STAGE_MULTICAST, keep_receiving_multicast_messages,
+                tcp_handler));
+    }
+
+  // Spawn threads for sending messages
+  for (uint32_t i = 0; i < pipeline.threads(STAGE_SENDER); i++) {
+    sender_threads.push_back(spawn(
+        1u << STAGE_SENDER, keep_sending_messages_from_queue, tcp_handler));
+  }
+
+  // Spawn threads running several stages in turn
+  for (uint32_t stages : pipeline.fused()) {
+    fused_threads.push_back(
+        spawn(stages, run_fused_stages, tcp_handler, stages));
+  }
 
   // Spawn thread for enqueuing messages
-  enqueuer_thread = std::thread(broadcast_messages, &tcp_handler, myself_node,
-                                &enqueued_messages, msgs_to_send_count);
+  enqueuer_thread =
+      spawn(1u << STAGE_ENQUEUER, broadcast_messages, tcp_handler,
+            myself_node, &enqueued_messages, msgs_to_send_count);
 
   // Spawn thread for retransmitting messages
-  retransmiter_thread = std::thread(keep_retransmitting_messages, &tcp_handler);
+  if (pipeline.threads(STAGE_RETRANSMITTER) > 0)
+    retransmiter_thread = spawn(1u << STAGE_RETRANSMITTER,
+                                keep_retransmitting_messages, tcp_handler);
 
   // Spawn thread for dumping messages
-  writer_thread = std::thread(keep_dumping_to_output);
+  writer_thread = spawn(1u << STAGE_WRITER, keep_dumping_to_output);
+
+  // Spawn thread for detecting crashed peers
+  heartbeat_thread =
+      spawn(1u << STAGE_HEARTBEAT, keep_sending_heartbeats, tcp_handler);
+
+  // Spawn thread for advertising digests of seen messages
+  if (RELAY_SUPPRESSION)
+    digester_thread =
+        spawn(1u << STAGE_DIGESTER, keep_sending_digests, tcp_handler);
 
   if (!KEEP_ALIVE) {
     while (!all_delivered()) {
@@ -248,5 +406,6 @@ int main(int argc, char **argv) {
   }
 
   join_threads();
+  memory_arena.show(true);
   return 0;
 }
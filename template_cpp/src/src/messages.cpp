@@ -1,9 +1,11 @@
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <math.h>
 #include <string>
 
 #include "common.hpp"
+#include "fragments.hpp"
 #include "messages.hpp"
 #include "tcp.hpp"
 
@@ -15,74 +17,263 @@ std::string buff_as_str(char *buffer, ssize_t size) {
 ssize_t encode_udp_payload(struct tcp_handler_s *h, payload_t *payload,
                            char *buffer, ssize_t buff_size) {
 
-  uint32_t vc_size = vector_clock_size(h);
+  uint16_t vc_len = static_cast<uint16_t>(payload->vc_len);
+  uint8_t flags =
+      static_cast<uint8_t>((payload->is_ack ? FLAG_ACK : 0) |
+                           (payload->is_digest ? FLAG_DIGEST : 0) |
+                           (payload->is_heartbeat ? FLAG_HEARTBEAT : 0) |
+                           (payload->sparse_clock ? FLAG_SPARSE_CLOCK : 0) |
+                           (payload->is_fragment ? FLAG_FRAGMENT : 0) |
+                           (payload->is_nack ? FLAG_NACK : 0));
 
   if (DEBUG_V) {
     std::cout << "Encoding...\n";
-    show_vector_clock(payload->vector_clock, vc_size);
+    show_payload_clock(payload);
   }
 
   memcpy(buffer, &payload->packet_uid, 4);
   memcpy(buffer + 4, &payload->sender_id, 4);
   memcpy(buffer + 8, &payload->owner_id, 4);
-  memcpy(buffer + 12, &payload->is_ack, 1);
-  memcpy(buffer + 13, payload->buffer, buff_size);
-  memcpy(buffer + 13 + buff_size, payload->vector_clock, vc_size * 4);
+  memcpy(buffer + 12, &flags, 1);
+  memcpy(buffer + 13, &payload->credit, 4);
+  memcpy(buffer + 17, &vc_len, 2);
+  memcpy(buffer + 19, &payload->channel_id, 2);
+  memcpy(buffer + PAYLOAD_META_SIZE, payload->buffer, buff_size);
+  memcpy(buffer + PAYLOAD_META_SIZE + buff_size, payload->vector_clock,
+         vc_len * 4);
 
   if (DEBUG_V)
     std::cout << "Encoded!\n";
 
-  return 13 + buff_size + vc_size * 4;
+  return PAYLOAD_META_SIZE + buff_size + vc_len * 4;
 }
 
-void decode_udp_payload(struct tcp_handler_s *h, payload_t *payload,
+bool decode_udp_payload(struct tcp_handler_s *h, payload_t *payload,
                         char *buffer, size_t datagram_len) {
+  uint8_t flags;
+  uint16_t vc_len;
+
   if (DEBUG_V)
     std::cout << "Decoding...\n";
+  if (datagram_len < PAYLOAD_META_SIZE) {
+    return false;
+  }
   memcpy(&payload->packet_uid, buffer, 4);
   memcpy(&payload->sender_id, buffer + 4, 4);
   memcpy(&payload->owner_id, buffer + 8, 4);
-  memcpy(&payload->is_ack, buffer + 12, 1);
+  memcpy(&flags, buffer + 12, 1);
+  memcpy(&payload->credit, buffer + 13, 4);
+  memcpy(&vc_len, buffer + 17, 2);
+  memcpy(&payload->channel_id, buffer + 19, 2);
+  payload->is_ack = flags & FLAG_ACK;
+  payload->is_digest = flags & FLAG_DIGEST;
+  payload->is_heartbeat = flags & FLAG_HEARTBEAT;
+  payload->sparse_clock = flags & FLAG_SPARSE_CLOCK;
+  payload->is_fragment = flags & FLAG_FRAGMENT;
+  payload->is_nack = flags & FLAG_NACK;
 
-  uint32_t vc_size = vector_clock_size(h);
-  payload->vector_clock = new uint32_t[vc_size];
+  if (datagram_len < PAYLOAD_META_SIZE + vc_len * 4u) {
+    return false; // truncated, or a corrupted clock length
+  }
+  payload->vc_len = vc_len;
+  ssize_t buff_size = static_cast<ssize_t>(datagram_len - PAYLOAD_META_SIZE -
+                                           vc_len * 4u);
+  const char *clock = buffer + PAYLOAD_META_SIZE + buff_size;
+  if (h != nullptr && !is_valid_payload(h, payload, buff_size, clock)) {
+    return false;
+  }
 
-  ssize_t buff_size = datagram_len - PAYLOAD_META_SIZE - vc_size * 4;
+  payload->vector_clock = new uint32_t[vc_len];
   payload->buffer = new char[buff_size];
 
-  memcpy(payload->buffer, buffer + 13, buff_size);
-  memcpy(payload->vector_clock, buffer + 13 + buff_size, vc_size * 4);
+  memcpy(payload->buffer, buffer + PAYLOAD_META_SIZE, buff_size);
+  memcpy(payload->vector_clock, clock, vc_len * 4);
 
   payload->buff_size = buff_size;
 
   if (DEBUG_V) {
-    show_vector_clock(payload->vector_clock, vc_size);
+    show_payload_clock(payload);
     std::cout << "Decoded!\n";
   }
+  return true;
 }
 
-void copy_payload(payload_t *dest, payload_t *source, uint32_t vc_size) {
+bool is_valid_payload(struct tcp_handler_s *h, payload_t *payload,
+                      ssize_t buff_size, const char *clock) {
+  uint32_t processes = static_cast<uint32_t>(h->nodes->size());
+  uint32_t vc_size = vector_clock_size(h);
+
+  if (payload->sender_id < 1 || payload->sender_id > processes ||
+      payload->owner_id < 1 || payload->owner_id > processes) {
+    return false;
+  }
+  if (payload->is_digest &&
+      buff_size != static_cast<ssize_t>(2 * vc_size * sizeof(uint32_t))) {
+    return false;
+  }
+  if (payload->is_heartbeat && buff_size != 0) {
+    return false;
+  }
+  if (!payload->sparse_clock) {
+    // fragments carry their clock inside the reassembled payload
+    return payload->vc_len == vc_size ||
+           (payload->is_fragment && payload->vc_len == 0);
+  }
+  if (payload->vc_len % 2 != 0) {
+    return false;
+  }
+  for (uint32_t i = 0; i < payload->vc_len; i += 2) {
+    uint32_t dependency;
+    memcpy(&dependency, clock + i * 4, 4);
+    if (dependency < 1 || dependency > processes) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes fragment `index` of the `total` bytes long serialized payload
+// `whole` as a datagram of its own
+ssize_t encode_fragment(payload_t *payload, const char *whole, uint32_t total,
+                        uint32_t index, char *buffer) {
+  uint8_t flags = FLAG_FRAGMENT;
+  uint32_t credit = 0;
+  uint16_t vc_len = 0;
+  uint32_t count = Fragmenter::fragment_count(total);
+  uint32_t offset = index * FRAGMENT_CHUNK_SIZE;
+  uint32_t chunk_len = std::min<uint32_t>(FRAGMENT_CHUNK_SIZE, total - offset);
+
+  memcpy(buffer, &payload->packet_uid, 4);
+  memcpy(buffer + 4, &payload->sender_id, 4);
+  memcpy(buffer + 8, &payload->owner_id, 4);
+  memcpy(buffer + 12, &flags, 1);
+  memcpy(buffer + 13, &credit, 4);
+  memcpy(buffer + 17, &vc_len, 2);
+  memcpy(buffer + 19, &payload->channel_id, 2);
+  memcpy(buffer + PAYLOAD_META_SIZE, &index, 4);
+  memcpy(buffer + PAYLOAD_META_SIZE + 4, &count, 4);
+  memcpy(buffer + PAYLOAD_META_SIZE + 8, &total, 4);
+  memcpy(buffer + PAYLOAD_META_SIZE + FRAGMENT_HEADER_SIZE, whole + offset,
+         chunk_len);
+
+  return PAYLOAD_META_SIZE + FRAGMENT_HEADER_SIZE + chunk_len;
+}
+
+void copy_payload(payload_t *dest, payload_t *source) {
   if (DEBUG_V)
     std::cout << "Copying...\n";
   dest->buffer = new char[source->buff_size];
-  dest->vector_clock = new uint32_t[vc_size];
+  dest->vector_clock = new uint32_t[source->vc_len];
+  dest->sparse_clock = source->sparse_clock;
+  dest->vc_len = source->vc_len;
   dest->buff_size = source->buff_size;
   dest->packet_uid = source->packet_uid;
   dest->sender_id = source->sender_id;
   dest->owner_id = source->owner_id;
   dest->is_ack = source->is_ack;
+  dest->is_digest = source->is_digest;
+  dest->is_heartbeat = source->is_heartbeat;
+  dest->is_fragment = source->is_fragment;
+  dest->is_nack = source->is_nack;
+  dest->credit = source->credit;
+  dest->channel_id = source->channel_id;
   memcpy(dest->buffer, source->buffer, source->buff_size);
-  memcpy(dest->vector_clock, source->vector_clock, vc_size * 4);
+  memcpy(dest->vector_clock, source->vector_clock, source->vc_len * 4);
 
   if (DEBUG_V)
     std::cout << "Copied!\n";
 }
 
+void project_vector_clock(payload_t *payload, uint32_t *vector_clock,
+                          std::vector<uint32_t> &dependencies,
+                          uint32_t vc_size, uint32_t *carried) {
+  // FIFO delivers the owner's previous packets first, and their clocks
+  // already hold the receiver to `carried`: only what grew since is sent.
+  // A previous packet that is lost or late does not weaken this: a receiver
+  // only checks the clock of an owner's next packet in line, so this one
+  // waits for it whatever order they arrive in, and a packet's clock never
+  // changes as it is relayed, retransmitted or resent from the log
+  std::vector<uint32_t> grown;
+  for (uint32_t dependency : dependencies) {
+    uint32_t value = vector_clock[dependency];
+    if (value > carried[dependency]) {
+      grown.push_back(dependency);
+      grown.push_back(value);
+      carried[dependency] = value;
+    }
+  }
+
+  // pairs take twice the room of a value, past that a dense clock is smaller
+  payload->sparse_clock = grown.size() < vc_size;
+
+  if (!payload->sparse_clock) {
+    payload->vc_len = vc_size;
+    payload->vector_clock = new uint32_t[vc_size];
+    for (uint32_t i = 0; i < vc_size; i++) {
+      payload->vector_clock[i] = carried[i];
+    }
+    return;
+  }
+
+  payload->vc_len = static_cast<uint32_t>(grown.size());
+  payload->vector_clock = new uint32_t[payload->vc_len];
+  std::copy(grown.begin(), grown.end(), payload->vector_clock);
+}
+
+void clear_vector_clock(payload_t *payload) {
+  payload->sparse_clock = true;
+  payload->vc_len = 0;
+  payload->vector_clock = new uint32_t[0];
+}
+
+void show_payload_clock(payload_t *payload) {
+  if (DEBUG) {
+    std::cout << "Vector clock: ";
+    for (uint32_t i = 0; i < payload->vc_len; i++) {
+      if (payload->sparse_clock) {
+        std::cout << payload->vector_clock[i] << ":";
+        i++;
+      }
+      std::cout << payload->vector_clock[i] << " ";
+    }
+    std::cout << "\n";
+  }
+}
+
 void free_message(message_t *message) {
-  free_payload(message->payload);
+  if (message->retransmission == nullptr) {
+    free_payload(message->payload);
+  }
   delete message;
 }
 
+void free_retransmission(retransmission_t *retransmission) {
+  free_payload(retransmission->payload);
+  delete retransmission;
+}
+
+void write_output(std::ostream &output, PayloadQueue *broadcasted,
+                  PayloadQueue *deliverable, uint32_t until_size) {
+  // a broadcast is queued before any delivery that followed it, so writing
+  // every broadcast queued by now first keeps them in order
+  uint32_t deliveries = deliverable->size();
+  while (broadcasted->size() > 0) {
+    payload_t *payload = broadcasted->dequeue();
+
+    output << "b " << buff_as_str(payload->buffer, payload->buff_size)
+           << "\n";
+    free_payload(payload);
+  }
+
+  for (; deliveries > until_size; deliveries--) {
+    payload_t *payload = deliverable->dequeue();
+
+    output << "d " << payload->owner_id << " "
+           << buff_as_str(payload->buffer, payload->buff_size) << "\n";
+    free_payload(payload);
+  }
+}
+
 void free_payload(payload_t *payload) {
   delete[] payload->buffer;
   delete[] payload->vector_clock;
@@ -94,6 +285,15 @@ void show_payload(payload_t *payload, struct tcp_handler_s *h) {
     if (payload->is_ack) {
       std::cout << "ACK ";
     }
+    if (payload->is_digest) {
+      std::cout << "DIGEST ";
+    }
+    if (payload->is_heartbeat) {
+      std::cout << "HEARTBEAT ";
+    }
+    if (payload->is_nack) {
+      std::cout << "NACK ";
+    }
     std::cout << "Payload: "
               << "{ message: "
               << buff_as_str(payload->buffer, payload->buff_size)
@@ -104,8 +304,11 @@ void show_payload(payload_t *payload, struct tcp_handler_s *h) {
     if (h != NULL) {
       std::cout << ", VC: ";
 
-      uint32_t vc_size = vector_clock_size(h);
-      for (uint32_t i = 0; i < vc_size; i++) {
+      for (uint32_t i = 0; i < payload->vc_len; i++) {
+        if (payload->sparse_clock) {
+          std::cout << payload->vector_clock[i] << ":";
+          i++;
+        }
         std::cout << payload->vector_clock[i] << " ";
       }
     }
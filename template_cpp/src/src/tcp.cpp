@@ -2,6 +2,7 @@
 #include <cassert>
 #include <chrono>
 #include <iostream>
+#include <stdexcept>
 #include <sys/types.h>
 #include <thread>
 #include <utility>
@@ -18,127 +19,694 @@
 using namespace std::chrono;
 
 void keep_receiving_messages(tcp_handler_t *tcp_handler) {
-  bool should_alloc = true;
-  ssize_t buff_size;
-  message_t *message;
-  payload_t *payload;
+  receive_messages(tcp_handler, tcp_handler->sockfd);
+}
 
-  while (!*tcp_handler->finito)
-    if (select_socket(tcp_handler->sockfd, 0, MAX_PACKET_WAIT_MS)) {
+void keep_receiving_multicast_messages(tcp_handler_t *tcp_handler) {
+  receive_messages(tcp_handler, tcp_handler->multicast_sockfd);
+}
 
-      if (should_alloc)
-        payload = new payload_t;
+void receive_messages(tcp_handler_t *tcp_handler, int sockfd) {
+  receiver_t receiver;
+  init_receiver(tcp_handler, &receiver, sockfd);
+  int wait_ms =
+      tcp_handler->pipeline->busy_poll(STAGE_RECEIVER) ? 0 : MAX_PACKET_WAIT_MS;
 
-      buff_size =
-          receive_udp_payload(tcp_handler, tcp_handler->sockfd, payload);
+  while (!*tcp_handler->finito) {
+    receive_message(tcp_handler, &receiver, wait_ms);
+  }
 
-      bool should_alloc = buff_size < 0;
-      if (buff_size < 0) {
-        continue;
-      }
+  delete receiver.batch;
+}
 
-      if (!payload->is_ack) {
-        node_t *sender_node = (*tcp_handler->nodes)[get_node_idx_by_id(
-            tcp_handler->nodes, payload->sender_id)];
+void init_receiver(tcp_handler_t *tcp_handler, receiver_t *receiver,
+                   int sockfd) {
+  receiver->sockfd = sockfd;
+  receiver->poll_fd = readable_fd(tcp_handler, sockfd);
+  receiver->batch = new gro_batch_t;
+}
 
-        payload_t *ack_payload = new payload_t;
+bool receive_message(tcp_handler_t *tcp_handler, receiver_t *receiver,
+                     int wait_ms) {
+  if (!has_pending_segments(receiver->batch) &&
+      select_socket(receiver->poll_fd, 0, wait_ms) <= 0) {
+    return false;
+  }
 
-        uint32_t vc_size = vector_clock_size(tcp_handler);
-        copy_payload(ack_payload, payload, vc_size);
-        ack_payload->is_ack = true;
+  payload_t *payload = new payload_t;
+  ssize_t buff_size = receive_udp_payload(tcp_handler, receiver->sockfd,
+                                          receiver->batch, payload);
+  if (buff_size < 0) {
+    delete payload; // nothing decoded into it
+    return false;
+  }
 
-        message = new message_t;
-        message->recipient = sender_node;
-        message->payload = ack_payload;
-        tcp_handler->sending_queue->enqueue(message);
-      }
+  dispatch_payload(tcp_handler, payload);
+  return true;
+}
 
-      tcp_handler->delivered->insert(payload->sender_id, payload);
+void dispatch_payload(tcp_handler_t *tcp_handler, payload_t *payload) {
+  tcp_handler_t *channel = channel_of(tcp_handler, payload->channel_id);
+  if (channel == nullptr) {
+    // a channel this process does not serve
+    free_payload(payload);
+    return;
+  }
+  handle_payload(channel, payload);
+}
 
-      uniform_reliable_broadcast(tcp_handler, payload);
+void handle_payload(tcp_handler_t *tcp_handler, payload_t *payload) {
+  if (payload->sender_id == tcp_handler->current_node->id) {
+    // our own multicast looped back
+    free_payload(payload);
+    return;
+  }
+
+  // any datagram is a proof of life
+  for (retransmission_t *resumed :
+       tcp_handler->detector->heard_from(payload->sender_id)) {
+    // due right away, the peer missed it while it looked crashed
+    resumed->sending_time =
+        ProtocolClock::now() - milliseconds(RETRANSMISSION_OFFSET_MS + 1);
+    tcp_handler->retrans_queue->enqueue(resumed);
+  }
+
+  if (payload->is_heartbeat) {
+    // nothing but a proof of life, for every channel at once
+    free_payload(payload);
+    return;
+  }
+
+  if (payload->is_digest) {
+    // watermarks, then the credits ACKs carry in case some were lost
+    uint32_t vc_size = vector_clock_size(tcp_handler);
+    std::vector<uint32_t> body(2 * vc_size, 0);
+    memcpy(body.data(), payload->buffer,
+           std::min(static_cast<size_t>(payload->buff_size),
+                    body.size() * sizeof(uint32_t)));
+    tcp_handler->delivered->insert_digest(payload->sender_id, body.data());
+    if (tcp_handler->delivered->take_catch_up(payload->sender_id)) {
+      catch_up(tcp_handler, payload->sender_id);
     }
+    for (uint32_t owner_id = 1; owner_id < vc_size; owner_id++) {
+      tcp_handler->delivered->update_credit(payload->sender_id, owner_id,
+                                            body[vc_size + owner_id]);
+    }
+    free_payload(payload);
+    return;
+  }
+
+  if (payload->is_nack) {
+    resend_nacked(tcp_handler, payload);
+    free_payload(payload);
+    return;
+  }
+
+  if (payload->is_fragment && !reassemble_fragment(tcp_handler, &payload)) {
+    return;
+  }
+
+  if (payload->is_ack) {
+    tcp_handler->delivered->update_credit(payload->sender_id, payload->owner_id,
+                                          payload->credit);
+  } else if (!tcp_handler->delivered->within_credit(payload->owner_id,
+                                                    payload->packet_uid)) {
+    // no room for it - the sender will retry once we advertise more
+    free_payload(payload);
+    return;
+  }
+
+  if (!payload->is_ack && tcp_handler->delivered->was_seen(payload)) {
+    // the peer does not know we have it
+    tcp_handler->delivered->request_digest();
+  }
+  if (!payload->is_ack && tcp_handler->reliability == RELIABILITY_ACK) {
+    send_ack(tcp_handler, payload);
+  } else if (!payload->is_ack) {
+    send_nacks(tcp_handler, payload);
+  }
+
+  tcp_handler->delivered->insert(payload->sender_id, payload);
+
+  uniform_reliable_broadcast(tcp_handler, payload);
+}
+
+void send_ack(tcp_handler_t *tcp_handler, payload_t *payload) {
+  node_t *sender_node = (*tcp_handler->nodes)[get_node_idx_by_id(
+      tcp_handler->nodes, payload->sender_id)];
+
+  payload_t *ack_payload = new payload_t;
+  construct_ack_payload(tcp_handler, ack_payload, payload);
+
+  message_t *message = new message_t;
+  message->recipient = sender_node;
+  message->payload = ack_payload;
+  tcp_handler->sending_queue->enqueue(message, SEND_CONTROL);
+}
+
+Reliability reliability_from_env() {
+  const char *mode = getenv(RELIABILITY_ENV);
+  if (mode == NULL || strcmp(mode, "ack") == 0) {
+    return RELIABILITY_ACK;
+  }
+  if (strcmp(mode, "nack") == 0) {
+    return RELIABILITY_NACK;
+  }
+  throw std::runtime_error(std::string(RELIABILITY_ENV) +
+                           ": expected ack or nack");
+}
+
+uint32_t channels_from_env() {
+  const char *value = getenv(CHANNELS_ENV);
+  if (value == NULL || *value == '\0') {
+    return 1;
+  }
+  unsigned long channels = 0;
+  try {
+    channels = std::stoul(value);
+  } catch (std::logic_error &) {
+  }
+  if (channels == 0 || channels > MAX_CHANNELS) {
+    throw std::runtime_error(std::string(CHANNELS_ENV) +
+                             ": expected 1 to " +
+                             std::to_string(MAX_CHANNELS) + " channels");
+  }
+  return static_cast<uint32_t>(channels);
+}
+
+void send_nacks(tcp_handler_t *tcp_handler, payload_t *payload) {
+  if (payload->sender_id != payload->owner_id) {
+    return; // relays skip packets by design
+  }
+  std::vector<PacketID> missing;
+  for (PacketID uid : tcp_handler->gaps->skipped(payload->owner_id,
+                                                 payload->packet_uid)) {
+    if (!tcp_handler->delivered->holds(tcp_handler->current_node->id,
+                                       payload->owner_id, uid)) {
+      missing.push_back(uid);
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
+
+  node_t *owner_node = (*tcp_handler->nodes)[get_node_idx_by_id(
+      tcp_handler->nodes, payload->owner_id)];
+  for (size_t first = 0; first < missing.size(); first += NACK_MAX_UIDS) {
+    payload_t *nack = new payload_t;
+    construct_nack_payload(tcp_handler, nack, payload->owner_id,
+                           missing.data() + first,
+                           std::min<size_t>(NACK_MAX_UIDS,
+                                            missing.size() - first));
+    message_t *message = new message_t;
+    message->recipient = owner_node;
+    message->payload = nack;
+    tcp_handler->sending_queue->enqueue(message, SEND_CONTROL);
+  }
+}
+
+void resend_nacked(tcp_handler_t *tcp_handler, payload_t *nack) {
+  node_t *peer = (*tcp_handler->nodes)[get_node_idx_by_id(
+      tcp_handler->nodes, nack->sender_id)];
+  size_t count = static_cast<size_t>(nack->buff_size) / sizeof(PacketID);
+
+  for (size_t i = 0; i < count; i++) {
+    PacketID uid;
+    memcpy(&uid, nack->buffer + i * sizeof(PacketID), sizeof(PacketID));
+    if (tcp_handler->delivered->holds(peer->id, nack->owner_id, uid)) {
+      continue;
+    }
+    payload_t *payload = tcp_handler->sent_log->copy(uid);
+    if (payload == nullptr) {
+      continue; // stable by now, the peer has it
+    }
+    message_t *message = new message_t;
+    message->recipient = peer;
+    message->payload = payload;
+    tcp_handler->sending_queue->enqueue(message, SEND_RETRANSMISSION);
+  }
+}
+
+void catch_up(tcp_handler_t *tcp_handler, uint32_t peer_id) {
+  PacketID from = tcp_handler->delivered->held_up_to(
+      peer_id, tcp_handler->current_node->id);
+  for (payload_t *payload : tcp_handler->sent_log->copy_from(from)) {
+    // reliable from there on, like any other retransmission
+    release_retransmission(tcp_handler,
+                           new_retransmission(tcp_handler, payload));
+    free_payload(payload);
+  }
+}
+
+bool reassemble_fragment(tcp_handler_t *tcp_handler, payload_t **payload) {
+  payload_t *fragment = *payload;
+
+  if (fragment->is_ack) {
+    tcp_handler->fragments->acked(fragment->sender_id, fragment);
+    free_payload(fragment);
+    return false;
+  }
+  if (!tcp_handler->delivered->within_credit(fragment->owner_id,
+                                             fragment->packet_uid)) {
+    free_payload(fragment);
+    return false;
+  }
+
+  send_ack(tcp_handler, fragment);
+  if (tcp_handler->delivered->was_seen(fragment)) {
+    // our ACK of the whole payload was lost, the sender is probing
+    fragment->is_fragment = false;
+    send_ack(tcp_handler, fragment);
+    free_payload(fragment);
+    return false;
+  }
+
+  std::vector<char> whole;
+  bool complete = tcp_handler->fragments->add(fragment, whole);
+  free_payload(fragment);
+  if (!complete) {
+    return false;
+  }
+
+  *payload = new payload_t;
+  if (!decode_udp_payload(tcp_handler, *payload, whole.data(), whole.size())) {
+    delete *payload;
+    return false;
+  }
+  return true;
 }
 
 void keep_sending_messages_from_queue(tcp_handler_t *tcp_handler) {
-  bool was_sent;
+  bool busy_poll = tcp_handler->pipeline->busy_poll(STAGE_SENDER);
 
   while (!*tcp_handler->finito) {
+    send_queued_message(tcp_handler, !busy_poll);
+  }
+}
+
+bool send_queued_message(tcp_handler_t *tcp_handler, bool wait) {
+  if (tcp_handler->sending_queue->size() == 0) {
+    // nothing else to batch with, do not hold datagrams back
+    tcp_handler->gso->flush();
+  }
 
-    message_t *message = tcp_handler->sending_queue->dequeue();
+  message_t *message = wait ? tcp_handler->sending_queue->dequeue()
+                            : tcp_handler->sending_queue->try_dequeue();
+  if (message == nullptr) {
+    return false;
+  }
+  // the queue is shared by every channel
+  tcp_handler = channel_of(tcp_handler, message->payload->channel_id);
+  retransmission_t *retransmission = message->retransmission;
+  if (retransmission == nullptr) {
     message->payload->sender_id = tcp_handler->current_node->id;
+  }
 
+  if (is_data_message(tcp_handler, message) &&
+      (tcp_handler->detector->is_suspected(message->recipient->id) ||
+       !tcp_handler->delivered->has_credit(message->recipient->id,
+                                           message->payload->owner_id,
+                                           message->payload->packet_uid))) {
+    // the peer looks crashed or has no room for it yet, the entry tries
+    // again next round or gets parked
+    if (DEBUG_V)
+      std::cout << "Holding back a send to " << message->recipient->id
+                << "\n";
+  } else {
     if (DEBUG_V)
       std::cout << "Trying to send...\n";
-    was_sent =
-        send_udp_payload(tcp_handler, tcp_handler->sockfd, message->recipient,
-                         message->payload, message->payload->buff_size);
+    send_udp_payload(tcp_handler, tcp_handler->sockfd, message->recipient,
+                     message->payload, message->payload->buff_size);
     if (DEBUG_V)
       std::cout << "Sent!\n";
+  }
+
+  // ACKs, NACKs and digests are not needed anymore, the entry of a data
+  // packet waits for its next round
+  free_message(message);
+  if (retransmission != nullptr) {
+    release_retransmission(tcp_handler, retransmission);
+  }
+  return true;
+}
+
+void keep_retransmitting_messages(tcp_handler_t *tcp_handler) {
+  bool busy_poll = tcp_handler->pipeline->busy_poll(STAGE_RETRANSMITTER);
+  retransmission_t *pending = nullptr;
 
-    if (message->payload->is_ack) {
-      // We no longer need it after ACK was sent
-      if (DEBUG_V)
-        std::cout << "Sending ACK: freeing message...\n";
-      free_message(message);
+  while (!*tcp_handler->finito) {
+    retransmit_message(tcp_handler, &pending,
+                       busy_poll ? WAIT_SPIN : WAIT_SLEEP);
+  }
+}
+
+bool retransmit_message(tcp_handler_t *tcp_handler,
+                        retransmission_t **pending, WaitMode wait) {
+  retransmission_t *retransmission = *pending;
+  bool dequeued = retransmission == nullptr;
+  *pending = nullptr;
+
+  if (dequeued) {
+    if (wait == WAIT_NONE) {
+      if (!tcp_handler->retrans_queue->try_dequeue(retransmission)) {
+        return false;
+      }
     } else {
-      // Retransmitting
-      message->sending_time = steady_clock::now();
-      message->first_send = false;
-      tcp_handler->retrans_queue->enqueue(message);
+      retransmission = tcp_handler->retrans_queue->dequeue();
+    }
+  }
+  payload_t *payload = retransmission->payload;
+  // the queue is shared by every channel
+  tcp_handler = channel_of(tcp_handler, payload->channel_id);
+
+  if (dequeued && drop_if_held(tcp_handler, retransmission)) {
+    return true;
+  }
+
+  if (!should_start_retransmission(retransmission->sending_time)) {
+    if (wait == WAIT_NONE) {
+      // the queue is in sending order, nothing behind it is due either
+      *pending = retransmission;
+      return false;
+    }
+    if (wait == WAIT_SLEEP) {
+      std::this_thread::sleep_until(retransmission->sending_time +
+                                    milliseconds(RETRANSMISSION_OFFSET_MS + 1));
     }
+    while (!should_start_retransmission(retransmission->sending_time)) {
+      // spin until we can retransmit again
+    }
+  }
+
+  // an ACK or digest may have come in while it waited
+  if (drop_if_held(tcp_handler, retransmission)) {
+    return true;
+  }
+
+  if (DEBUG) {
+    std::cout << "Retransmitting: ";
+    show_payload(payload, tcp_handler);
   }
+
+  bool sent = false;
+  bool deferred = false;
+  bool overlay_deferred = false;
+  retransmission->in_flight = 1;
+  for (node_t *node : *tcp_handler->nodes) {
+    if (!retransmission->pending[node->id] ||
+        tcp_handler->detector->is_suspected(node->id)) {
+      continue;
+    }
+    bool unsent = retransmission->unsent[node->id];
+
+    if (unsent && tcp_handler->overlay->is_enabled() &&
+        retransmission->deferrals < OVERLAY_FALLBACK_ROUNDS &&
+        !tcp_handler->overlay->repairs(node->id)) {
+      // the designated repairers go first, their digests will tell
+      overlay_deferred = true;
+      continue;
+    }
+    if (tcp_handler->reliability == RELIABILITY_NACK && !unsent &&
+        payload->packet_uid >=
+            tcp_handler->delivered->held_up_to(node->id, payload->owner_id) +
+                NACK_TAIL_WINDOW) {
+      // most likely held already, above a gap the peer NACKs
+      deferred = true;
+      continue;
+    }
+
+    // relays that were held back are sent for the first time
+    if (FEC_ENABLED && !unsent)
+      tcp_handler->fec->note_loss(node->id);
+    enqueue_send(tcp_handler, retransmission, node,
+                 unsent ? SEND_RELAY : SEND_RETRANSMISSION);
+    sent = true;
+  }
+  if (overlay_deferred) {
+    retransmission->deferrals++;
+  }
+
+  if (!sent && !deferred && !overlay_deferred &&
+      tcp_handler->detector->park(retransmission)) {
+    // only peers that look crashed lack it, wait until one is heard of again
+    return true;
+  }
+  release_retransmission(tcp_handler, retransmission);
+  return true;
 }
 
-void keep_retransmitting_messages(tcp_handler_t *tcp_handler) {
+bool drop_if_held(tcp_handler_t *tcp_handler,
+                  retransmission_t *retransmission) {
+  payload_t *payload = retransmission->payload;
+  // not is_stable: a given up peer may be back and catching up
+  bool held = tcp_handler->delivered->is_held_by_all(payload);
+  bool pending = false;
+
+  for (uint32_t node_id = 1; node_id < retransmission->pending.size();
+       node_id++) {
+    if (!retransmission->pending[node_id]) {
+      continue;
+    }
+    if (!held && !tcp_handler->detector->is_given_up(node_id) &&
+        !tcp_handler->delivered->contains(node_id, payload)) {
+      pending = true;
+      continue;
+    }
+    // already delivered, held by all or given up on - no need to retransmit
+    retransmission->pending[node_id] = false;
+    if (Fragmenter::is_fragmented(payload))
+      tcp_handler->fragments->forget(node_id, payload);
+  }
+  if (pending) {
+    return false;
+  }
+
+  if (DEBUG_V)
+    std::cout << "Retransmission: freeing message \n";
+  show_payload(payload, tcp_handler);
+  free_retransmission(retransmission);
+  return true;
+}
+
+void run_fused_stages(tcp_handler_t *tcp_handler, uint32_t stages) {
+  bool receives = stages & 1u << STAGE_RECEIVER;
+  bool sends = stages & 1u << STAGE_SENDER;
+  bool retransmits = stages & 1u << STAGE_RETRANSMITTER;
+  bool busy_poll = true;
+  for (uint32_t stage = 0; stage < STAGES; stage++) {
+    if (stages & 1u << stage)
+      busy_poll = busy_poll &&
+                  tcp_handler->pipeline->busy_poll(static_cast<Stage>(stage));
+  }
+
+  receiver_t receiver;
+  init_receiver(tcp_handler, &receiver, tcp_handler->sockfd);
+  retransmission_t *pending = nullptr;
+
   while (!*tcp_handler->finito) {
-    message_t *message = tcp_handler->retrans_queue->dequeue();
-    uint32_t packet_uid = message->payload->packet_uid;
-
-    if (tcp_handler->delivered->contains(message->recipient->id,
-                                         message->payload)) {
-      // already delivered - no need to retransmit
-      if (DEBUG_V)
-        std::cout << "Retransmission: freeing message \n";
-      show_payload(message->payload, tcp_handler);
-      free_message(message);
+    bool progress = false;
+    // bounded rounds, so no stage starves the others
+    for (uint32_t i = 0; receives && i < FUSED_ROUND_SIZE; i++) {
+      if (!receive_message(tcp_handler, &receiver, 0))
+        break;
+      progress = true;
+    }
+    for (uint32_t i = 0; retransmits && i < FUSED_ROUND_SIZE; i++) {
+      if (!retransmit_message(tcp_handler, &pending, WAIT_NONE))
+        break;
+      progress = true;
+    }
+    for (uint32_t i = 0; sends && i < FUSED_ROUND_SIZE; i++) {
+      if (!send_queued_message(tcp_handler, false))
+        break;
+      progress = true;
+    }
+
+    if (progress || busy_poll) {
       continue;
     }
+    // idle: block on the link, or nap if the thread does not receive
+    if (receives) {
+      if (select_socket(receiver.poll_fd, 0, FUSED_IDLE_WAIT_MS) < 0 &&
+          errno != EINTR)
+        throw std::runtime_error("select error");
+    } else {
+      std::this_thread::sleep_for(milliseconds(FUSED_IDLE_WAIT_MS));
+    }
+  }
+
+  delete receiver.batch;
+}
+
+retransmission_t *new_retransmission(tcp_handler_t *tcp_handler,
+                                     payload_t *payload) {
+  size_t slots = tcp_handler->nodes->size() + 1;
+  retransmission_t *retransmission = new retransmission_t;
+  retransmission->payload = new payload_t;
+  copy_payload(retransmission->payload, payload);
+  retransmission->payload->sender_id = tcp_handler->current_node->id;
+  retransmission->pending.assign(slots, false);
+  retransmission->in_flight = 1;
 
-    if (DEBUG) {
-      std::cout << "Retransmitting: ";
-      show_payload(message->payload, tcp_handler);
+  for (node_t *node : *tcp_handler->nodes) {
+    // given up peers catch up from the log if they come back
+    if (node->id != tcp_handler->current_node->id &&
+        !tcp_handler->detector->is_given_up(node->id) &&
+        !tcp_handler->delivered->contains(node->id, payload)) {
+      retransmission->pending[node->id] = true;
     }
+  }
+  retransmission->unsent = retransmission->pending;
+  return retransmission;
+}
 
-    while (!should_start_retransmission(message->sending_time)) {
-      // spin until we can retransmit again
+void enqueue_send(tcp_handler_t *tcp_handler, retransmission_t *retransmission,
+                  node_t *recipient, SendClass send_class) {
+  if (recipient == tcp_handler->group_node) {
+    retransmission->unsent.assign(retransmission->unsent.size(), false);
+  } else {
+    retransmission->unsent[recipient->id] = false;
+  }
+  message_t *message = new message_t;
+  message->recipient = recipient;
+  message->payload = retransmission->payload;
+  message->retransmission = retransmission;
+  retransmission->in_flight++;
+  tcp_handler->sending_queue->enqueue(message, send_class);
+}
+
+void release_retransmission(tcp_handler_t *tcp_handler,
+                            retransmission_t *retransmission) {
+  if (--retransmission->in_flight > 0) {
+    return; // some of its sends are still queued
+  }
+  retransmission->sending_time = ProtocolClock::now();
+  tcp_handler->retrans_queue->enqueue(retransmission);
+}
+
+void keep_sending_digests(tcp_handler_t *tcp_handler) {
+  std::vector<tcp_handler_t *> channels = all_channels(tcp_handler);
+  std::vector<std::vector<uint32_t>> last_sent(channels.size());
+  uint32_t rounds = 0;
+
+  while (!*tcp_handler->finito) {
+    std::this_thread::sleep_for(milliseconds(DIGEST_INTERVAL_MS));
+    rounds++;
+    for (size_t index = 0; index < channels.size(); index++) {
+      send_digest(channels[index], last_sent[index], rounds);
     }
+  }
+}
+
+void send_digest(tcp_handler_t *tcp_handler, std::vector<uint32_t> &last_sent,
+                 uint32_t round) {
+  payload_t *digest = new payload_t;
+  construct_digest_payload(tcp_handler, digest);
+  size_t words = static_cast<size_t>(digest->buff_size) / sizeof(uint32_t);
+  if (last_sent.size() != words) {
+    last_sent.assign(words, 0);
+  }
 
-    tcp_handler->sending_queue->enqueue(message);
+  bool changed = memcmp(last_sent.data(), digest->buffer,
+                        words * sizeof(uint32_t)) != 0;
+  // URB deliveries wait for the changes, an idle one is only refreshed
+  bool requested = tcp_handler->delivered->take_digest_request();
+  if (!changed && !requested && round % DIGEST_REFRESH_ROUNDS != 0) {
+    free_payload(digest);
+    return;
   }
+  memcpy(last_sent.data(), digest->buffer, words * sizeof(uint32_t));
+
+  best_effort_broadcast(tcp_handler, digest);
+  free_payload(digest);
+}
+
+void keep_sending_heartbeats(tcp_handler_t *tcp_handler) {
+  uint32_t rounds = 0;
+
+  while (!*tcp_handler->finito) {
+    std::this_thread::sleep_for(milliseconds(HEARTBEAT_INTERVAL_MS));
+    rounds++;
+    send_heartbeats(tcp_handler, rounds);
+  }
+}
+
+void send_heartbeats(tcp_handler_t *tcp_handler, uint32_t round) {
+  uint32_t probe_every = PROBE_INTERVAL_MS / HEARTBEAT_INTERVAL_MS;
+
+  // one per peer for the whole process, the detector serves every channel
+  payload_t *heartbeat = new payload_t;
+  construct_heartbeat_payload(tcp_handler, heartbeat);
+
+  for (node_t *node : *tcp_handler->nodes) {
+    if (node->id == tcp_handler->current_node->id) {
+      continue;
+    }
+    if (tcp_handler->detector->is_suspected(node->id) &&
+        round % probe_every != 0) {
+      continue; // suspected peers are only probed
+    }
+    // sent directly, so they are not delayed by the sending queue
+    send_udp_payload(tcp_handler, tcp_handler->sockfd, node, heartbeat,
+                     heartbeat->buff_size);
+  }
+
+  free_payload(heartbeat);
+  tcp_handler->gso->flush();
+
+  if (round % probe_every == 0)
+    tcp_handler->sending_queue->show_depths();
+
+  tcp_handler->detector->check(tcp_handler->current_node->id);
+  tcp_handler->detector->prune_parked(
+      [tcp_handler](retransmission_t *retransmission) {
+        return drop_if_held(
+            channel_of(tcp_handler, retransmission->payload->channel_id),
+            retransmission);
+      });
+  for (tcp_handler_t *channel : all_channels(tcp_handler)) {
+    if (round % probe_every == 0)
+      channel->fragments->sweep();
+    channel->sent_log->prune(channel->delivered);
+  }
+
+  if (FEC_ENABLED) {
+    tcp_handler->fec->flush([&](node_t *node, char *parity, ssize_t len) {
+      tcp_handler->gso->send(node, parity, len);
+    });
+    tcp_handler->gso->flush();
+  }
+}
+
+bool is_data_message(tcp_handler_t *h, message_t *message) {
+  payload_t *payload = message->payload;
+  return message->recipient != h->group_node && !payload->is_ack &&
+         !payload->is_nack && !payload->is_digest && !payload->is_heartbeat;
 }
 
 void construct_message(message_t *message, payload_t *payload,
                        node_t *recipient) {
-  message->first_send = true;
   message->recipient = recipient;
   message->payload = payload;
 }
 
 void construct_payload(tcp_handler_t *h, payload_t *payload, node_t *sender,
-                       uint32_t seq_num) {
-  std::string msg_content = std::to_string(seq_num);
-
-  payload->buffer = new char[msg_content.length()];
-  strncpy(payload->buffer, msg_content.c_str(), msg_content.length());
+                       uint32_t seq_num, const char *data, size_t len) {
+  payload->buffer = new char[len];
+  memcpy(payload->buffer, data, len);
   payload->packet_uid = seq_num;
 
   payload->sender_id = sender->id;
   payload->owner_id = sender->id;
-  payload->buff_size = msg_content.length();
+  payload->channel_id = h->channel_id;
+  payload->buff_size = static_cast<ssize_t>(len);
 
-  uint32_t vc_size = vector_clock_size(h);
-  payload->vector_clock = new uint32_t[vc_size];
-  memcpy(payload->vector_clock, h->delivered->vector_clock, 4 * vc_size);
+  if (h->broadcast_clock.size() != vector_clock_size(h)) {
+    h->broadcast_clock.assign(vector_clock_size(h), 0);
+  }
+  project_vector_clock(payload, h->delivered->vector_clock,
+                       (*h->delivered->causality)[sender->id],
+                       vector_clock_size(h), h->broadcast_clock.data());
 
   if (DEBUG) {
     std::cout << "Constructed ";
@@ -146,8 +714,72 @@ void construct_payload(tcp_handler_t *h, payload_t *payload, node_t *sender,
   }
 }
 
+void construct_ack_payload(tcp_handler_t *h, payload_t *ack,
+                           payload_t *payload) {
+  // an ACK only names the packet, plus the index for a fragment
+  ack->buff_size = payload->is_fragment ? 4 : 0;
+  ack->buffer = new char[ack->buff_size];
+  memcpy(ack->buffer, payload->buffer, static_cast<size_t>(ack->buff_size));
+
+  ack->packet_uid = payload->packet_uid;
+  ack->sender_id = payload->sender_id;
+  ack->owner_id = payload->owner_id;
+  ack->channel_id = h->channel_id;
+  ack->is_ack = true;
+  ack->is_fragment = payload->is_fragment;
+  ack->credit = h->delivered->advertised_credit(payload->owner_id);
+  clear_vector_clock(ack);
+}
+
+void construct_nack_payload(tcp_handler_t *h, payload_t *nack,
+                            OwnerID owner_id, const PacketID *uids,
+                            size_t count) {
+  nack->buff_size = static_cast<ssize_t>(count * sizeof(PacketID));
+  nack->buffer = new char[nack->buff_size];
+  memcpy(nack->buffer, uids, count * sizeof(PacketID));
+
+  nack->packet_uid = 0;
+  nack->sender_id = h->current_node->id;
+  nack->owner_id = owner_id;
+  nack->channel_id = h->channel_id;
+  nack->is_nack = true;
+  clear_vector_clock(nack);
+}
+
+void construct_digest_payload(tcp_handler_t *h, payload_t *payload) {
+  uint32_t vc_size = vector_clock_size(h);
+  // watermarks, then our credit limits
+  std::vector<uint32_t> body(2 * vc_size, 0);
+  h->delivered->digest(body.data());
+  for (uint32_t owner_id = 1; owner_id < vc_size; owner_id++) {
+    body[vc_size + owner_id] = h->delivered->advertised_credit(owner_id);
+  }
+
+  payload->buff_size = static_cast<ssize_t>(body.size() * sizeof(uint32_t));
+  payload->buffer = new char[payload->buff_size];
+  memcpy(payload->buffer, body.data(), payload->buff_size);
+
+  payload->packet_uid = 0;
+  payload->sender_id = h->current_node->id;
+  payload->owner_id = h->current_node->id;
+  payload->channel_id = h->channel_id;
+  payload->is_digest = true;
+  clear_vector_clock(payload);
+}
+
+void construct_heartbeat_payload(tcp_handler_t *h, payload_t *payload) {
+  payload->buff_size = 0;
+  payload->buffer = new char[0];
+  payload->packet_uid = 0;
+  payload->sender_id = h->current_node->id;
+  payload->owner_id = h->current_node->id;
+  payload->channel_id = h->channel_id;
+  payload->is_heartbeat = true;
+  clear_vector_clock(payload);
+}
+
 bool should_start_retransmission(steady_clock::time_point sending_start) {
-  time_point current_time = steady_clock::now();
+  time_point current_time = ProtocolClock::now();
   auto duration = duration_cast<microseconds>(current_time - sending_start);
   int64_t ms_since_last_sending = duration.count() / 1000;
   return ms_since_last_sending > RETRANSMISSION_OFFSET_MS;
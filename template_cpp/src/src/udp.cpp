@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <iostream>
 #include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,8 +12,14 @@
 #include <vector>
 
 #include "common.hpp"
+#include "compression.hpp"
+#include "fec.hpp"
+#include "fragments.hpp"
+#include "gso.hpp"
 #include "messages.hpp"
+#include "tcp.hpp"
 #include "udp.hpp"
+#include "uring.hpp"
 
 size_t get_node_idx_by_id(std::vector<node_t *> *nodes, uint32_t id) {
   for (size_t index = 0; index < nodes->size(); ++index) {
@@ -23,27 +31,140 @@ size_t get_node_idx_by_id(std::vector<node_t *> *nodes, uint32_t id) {
   return -1;
 }
 
-bool send_udp_payload(struct tcp_handler_s *h, int sockfd, node_t *receiver,
-                      payload_t *payload, ssize_t size) {
-  char buffer[IP_MAXPACKET];
+// Replaces the body of the datagram with its compressed form, prefixed by
+// its original length, if that makes the datagram shorter
+static ssize_t compress_datagram(char *datagram, ssize_t datagram_len) {
+  char compressed[IP_MAXPACKET];
+  size_t body_len = static_cast<size_t>(datagram_len - PAYLOAD_META_SIZE);
+  if (body_len < COMPRESSION_MIN_BYTES) {
+    return datagram_len;
+  }
+
+  ssize_t compressed_len =
+      LzCodec::compress(datagram + PAYLOAD_META_SIZE, body_len, compressed,
+                        body_len - 3);
+  if (compressed_len < 0) {
+    return datagram_len;
+  }
+
+  uint16_t original_len = static_cast<uint16_t>(body_len);
+  datagram[12] = static_cast<char>(datagram[12] | FLAG_COMPRESSED);
+  memcpy(datagram + PAYLOAD_META_SIZE, &original_len, 2);
+  memcpy(datagram + PAYLOAD_META_SIZE + 2, compressed,
+         static_cast<size_t>(compressed_len));
+  return PAYLOAD_META_SIZE + 2 + compressed_len;
+}
+
+// Restores a compressed body in place. Returns -1 if it is malformed
+static ssize_t decompress_datagram(char *datagram, ssize_t datagram_len) {
+  char body[IP_MAXPACKET];
+  uint16_t original_len;
+  if (!(datagram[12] & FLAG_COMPRESSED)) {
+    return datagram_len;
+  }
+  if (datagram_len < PAYLOAD_META_SIZE + 2) {
+    return -1;
+  }
+
+  memcpy(&original_len, datagram + PAYLOAD_META_SIZE, 2);
+  if (original_len > IP_MAXPACKET - PAYLOAD_META_SIZE ||
+      !LzCodec::decompress(
+          datagram + PAYLOAD_META_SIZE + 2,
+          static_cast<size_t>(datagram_len - PAYLOAD_META_SIZE - 2), body,
+          original_len)) {
+    return -1;
+  }
+  datagram[12] = static_cast<char>(datagram[12] & ~FLAG_COMPRESSED);
+  memcpy(datagram + PAYLOAD_META_SIZE, body, original_len);
+  return PAYLOAD_META_SIZE + original_len;
+}
+
+// Sends the `payload_size` bytes long datagram found after the room left
+// for the FEC header at the front of `buffer`
+static bool send_datagram(struct tcp_handler_s *h, int sockfd,
+                          node_t *receiver, char *buffer,
+                          ssize_t payload_size) {
+  char parity[IP_MAXPACKET];
   bool was_sent = true;
+  ssize_t parity_size = 0;
 
-  ssize_t payload_size = encode_udp_payload(h, payload, buffer, size);
+  if (WIRE_COMPRESSION) {
+    char *datagram = FEC_ENABLED ? buffer + FEC_HEADER_SIZE : buffer;
+    payload_size = compress_datagram(datagram, payload_size);
+  }
+  if (FEC_ENABLED) {
+    parity_size = h->fec->encode(receiver, buffer, payload_size, parity);
+    payload_size += FEC_HEADER_SIZE;
+  }
 
   if (DEBUG_V)
     std::cout << "Low level sending...\n";
-  ssize_t message_len = send_udp_packet(sockfd, receiver, buffer, payload_size);
-  if (DEBUG_V)
-    std::cout << "Low level sent!\n";
-
-  if (message_len != payload_size) {
-    if (errno == ENOTCONN || errno == ENETUNREACH || errno == EHOSTUNREACH) {
-      was_sent = false;
-    } else {
+  if (sockfd == h->sockfd) {
+    was_sent = h->gso->send(receiver, buffer, payload_size);
+    if (parity_size > 0) {
+      h->gso->send(receiver, parity, parity_size);
+    }
+  } else {
+    was_sent = send_udp_packet(sockfd, receiver, buffer, payload_size) ==
+               payload_size;
+    if (parity_size > 0) {
+      send_udp_packet(sockfd, receiver, parity, parity_size);
+    }
+    if (!was_sent && errno != ENOTCONN && errno != ENETUNREACH &&
+        errno != EHOSTUNREACH) {
       std::cout << "\nERRNO: " << errno << "\n";
       throw std::runtime_error("sendto error");
     }
   }
+  if (DEBUG_V)
+    std::cout << "Low level sent!\n";
+  return was_sent;
+}
+
+// Sends the fragments of `payload` the receiver is missing, or the last one
+// to get the whole message acked again if it has all of them
+static bool send_fragments(struct tcp_handler_s *h, int sockfd,
+                           node_t *receiver, payload_t *payload) {
+  char buffer[IP_MAXPACKET];
+  char *datagram = FEC_ENABLED ? buffer + FEC_HEADER_SIZE : buffer;
+  bool was_sent = true;
+
+  std::vector<char> whole(static_cast<size_t>(Fragmenter::encoded_size(payload)));
+  uint32_t total = static_cast<uint32_t>(
+      encode_udp_payload(h, payload, whole.data(), payload->buff_size));
+  uint32_t count = Fragmenter::fragment_count(total);
+
+  std::vector<uint32_t> indexes =
+      h->fragments->missing(receiver->id, payload, count);
+  if (indexes.empty()) {
+    indexes.push_back(count - 1);
+  }
+
+  for (uint32_t index : indexes) {
+    ssize_t datagram_len =
+        encode_fragment(payload, whole.data(), total, index, datagram);
+    was_sent = send_datagram(h, sockfd, receiver, buffer, datagram_len) &&
+               was_sent;
+  }
+  return was_sent;
+}
+
+bool send_udp_payload(struct tcp_handler_s *h, int sockfd, node_t *receiver,
+                      payload_t *payload, ssize_t size) {
+  bool was_sent;
+
+  if (h->simulated_link) {
+    return h->simulated_link(receiver, payload);
+  }
+
+  if (Fragmenter::is_fragmented(payload)) {
+    was_sent = send_fragments(h, sockfd, receiver, payload);
+  } else {
+    char buffer[IP_MAXPACKET];
+    char *datagram = FEC_ENABLED ? buffer + FEC_HEADER_SIZE : buffer;
+    ssize_t payload_size = encode_udp_payload(h, payload, datagram, size);
+    was_sent = send_datagram(h, sockfd, receiver, buffer, payload_size);
+  }
 
   if (DEBUG) {
     if (was_sent) {
@@ -57,16 +178,53 @@ bool send_udp_payload(struct tcp_handler_s *h, int sockfd, node_t *receiver,
 }
 
 ssize_t receive_udp_payload(struct tcp_handler_s *h, int sockfd,
-                            payload_t *payload) {
+                            gro_batch_t *batch, payload_t *payload) {
   char buffer[IP_MAXPACKET];
 
-  ssize_t datagram_len = receive_udp_packet(sockfd, buffer, IP_MAXPACKET);
+  if (!has_pending_segments(batch)) {
+    uint16_t segment_size;
+    ssize_t received =
+        sockfd == h->sockfd && h->uring->is_active()
+            ? h->uring->receive(batch->buffer, IP_MAXPACKET, &segment_size)
+            : receive_udp_packet(sockfd, batch->buffer, IP_MAXPACKET,
+                                 &segment_size);
+    if (received < 0) {
+      return received;
+    }
+    batch->len = received;
+    batch->offset = 0;
+    batch->segment_size = segment_size;
+  }
+
+  // FEC may recover a datagram longer than the segment, hence the copy
+  ssize_t datagram_len =
+      std::min<ssize_t>(batch->segment_size, batch->len - batch->offset);
+  memcpy(buffer, batch->buffer + batch->offset,
+         static_cast<size_t>(datagram_len));
+  batch->offset += datagram_len;
+
+  if (FEC_ENABLED) {
+    datagram_len = h->fec->decode(buffer, datagram_len);
+    if (datagram_len < 0) {
+      errno = EAGAIN; // parity only, nothing to hand over
+      return datagram_len;
+    }
+  }
 
+  datagram_len = decompress_datagram(buffer, datagram_len);
   if (datagram_len < 0) {
+    errno = EAGAIN; // dropped like a corrupted datagram
     return datagram_len;
   }
 
-  decode_udp_payload(h, payload, buffer, datagram_len);
+  if (h->capture != nullptr) {
+    h->capture->record(buffer, datagram_len);
+  }
+  if (!decode_udp_payload(h, payload, buffer,
+                          static_cast<size_t>(datagram_len))) {
+    errno = EAGAIN; // dropped like a corrupted datagram
+    return -1;
+  }
 
   if (DEBUG) {
     std::cout << "Received ";
@@ -76,25 +234,62 @@ ssize_t receive_udp_payload(struct tcp_handler_s *h, int sockfd,
 }
 
 ssize_t send_udp_packet(int sockfd, node_t *receiver, const char *buffer,
-                        ssize_t buff_len) {
+                        ssize_t buff_len, uint16_t segment_size) {
   struct sockaddr_in recipent_addr;
   bzero(&recipent_addr, sizeof(recipent_addr));
   recipent_addr.sin_family = AF_INET;
   recipent_addr.sin_port = htons(receiver->port);
   recipent_addr.sin_addr.s_addr = receiver->ip;
 
-  return sendto(sockfd, buffer, buff_len, 0,
-                reinterpret_cast<struct sockaddr *>(&recipent_addr),
-                sizeof(recipent_addr));
+  if (segment_size == 0) {
+    return sendto(sockfd, buffer, static_cast<size_t>(buff_len), 0,
+                  reinterpret_cast<struct sockaddr *>(&recipent_addr),
+                  sizeof(recipent_addr));
+  }
+
+  // the kernel cuts the buffer into datagrams of `segment_size` bytes
+  struct iovec iov;
+  iov.iov_base = const_cast<char *>(buffer);
+  iov.iov_len = static_cast<size_t>(buff_len);
+
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  bzero(control, sizeof(control));
+  struct msghdr msg;
+  bzero(&msg, sizeof(msg));
+  msg.msg_name = &recipent_addr;
+  msg.msg_namelen = sizeof(recipent_addr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+
+  return sendmsg(sockfd, &msg, 0);
 }
 
-ssize_t receive_udp_packet(int sockfd, char *buffer, ssize_t buff_len) {
+ssize_t receive_udp_packet(int sockfd, char *buffer, ssize_t buff_len,
+                           uint16_t *segment_size) {
   struct sockaddr_in sender;
-  socklen_t sender_len = sizeof(sender);
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = static_cast<size_t>(buff_len);
 
-  ssize_t datagram_len =
-      recvfrom(sockfd, buffer, buff_len, MSG_DONTWAIT,
-               reinterpret_cast<struct sockaddr *>(&sender), &sender_len);
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  bzero(&msg, sizeof(msg));
+  msg.msg_name = &sender;
+  msg.msg_namelen = sizeof(sender);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t datagram_len = recvmsg(sockfd, &msg, MSG_DONTWAIT);
   if (datagram_len < 0) {
     if (errno == EAGAIN) {
       return datagram_len;
@@ -104,6 +299,19 @@ ssize_t receive_udp_packet(int sockfd, char *buffer, ssize_t buff_len) {
     throw std::runtime_error("recvfrom error");
   }
 
+  // with UDP_GRO the buffer may hold several datagrams of the same size
+  *segment_size = static_cast<uint16_t>(datagram_len);
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int gso_size;
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+      if (gso_size > 0) {
+        *segment_size = static_cast<uint16_t>(gso_size);
+      }
+    }
+  }
+
   char sender_ip_str[20];
   inet_ntop(AF_INET, &(sender.sin_addr), sender_ip_str, sizeof(sender_ip_str));
 
@@ -111,6 +319,14 @@ ssize_t receive_udp_packet(int sockfd, char *buffer, ssize_t buff_len) {
   return datagram_len;
 }
 
+// The io_uring backend signals received datagrams on its ring
+int readable_fd(struct tcp_handler_s *h, int sockfd) {
+  if (sockfd == h->sockfd && h->uring->is_active()) {
+    return h->uring->receive_fd();
+  }
+  return sockfd;
+}
+
 int select_socket(int sockfd, int secs, int milisecs) {
   fd_set descriptors;
   FD_ZERO(&descriptors);
@@ -145,5 +361,65 @@ int bind_socket(unsigned short port) {
     std::cout << "\nERRNO: " << errno << "\n";
     throw std::runtime_error("bind error");
   }
+  if (UDP_OFFLOAD) {
+    enable_udp_gro(sockfd);
+  }
   return sockfd;
 }
+
+void enable_udp_gro(int sockfd) {
+  int on = 1;
+  // without it the kernel splits coalesced datagrams itself
+  if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0 && DEBUG)
+    std::cout << "UDP GRO is not supported by the kernel\n";
+}
+
+int bind_multicast_socket(node_t *group, in_addr_t interface) {
+  int sockfd = init_socket();
+  int reuse = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+    throw std::runtime_error("setsockopt SO_REUSEADDR error");
+
+  struct sockaddr_in group_address;
+  bzero(&group_address, sizeof(group_address));
+  group_address.sin_family = AF_INET;
+  group_address.sin_port = htons(group->port);
+  group_address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  int bind_res =
+      bind(sockfd, reinterpret_cast<struct sockaddr *>(&group_address),
+           sizeof(group_address));
+  if (bind_res < 0) {
+    std::cout << "\nERRNO: " << errno << "\n";
+    throw std::runtime_error("bind error");
+  }
+
+  struct ip_mreq membership;
+  membership.imr_multiaddr.s_addr = group->ip;
+  membership.imr_interface.s_addr = interface;
+  if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                 sizeof(membership)) < 0) {
+    std::cout << "\nERRNO: " << errno << "\n";
+    throw std::runtime_error("setsockopt IP_ADD_MEMBERSHIP error");
+  }
+  if (UDP_OFFLOAD) {
+    enable_udp_gro(sockfd);
+  }
+  return sockfd;
+}
+
+void enable_multicast_sending(int sockfd, in_addr_t interface) {
+  struct in_addr interface_addr;
+  interface_addr.s_addr = interface;
+  unsigned char loop = 1; // processes may share the host
+  unsigned char ttl = 1;  // stay on the LAN
+
+  if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &interface_addr,
+                 sizeof(interface_addr)) < 0 ||
+      setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) <
+          0 ||
+      setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+    std::cout << "\nERRNO: " << errno << "\n";
+    throw std::runtime_error("setsockopt multicast error");
+  }
+}
@@ -0,0 +1,482 @@
+// Microbenchmarks of the hot-path components, each measured in isolation:
+// the thread-safe queues, the datagram codec, payload copies, the delivered
+// set and the formatting of the output file.
+//
+//   da_microbench [--filter TEXT] [--repeats R] [--scale X] [--json]
+//
+// Every case runs once to warm up, then R times; setup is left out of the
+// timings. One line per case is printed, tab-separated with a header row, or
+// as a JSON object with --json: the median, fastest and slowest time per
+// operation in ns, and the median absolute deviation in percent of the
+// median, which tells whether the machine was quiet enough to compare runs.
+// --filter keeps the cases whose "name/params" contains TEXT, --scale
+// multiplies the operation counts. Workloads are seeded, so two runs measure
+// the same operations; pin the process (taskset -c) for steadier numbers.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "delivered_set.hpp"
+#include "messages.hpp"
+#include "ts_queue.hpp"
+
+#define SEED 42
+// Process sizes the delivered set is measured at
+#define SET_SIZES {4, 32, 128}
+// Inserts per delivered set run, whatever the process count
+#define SET_INSERTS 200000
+
+using namespace std::chrono; // noqa
+
+// Results are folded in here so the compiler cannot drop the calls
+static volatile uint64_t sink;
+
+typedef struct {
+  std::string filter;
+  uint32_t repeats = 7;
+  double scale = 1;
+  bool json = false;
+} bench_config_t;
+
+// Performs one run of `ops` operations, returns the time they took in ns
+typedef std::function<uint64_t(uint64_t ops)> BenchRun;
+
+static void usage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [--filter TEXT] [--repeats R] [--scale X] [--json]\n";
+  exit(2);
+}
+
+static void parse_args(int argc, char **argv, bench_config_t &config) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      config.json = true;
+    } else if (i + 1 == argc) {
+      usage(argv[0]);
+    } else if (arg == "--filter") {
+      config.filter = argv[++i];
+    } else if (arg == "--repeats") {
+      config.repeats = static_cast<uint32_t>(std::stoul(argv[++i]));
+    } else if (arg == "--scale") {
+      config.scale = std::stod(argv[++i]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (config.repeats == 0 || config.scale <= 0) {
+    usage(argv[0]);
+  }
+}
+
+static bool selected(const bench_config_t &config, const std::string &name,
+                     const std::string &params) {
+  return (name + "/" + params).find(config.filter) != std::string::npos;
+}
+
+static uint64_t scaled(const bench_config_t &config, uint64_t ops) {
+  return std::max<uint64_t>(
+      1, static_cast<uint64_t>(static_cast<double>(ops) * config.scale));
+}
+
+static uint64_t elapsed_ns(steady_clock::time_point start) {
+  return static_cast<uint64_t>(
+      duration_cast<nanoseconds>(steady_clock::now() - start).count());
+}
+
+static double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  size_t middle = values.size() / 2;
+  return values.size() % 2 == 1 ? values[middle]
+                                : (values[middle - 1] + values[middle]) / 2;
+}
+
+static void measure(const bench_config_t &config, const std::string &name,
+                    const std::string &params, uint64_t ops, BenchRun run) {
+  if (!selected(config, name, params)) {
+    return;
+  }
+  run(ops);
+
+  std::vector<double> per_op;
+  for (uint32_t repeat = 0; repeat < config.repeats; repeat++) {
+    per_op.push_back(static_cast<double>(run(ops)) /
+                     static_cast<double>(ops));
+  }
+  double middle = median(per_op);
+  std::vector<double> deviations;
+  for (double value : per_op) {
+    deviations.push_back(std::abs(value - middle));
+  }
+  double mad_pct = middle > 0 ? median(deviations) / middle * 100 : 0;
+  double fastest = *std::min_element(per_op.begin(), per_op.end());
+  double slowest = *std::max_element(per_op.begin(), per_op.end());
+
+  std::cout << std::fixed << std::setprecision(2);
+  if (config.json) {
+    std::cout << "{\"benchmark\": \"" << name << "\", \"params\": \""
+              << params << "\", \"ops\": " << ops
+              << ", \"median_ns\": " << middle << ", \"min_ns\": " << fastest
+              << ", \"max_ns\": " << slowest << ", \"mad_pct\": " << mad_pct
+              << "}\n";
+  } else {
+    std::cout << name << "\t" << params << "\t" << ops << "\t" << middle
+              << "\t" << fastest << "\t" << slowest << "\t" << mad_pct
+              << "\n";
+  }
+  std::cout.flush();
+}
+
+// A packet as broadcast by `owner_id`: `body` bytes of text and either a
+// dense clock over `processes` or `pairs` sparse (process, 0) entries
+static payload_t *make_payload(OwnerID owner_id, PacketID packet_uid,
+                               size_t body, bool dense, uint32_t processes,
+                               uint32_t pairs) {
+  payload_t *payload = new payload_t;
+  payload->owner_id = owner_id;
+  payload->sender_id = owner_id;
+  payload->packet_uid = packet_uid;
+  payload->buff_size = static_cast<ssize_t>(body);
+  payload->buffer = new char[body];
+  std::string text = std::to_string(packet_uid);
+  for (size_t i = 0; i < body; i++) {
+    payload->buffer[i] = text[i % text.size()];
+  }
+  payload->sparse_clock = !dense;
+  payload->vc_len = dense ? processes + 1 : 2 * pairs;
+  payload->vector_clock = new uint32_t[payload->vc_len];
+  std::fill(payload->vector_clock, payload->vector_clock + payload->vc_len, 0);
+  for (uint32_t pair = 0; !dense && pair < pairs; pair++) {
+    payload->vector_clock[2 * pair] = pair + 1;
+  }
+  return payload;
+}
+
+static void bench_queue(const bench_config_t &config) {
+  payload_t item;
+
+  measure(config, "queue/uncontended", "threads=1",
+          scaled(config, MILLION), [&item](uint64_t ops) {
+            PayloadQueue queue;
+            payload_t *out;
+            steady_clock::time_point start = steady_clock::now();
+            for (uint64_t i = 0; i < ops; i++) {
+              queue.enqueue(&item);
+            }
+            for (uint64_t i = 0; i < ops; i++) {
+              queue.try_dequeue(out);
+            }
+            return elapsed_ns(start);
+          });
+
+  for (uint32_t threads : {1, 2, 4}) {
+    measure(
+        config, "queue/contended",
+        "producers=" + std::to_string(threads) +
+            " consumers=" + std::to_string(threads),
+        scaled(config, MILLION / 2), [&item, threads](uint64_t ops) {
+          PayloadQueue queue;
+          std::atomic<bool> go = false;
+          std::vector<std::thread> workers;
+          uint64_t share = ops / threads;
+          for (uint32_t t = 0; t < threads; t++) {
+            workers.emplace_back([&queue, &go, &item, share]() {
+              while (!go) {
+              }
+              for (uint64_t i = 0; i < share; i++) {
+                queue.enqueue(&item);
+              }
+            });
+            workers.emplace_back([&queue, &go, share]() {
+              while (!go) {
+              }
+              for (uint64_t i = 0; i < share; i++) {
+                queue.dequeue();
+              }
+            });
+          }
+          steady_clock::time_point start = steady_clock::now();
+          go = true;
+          for (std::thread &worker : workers) {
+            worker.join();
+          }
+          return elapsed_ns(start);
+        });
+  }
+}
+
+static void bench_codec(const bench_config_t &config) {
+  std::vector<char> datagram(IP_MAXPACKET);
+
+  for (size_t body : {8, 1024}) {
+    for (uint32_t clock : {0, 32}) {
+      std::string params = "body=" + std::to_string(body) +
+                           " clock=" + (clock == 0 ? "empty" : "dense") +
+                           (clock == 0 ? "" : std::to_string(clock));
+      payload_t *source = make_payload(1, 1, body, clock > 0, clock, 0);
+      ssize_t len = 0;
+
+      measure(config, "codec/encode", params, scaled(config, MILLION),
+              [&](uint64_t ops) {
+                steady_clock::time_point start = steady_clock::now();
+                for (uint64_t i = 0; i < ops; i++) {
+                  source->packet_uid = static_cast<PacketID>(i);
+                  len = encode_udp_payload(nullptr, source, datagram.data(),
+                                           source->buff_size);
+                }
+                sink = sink + static_cast<uint64_t>(len);
+                return elapsed_ns(start);
+              });
+
+      len = encode_udp_payload(nullptr, source, datagram.data(),
+                               source->buff_size);
+      std::vector<payload_t> decoded(scaled(config, MILLION / 4));
+      measure(config, "codec/decode", params, decoded.size(),
+              [&](uint64_t ops) {
+                steady_clock::time_point start = steady_clock::now();
+                for (uint64_t i = 0; i < ops; i++) {
+                  decode_udp_payload(nullptr, &decoded[i], datagram.data(),
+                                     static_cast<size_t>(len));
+                }
+                uint64_t ns = elapsed_ns(start);
+                for (uint64_t i = 0; i < ops; i++) {
+                  delete[] decoded[i].buffer;
+                  delete[] decoded[i].vector_clock;
+                }
+                return ns;
+              });
+
+      std::vector<payload_t> copies(scaled(config, MILLION / 4));
+      measure(config, "payload/copy", params, copies.size(),
+              [&](uint64_t ops) {
+                steady_clock::time_point start = steady_clock::now();
+                for (uint64_t i = 0; i < ops; i++) {
+                  copy_payload(&copies[i], source);
+                }
+                uint64_t ns = elapsed_ns(start);
+                for (uint64_t i = 0; i < ops; i++) {
+                  delete[] copies[i].buffer;
+                  delete[] copies[i].vector_clock;
+                }
+                return ns;
+              });
+      free_payload(source);
+    }
+  }
+}
+
+typedef struct {
+  SenderID sender_id;
+  payload_t *payload;
+} set_insert_t;
+
+// Every owner broadcasts the same number of packets, each acked by a
+// majority, in rounds; then each block of `window` inserts is shuffled, 1
+// keeping the arrival order
+class SetWorkload {
+
+public:
+  uint32_t processes;
+  uint32_t packets;
+  std::vector<payload_t *> payloads;
+  std::vector<set_insert_t> inserts;
+  CausalityMap causality;
+  CausalityMap reverse_causality;
+  node_t myself;
+
+  SetWorkload(uint32_t processes_in, uint32_t window)
+      : payloads(), inserts(), causality(), reverse_causality() {
+    processes = processes_in;
+    uint32_t majority = processes / 2 + 1;
+    packets = std::max<uint32_t>(1, SET_INSERTS / (processes * majority));
+    myself.id = 1;
+    for (uint32_t node_id = 1; node_id <= processes; node_id++) {
+      // each process depends on itself and the previous one
+      causality[node_id] = {node_id};
+      reverse_causality[node_id].push_back(node_id);
+      if (node_id > 1) {
+        causality[node_id].push_back(node_id - 1);
+        reverse_causality[node_id - 1].push_back(node_id);
+      }
+    }
+
+    for (PacketID packet_uid = 1; packet_uid <= packets; packet_uid++) {
+      for (OwnerID owner_id = 1; owner_id <= processes; owner_id++) {
+        payload_t *payload = make_payload(owner_id, packet_uid, 8, false,
+                                          processes, 0);
+        payloads.push_back(payload);
+        for (SenderID sender_id = 1; sender_id <= majority; sender_id++) {
+          inserts.push_back({sender_id, payload});
+        }
+      }
+    }
+    std::mt19937 random(SEED);
+    for (size_t from = 0; from < inserts.size(); from += window) {
+      size_t to = std::min(inserts.size(), from + window);
+      std::shuffle(inserts.begin() + static_cast<ptrdiff_t>(from),
+                   inserts.begin() + static_cast<ptrdiff_t>(to), random);
+    }
+  }
+
+  ~SetWorkload() {
+    for (payload_t *payload : payloads) {
+      free_payload(payload);
+    }
+  }
+
+  DeliveredSet *make_set(uint64_t *deliveries) {
+    DeliveredSet *set = new DeliveredSet(&myself, processes);
+    set->causality = &causality;
+    set->reverse_causality = &reverse_causality;
+    set->on_deliver = [deliveries](OwnerID, PacketID, const char *,
+                                   size_t) noexcept { (*deliveries)++; };
+    return set;
+  }
+};
+
+static void bench_delivered_set(const bench_config_t &config) {
+  for (uint32_t processes : SET_SIZES) {
+    for (uint32_t window : {1, 16, 256}) {
+      std::string params = "n=" + std::to_string(processes) +
+                           " window=" + std::to_string(window);
+      if (!selected(config, "delivered_set/insert", params) &&
+          !selected(config, "delivered_set/contains", params)) {
+        continue;
+      }
+      SetWorkload workload(processes, window);
+
+      measure(config, "delivered_set/insert", params,
+              workload.inserts.size(), [&workload](uint64_t ops) {
+                uint64_t deliveries = 0;
+                DeliveredSet *set = workload.make_set(&deliveries);
+                steady_clock::time_point start = steady_clock::now();
+                for (uint64_t i = 0; i < ops; i++) {
+                  set->insert(workload.inserts[i].sender_id,
+                              workload.inserts[i].payload);
+                }
+                uint64_t ns = elapsed_ns(start);
+                delete set;
+                if (deliveries != workload.payloads.size()) {
+                  throw std::runtime_error("the workload was not delivered");
+                }
+                return ns;
+              });
+
+      // half the workload is in, so some senders hold packets out of order
+      uint64_t deliveries = 0;
+      DeliveredSet *set = workload.make_set(&deliveries);
+      for (size_t i = 0; i < workload.inserts.size() / 2; i++) {
+        set->insert(workload.inserts[i].sender_id,
+                    workload.inserts[i].payload);
+      }
+      std::mt19937 random(SEED);
+      std::uniform_int_distribution<size_t> pick_payload(
+          0, workload.payloads.size() - 1);
+      std::uniform_int_distribution<SenderID> pick_sender(1, processes);
+      std::vector<set_insert_t> queries;
+      for (uint64_t i = 0; i < scaled(config, MILLION); i++) {
+        queries.push_back(
+            {pick_sender(random), workload.payloads[pick_payload(random)]});
+      }
+      uint64_t held = 0;
+      measure(config, "delivered_set/contains", params, queries.size(),
+              [&](uint64_t ops) {
+                steady_clock::time_point start = steady_clock::now();
+                for (uint64_t i = 0; i < ops; i++) {
+                  held += set->contains(queries[i].sender_id,
+                                        queries[i].payload);
+                }
+                sink = sink + held;
+                return elapsed_ns(start);
+              });
+      delete set;
+    }
+  }
+
+  for (uint32_t processes : SET_SIZES) {
+    // clocks against every process, met so the whole clock is checked
+    SetWorkload workload(processes, 1);
+    for (uint32_t node_id = 1; node_id <= processes; node_id++) {
+      workload.causality[1].push_back(node_id);
+    }
+    uint64_t deliveries = 0;
+    DeliveredSet *set = workload.make_set(&deliveries);
+    for (uint32_t node_id = 0; node_id <= processes; node_id++) {
+      set->vector_clock[node_id] = processes + 1;
+    }
+
+    std::vector<std::pair<std::string, payload_t *>> clocks = {
+        {"dense", make_payload(1, 1, 8, true, processes, 0)},
+        {"sparse0", make_payload(1, 1, 8, false, processes, 0)},
+        {"sparse" + std::to_string(processes / 4),
+         make_payload(1, 1, 8, false, processes, processes / 4)}};
+    for (auto &clock : clocks) {
+      payload_t *payload = clock.second;
+      uint64_t happy = 0;
+      measure(config, "delivered_set/can_lcb_deliver",
+              "n=" + std::to_string(processes) + " clock=" + clock.first,
+              scaled(config, MILLION), [&](uint64_t ops) {
+                steady_clock::time_point start = steady_clock::now();
+                for (uint64_t i = 0; i < ops; i++) {
+                  happy += set->can_lcb_deliver(payload, 1);
+                }
+                sink = sink + happy;
+                return elapsed_ns(start);
+              });
+      free_payload(payload);
+    }
+    delete set;
+  }
+}
+
+static void bench_output(const bench_config_t &config) {
+  std::ofstream output("/dev/null");
+  measure(config, "output/write", "broadcasts=1/8 deliveries=7/8",
+          scaled(config, MILLION / 4), [&output](uint64_t ops) {
+            PayloadQueue broadcasted;
+            PayloadQueue deliverable;
+            for (uint64_t i = 1; i <= ops; i++) {
+              PacketID packet_uid = static_cast<PacketID>(i);
+              std::string text = std::to_string(packet_uid);
+              payload_t *payload = make_payload(
+                  static_cast<OwnerID>(i % 8), packet_uid, text.size(), false,
+                  0, 0);
+              if (i % 8 == 0) {
+                broadcasted.enqueue(payload);
+              } else {
+                deliverable.enqueue(payload);
+              }
+            }
+            steady_clock::time_point start = steady_clock::now();
+            write_output(output, &broadcasted, &deliverable, 0);
+            output.flush();
+            return elapsed_ns(start);
+          });
+}
+
+int main(int argc, char **argv) {
+  bench_config_t config;
+  parse_args(argc, argv, config);
+
+  if (!config.json) {
+    std::cout << "benchmark\tparams\tops\tmedian_ns\tmin_ns\tmax_ns\tmad_pct"
+              << "\n";
+  }
+  bench_queue(config);
+  bench_codec(config);
+  bench_delivered_set(config);
+  bench_output(config);
+  return 0;
+}
@@ -0,0 +1,209 @@
+// Replays a trace captured with DA_CAPTURE (see capture.hpp) through the
+// receive and delivery path of the process that captured it: every datagram
+// goes through decode_udp_payload, then handle_payload, which inserts it in
+// the delivered set, relays it and delivers what became deliverable. Whatever
+// the process would send in return (ACKs, NACKs, relays, retransmissions) is
+// dropped, so the run measures that path alone, against real traffic and in
+// the same order every time. The process' own broadcasts are not part of
+// the trace, so its deliveries of them are missing from the replay.
+//
+//   da_replay [--paced] [--speed X] [--channel K] TRACE
+//
+// Datagrams are fed as fast as possible unless --paced, which keeps their
+// recorded arrival times, sped up X times with --speed. DA_RELIABILITY has
+// to match the mode of the captured run. A process serving several channels
+// (DA_CHANNELS) records all of them, only channel K, 0 by default, is
+// replayed.
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "broadcast.hpp"
+#include "capture.hpp"
+#include "common.hpp"
+#include "delivered_set.hpp"
+#include "failure_detector.hpp"
+#include "messages.hpp"
+#include "overlay.hpp"
+#include "pipeline.hpp"
+#include "tcp.hpp"
+
+#define KILOBYTE 1024
+
+using namespace std::chrono; // noqa
+
+typedef struct {
+  bool paced = false;
+  double speed = 1;
+  uint32_t channel = 0;
+  std::string trace;
+} replay_config_t;
+
+static void usage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [--paced] [--speed X] [--channel K] TRACE\n";
+  exit(2);
+}
+
+static void parse_args(int argc, char **argv, replay_config_t &config) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--paced") {
+      config.paced = true;
+    } else if (arg == "--speed" && i + 1 < argc) {
+      config.speed = std::stod(argv[++i]);
+    } else if (arg == "--channel" && i + 1 < argc) {
+      config.channel = static_cast<uint32_t>(std::stoul(argv[++i]));
+    } else if (arg.rfind("--", 0) == 0 || !config.trace.empty()) {
+      usage(argv[0]);
+    } else {
+      config.trace = arg;
+    }
+  }
+  if (config.trace.empty() || config.speed <= 0 ||
+      config.channel >= MAX_CHANNELS) {
+    usage(argv[0]);
+  }
+}
+
+// Frees what handling a datagram queued for sending, returns how much
+static uint64_t drop_replies(tcp_handler_t *h) {
+  uint64_t dropped = 0;
+  message_t *message;
+  while ((message = h->sending_queue->try_dequeue()) != nullptr) {
+    retransmission_t *retransmission = message->retransmission;
+    free_message(message);
+    if (retransmission != nullptr) {
+      // the last of its sends moves it to the retransmission queue
+      release_retransmission(h, retransmission);
+    }
+    dropped++;
+  }
+  retransmission_t *retransmission;
+  while (h->retrans_queue->try_dequeue(retransmission)) {
+    free_retransmission(retransmission);
+  }
+  return dropped;
+}
+
+int main(int argc, char **argv) {
+  replay_config_t config;
+  parse_args(argc, argv, config);
+
+  TraceReader trace(config.trace);
+  if (trace.process_id == 0 || trace.process_id > trace.processes) {
+    throw std::runtime_error("the trace names no process it was captured by");
+  }
+
+  std::vector<node_t *> nodes;
+  for (uint32_t id = 1; id <= trace.processes; id++) {
+    node_t *node = new node_t;
+    node->id = id;
+    node->ip = 0;
+    node->port = 0;
+    nodes.push_back(node);
+  }
+  node_t *myself_node = nodes[trace.process_id - 1];
+  node_t group_node;
+  group_node.id = MULTICAST_NODE_ID;
+
+  // the stack of the capturing process, wired as in main.cpp
+  std::atomic<bool> finito = false;
+  SendScheduler sending_queue;
+  RetransmissionQueue retrans_queue;
+  PayloadQueue deliverable;
+  PayloadQueue broadcasted_queue;
+  DeliveredSet delivered = DeliveredSet(myself_node, nodes.size());
+  delivered.deliverable = &deliverable;
+  delivered.causality = &trace.causality;
+  delivered.reverse_causality = &trace.reverse_causality;
+  FailureDetector detector = FailureDetector(nodes.size());
+  detector.watch(&delivered);
+  FecCodec fec = FecCodec(myself_node->id);
+  Fragmenter fragments;
+  UringLink uring = UringLink(-1);
+  GsoBatcher gso = GsoBatcher(-1, &uring);
+  Overlay overlay = Overlay(static_cast<OverlayMode>(DISSEMINATION_OVERLAY),
+                            OVERLAY_FANOUT, myself_node, &nodes, &detector);
+  GapDetector gaps = GapDetector(nodes.size());
+  SentLog sent_log;
+  PipelineConfig pipeline;
+
+  tcp_handler_t handler = tcp_handler_t();
+  handler.sockfd = -1;
+  handler.multicast_sockfd = -1;
+  handler.group_node = &group_node;
+  handler.finito = &finito;
+  handler.current_node = myself_node;
+  handler.nodes = &nodes;
+  handler.delivered = &delivered;
+  handler.detector = &detector;
+  handler.fec = &fec;
+  handler.fragments = &fragments;
+  handler.gso = &gso;
+  handler.overlay = &overlay;
+  handler.uring = &uring;
+  handler.pipeline = &pipeline;
+  handler.reliability = reliability_from_env();
+  handler.gaps = &gaps;
+  handler.sent_log = &sent_log;
+  handler.capture = nullptr;
+  handler.channel_id = static_cast<uint16_t>(config.channel);
+  handler.channels = nullptr;
+  handler.sending_queue = &sending_queue;
+  handler.retrans_queue = &retrans_queue;
+  handler.broadcasted_queue = &broadcasted_queue;
+  handler.broadcast_seq = 0;
+
+  uint64_t deliveries = 0;
+  set_delivery_callback(&handler,
+                        [&deliveries](OwnerID, PacketID, const char *,
+                                      size_t) noexcept { deliveries++; });
+
+  uint64_t datagrams = 0, bytes = 0, replies = 0, recorded_ns = 0;
+  trace_record_t record;
+  steady_clock::time_point start = steady_clock::now();
+  while (trace.next(record)) {
+    if (config.paced) {
+      std::this_thread::sleep_until(
+          start + nanoseconds(static_cast<int64_t>(
+                      static_cast<double>(record.at_ns) / config.speed)));
+    }
+    payload_t *payload = new payload_t;
+    if (decode_udp_payload(&handler, payload, record.datagram, record.len)) {
+      dispatch_payload(&handler, payload);
+      replies += drop_replies(&handler);
+    } else {
+      delete payload; // recorded before the checks, dropped like live
+    }
+
+    datagrams++;
+    bytes += record.len;
+    recorded_ns = record.at_ns;
+  }
+  double wall_s = duration<double>(steady_clock::now() - start).count();
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "Replayed " << datagrams << " datagrams (" << bytes / KILOBYTE
+            << " KB) received by process " << trace.process_id << " over "
+            << static_cast<double>(recorded_ns) / 1e9 << " s, in " << wall_s
+            << " s: " << static_cast<double>(datagrams) / wall_s
+            << " datagrams/s, "
+            << wall_s * 1e9 /
+                   static_cast<double>(std::max<uint64_t>(datagrams, 1))
+            << " ns per datagram\n";
+  std::cout << "Delivered " << deliveries << " messages, "
+            << static_cast<double>(deliveries) / wall_s
+            << " per second; dropped " << replies << " replies\n";
+
+  finito = true;
+  for (node_t *node : nodes) {
+    delete node;
+  }
+  return 0;
+}
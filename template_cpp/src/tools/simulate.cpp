@@ -0,0 +1,763 @@
+// Discrete-event simulation of the protocol at scale. Every process runs the
+// real stack (delivered set, broadcast, relays, ACKs, retransmissions,
+// digests, heartbeats) in one thread, in virtual time, over a modelled
+// network: latency with jitter, a bandwidth limited link per process,
+// random loss, bounded receive buffers and a CPU cost per datagram and byte.
+//
+//   da_sim [--processes N] [--messages M] [--senders S] [--rate R]
+//          [--deps none|chain|all] [--latency US] [--jitter US]
+//          [--bandwidth MBPS] [--loss P] [--buffer KB] [--cpu-datagram US]
+//          [--cpu-byte NS] [--overlay off|tree|gossip] [--fanout K]
+//          [--reliability ack|nack] [--limit S] [--seed X]
+//          [--crash ID] [--crash-at S] [--settle S] [--reorder P]
+//
+// The first S processes broadcast M messages each, R per second. The run
+// ends once every process delivered every message, or after S virtual
+// seconds. Datagrams are accounted at their encoded size plus IP and UDP
+// headers; fragmentation, compression and FEC are not simulated.
+//
+// Every delivery is checked against FIFO order and against the deliveries
+// its owner had made of its dependencies when it broadcast it, and the run
+// fails on any violation. --reorder holds back that share of the data and
+// relay datagrams for REORDER_HOLD_US, so the packets an owner sent after
+// them overtake them; with --loss, the packets whose clocks only carry what
+// grew since the previous one (see project_vector_clock) arrive without it.
+//
+// --crash stops process ID for good at the given virtual time: the others
+// then only have to deliver each other's messages. --settle keeps the run
+// going for that long once they did, and fails it unless every live process
+// by then saw every message of the live ones stable and keeps nothing for
+// them: no parked or queued retransmission, and no more than SENT_LOG_LIMIT
+// logged packets the crashed process lacks.
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+#include "broadcast.hpp"
+#include "common.hpp"
+#include "delivered_set.hpp"
+#include "failure_detector.hpp"
+#include "messages.hpp"
+#include "overlay.hpp"
+#include "pipeline.hpp"
+#include "protocol_clock.hpp"
+#include "tcp.hpp"
+
+// How often a process retransmits, broadcasts and drains its sending queue
+#define TICK_US 1000
+// How long --reorder holds a datagram back, several ticks of broadcasts
+#define REORDER_HOLD_US 5000
+// IPv4 and UDP headers
+#define DATAGRAM_OVERHEAD 28
+#define KILOBYTE 1024
+
+using namespace std::chrono; // noqa
+
+typedef struct {
+  uint32_t processes = 16;
+  uint32_t messages = 10;
+  uint32_t senders = 0; // every process
+  double rate = 1000;
+  std::string deps = "chain";
+  double latency_us = 50;
+  double jitter_us = 20;
+  double bandwidth_mbps = 1000;
+  double loss = 0;
+  double buffer_kb = 256;
+  double cpu_datagram_us = 2;
+  double cpu_byte_ns = 1;
+  OverlayMode overlay = static_cast<OverlayMode>(DISSEMINATION_OVERLAY);
+  uint32_t fanout = OVERLAY_FANOUT;
+  Reliability reliability = RELIABILITY_ACK;
+  double limit_s = 30;
+  uint64_t seed = 1;
+  uint32_t crash = 0; // none
+  double crash_at_s = 1;
+  double settle_s = 0;
+  double reorder = 0;
+} sim_config_t;
+
+enum DatagramKind {
+  KIND_DATA = 0, // first copies and retransmissions of our own messages
+  KIND_RELAY,
+  KIND_ACK,
+  KIND_NACK,
+  KIND_DIGEST,
+  KIND_HEARTBEAT,
+  KINDS
+};
+
+static const char *const KIND_NAMES[KINDS] = {
+    "data", "relay", "ack", "nack", "digest", "heartbeat"};
+
+enum EventKind {
+  EVENT_ARRIVAL = 0,
+  EVENT_PROCESS, // the process takes the next datagram of its inbox
+  EVENT_TICK,
+  EVENT_DIGEST,
+  EVENT_HEARTBEAT
+};
+
+typedef struct {
+  steady_clock::time_point time;
+  uint64_t seq;
+  EventKind kind;
+  uint32_t process;
+  payload_t *payload;
+} event_t;
+
+// Pending events in time order, ties in scheduling order
+struct earlier_event {
+  bool operator()(const event_t &a, const event_t &b) const {
+    return a.time != b.time ? a.time < b.time : a.seq < b.seq;
+  }
+};
+
+// One process: its stack wired as in main.cpp, plus the state of its host
+struct sim_process_s {
+  SendScheduler sending_queue;
+  RetransmissionQueue retrans_queue;
+  PayloadQueue deliverable;
+  PayloadQueue broadcasted_queue;
+  DeliveredSet delivered;
+  FailureDetector detector;
+  FecCodec fec;
+  Fragmenter fragments;
+  UringLink uring;
+  GsoBatcher gso;
+  Overlay overlay;
+  GapDetector gaps;
+  SentLog sent_log;
+  tcp_handler_t handler;
+
+  retransmission_t *pending = nullptr;
+  std::vector<uint32_t> last_digest;
+  uint32_t digest_rounds = 0;
+  uint32_t heartbeat_rounds = 0;
+
+  std::deque<payload_t *> inbox;
+  int64_t inbox_bytes = 0;
+  bool processing = false;
+  steady_clock::time_point cpu_free_at;
+  steady_clock::time_point link_free_at;
+
+  uint32_t broadcasts = 0;
+  uint64_t deliveries = 0;
+  // last packet delivered of each owner
+  std::vector<uint32_t> delivered_up_to;
+  // what each broadcast depends on: the packets of every dependency but the
+  // owner itself delivered by then, in causality order
+  std::vector<uint32_t> broadcast_clocks;
+  // data and relay datagrams it sent
+  uint64_t payload_sends = 0;
+  std::vector<steady_clock::time_point> broadcast_times;
+  uint32_t peak_sending = 0;
+  uint32_t peak_retrans = 0;
+
+  sim_process_s(node_t *node, std::vector<node_t *> *nodes,
+                sim_config_t &config)
+      : sending_queue(), retrans_queue(), deliverable(), broadcasted_queue(),
+        delivered(node, nodes->size()), detector(nodes->size()),
+        fec(node->id), fragments(), uring(-1), gso(-1, &uring),
+        overlay(config.overlay, config.fanout, node, nodes, &detector),
+        gaps(nodes->size()), sent_log(), handler(),
+        last_digest(), inbox(), delivered_up_to(nodes->size() + 1, 0),
+        broadcast_clocks(), broadcast_times() {
+    detector.watch(&delivered);
+  }
+};
+typedef struct sim_process_s sim_process_t;
+
+typedef struct {
+  sim_config_t config;
+  steady_clock::time_point now;
+  steady_clock::time_point start;
+  std::set<event_t, earlier_event> events;
+  uint64_t next_seq = 0;
+  std::mt19937_64 random;
+
+  std::atomic<bool> finito;
+  std::vector<node_t *> nodes;
+  std::vector<sim_process_t *> processes;
+  CausalityMap causality;
+  CausalityMap reverse_causality;
+  PipelineConfig pipeline;
+  node_t group_node;
+
+  uint64_t datagrams[KINDS] = {};
+  uint64_t bytes[KINDS] = {};
+  uint64_t lost = 0;
+  uint64_t overflowed = 0;
+  uint64_t events_run = 0;
+  uint64_t deliveries = 0;
+  uint64_t expected_deliveries = 0;
+  uint64_t reordered = 0;
+  uint64_t violations = 0;
+  std::vector<double> latencies_ms;
+} simulation_t;
+
+static void schedule(simulation_t *sim, steady_clock::time_point time,
+                     EventKind kind, uint32_t process,
+                     payload_t *payload = nullptr) {
+  sim->events.insert({time, sim->next_seq++, kind, process, payload});
+}
+
+static nanoseconds cpu_cost(simulation_t *sim, int64_t bytes) {
+  double ns = sim->config.cpu_datagram_us * 1000 +
+              sim->config.cpu_byte_ns * static_cast<double>(bytes);
+  return nanoseconds(static_cast<int64_t>(ns));
+}
+
+static nanoseconds microseconds_of(double us) {
+  return nanoseconds(static_cast<int64_t>(us * 1000));
+}
+
+static bool has_crashed(simulation_t *sim, uint32_t process) {
+  return process + 1 == sim->config.crash &&
+         sim->now >= sim->start + microseconds_of(sim->config.crash_at_s *
+                                                  MILLION);
+}
+
+static DatagramKind datagram_kind(node_t *sender, payload_t *payload) {
+  if (payload->is_ack) {
+    return KIND_ACK;
+  }
+  if (payload->is_nack) {
+    return KIND_NACK;
+  }
+  if (payload->is_digest) {
+    return KIND_DIGEST;
+  }
+  if (payload->is_heartbeat) {
+    return KIND_HEARTBEAT;
+  }
+  return payload->owner_id == sender->id ? KIND_DATA : KIND_RELAY;
+}
+
+// The simulated_link of process `from`: charges its CPU and link for the
+// datagram and schedules a copy of it at the receiver
+static bool transmit(simulation_t *sim, uint32_t from, node_t *receiver,
+                     payload_t *payload) {
+  sim_process_t *process = sim->processes[from];
+  int64_t bytes = Fragmenter::encoded_size(payload) + DATAGRAM_OVERHEAD;
+  DatagramKind kind = datagram_kind(process->handler.current_node, payload);
+  sim->datagrams[kind]++;
+  sim->bytes[kind] += static_cast<uint64_t>(bytes);
+  if (kind == KIND_DATA || kind == KIND_RELAY) {
+    process->payload_sends++;
+  }
+
+  process->cpu_free_at =
+      std::max(process->cpu_free_at, sim->now) + cpu_cost(sim, bytes);
+  double serialization_us =
+      static_cast<double>(bytes * 8) / sim->config.bandwidth_mbps;
+  process->link_free_at =
+      std::max(process->link_free_at, process->cpu_free_at) +
+      microseconds_of(serialization_us);
+
+  std::uniform_real_distribution<double> uniform(0, 1);
+  if (uniform(sim->random) < sim->config.loss) {
+    sim->lost++;
+    return true;
+  }
+  double delay_us =
+      sim->config.latency_us + sim->config.jitter_us * uniform(sim->random);
+  if ((kind == KIND_DATA || kind == KIND_RELAY) &&
+      uniform(sim->random) < sim->config.reorder) {
+    sim->reordered++;
+    delay_us += REORDER_HOLD_US;
+  }
+  payload_t *copy = new payload_t;
+  copy_payload(copy, payload);
+  schedule(sim, process->link_free_at + microseconds_of(delay_us),
+           EVENT_ARRIVAL, receiver->id - 1, copy);
+  return true;
+}
+
+// Drains the sending queue as long as the link keeps up, as a blocking
+// socket would
+static void pump(simulation_t *sim, sim_process_t *process) {
+  nanoseconds backlog =
+      microseconds_of(sim->config.buffer_kb * KILOBYTE * 8 /
+                      sim->config.bandwidth_mbps);
+  while (process->link_free_at - sim->now < backlog &&
+         send_queued_message(&process->handler, false)) {
+  }
+}
+
+static void broadcast_due(simulation_t *sim, sim_process_t *process) {
+  double elapsed = duration<double>(sim->now - sim->start).count();
+  uint32_t due = static_cast<uint32_t>(
+      std::min(static_cast<double>(sim->config.messages),
+               elapsed * sim->config.rate + 1));
+
+  while (process->broadcasts < due && can_broadcast(&process->handler)) {
+    std::string content = std::to_string(process->broadcasts + 1);
+    uint32_t id = process->handler.current_node->id;
+    for (uint32_t dependency : sim->causality[id]) {
+      if (dependency != id) {
+        process->broadcast_clocks.push_back(
+            process->delivered_up_to[dependency]);
+      }
+    }
+    process->broadcast_times.push_back(sim->now);
+    broadcast(&process->handler, content.c_str(), content.length());
+    process->broadcasts++;
+  }
+}
+
+static void run_event(simulation_t *sim, const event_t &event) {
+  sim_process_t *process = sim->processes[event.process];
+  tcp_handler_t *h = &process->handler;
+
+  if (has_crashed(sim, event.process)) {
+    // its timers die with it, and whatever reaches it is lost
+    if (event.payload != nullptr) {
+      free_payload(event.payload);
+    }
+    return;
+  }
+
+  switch (event.kind) {
+  case EVENT_ARRIVAL: {
+    int64_t bytes = Fragmenter::encoded_size(event.payload);
+    if (static_cast<double>(process->inbox_bytes + bytes) >
+        sim->config.buffer_kb * KILOBYTE) {
+      // receive buffer full, the kernel drops it
+      sim->overflowed++;
+      free_payload(event.payload);
+      break;
+    }
+    process->inbox.push_back(event.payload);
+    process->inbox_bytes += bytes;
+    if (!process->processing) {
+      process->processing = true;
+      schedule(sim, std::max(sim->now, process->cpu_free_at), EVENT_PROCESS,
+               event.process);
+    }
+    break;
+  }
+  case EVENT_PROCESS: {
+    payload_t *payload = process->inbox.front();
+    process->inbox.pop_front();
+    int64_t bytes = Fragmenter::encoded_size(payload);
+    process->inbox_bytes -= bytes;
+    process->cpu_free_at = std::max(process->cpu_free_at, sim->now) +
+                           cpu_cost(sim, bytes + DATAGRAM_OVERHEAD);
+    handle_payload(h, payload);
+    pump(sim, process);
+    if (process->inbox.empty()) {
+      process->processing = false;
+    } else {
+      schedule(sim, std::max(sim->now, process->cpu_free_at), EVENT_PROCESS,
+               event.process);
+    }
+    break;
+  }
+  case EVENT_TICK:
+    while (retransmit_message(h, &process->pending, WAIT_NONE)) {
+    }
+    if (event.process < sim->config.senders) {
+      broadcast_due(sim, process);
+    }
+    pump(sim, process);
+    process->peak_sending =
+        std::max(process->peak_sending, h->sending_queue->size());
+    process->peak_retrans =
+        std::max(process->peak_retrans, h->retrans_queue->size());
+    schedule(sim, sim->now + microseconds(TICK_US), EVENT_TICK,
+             event.process);
+    break;
+  case EVENT_DIGEST:
+    send_digest(h, process->last_digest, ++process->digest_rounds);
+    pump(sim, process);
+    schedule(sim, sim->now + milliseconds(DIGEST_INTERVAL_MS), EVENT_DIGEST,
+             event.process);
+    break;
+  case EVENT_HEARTBEAT:
+    send_heartbeats(h, ++process->heartbeat_rounds);
+    schedule(sim, sim->now + milliseconds(HEARTBEAT_INTERVAL_MS),
+             EVENT_HEARTBEAT, event.process);
+    break;
+  default:
+    break;
+  }
+}
+
+// Counts a violation unless `process` delivers the next packet of `owner_id`
+// and every packet the owner had delivered before broadcasting it
+static void check_delivery(simulation_t *sim, sim_process_t *process,
+                           OwnerID owner_id, PacketID packet_uid) {
+  std::vector<uint32_t> &up_to = process->delivered_up_to;
+  bool in_order = packet_uid == up_to[owner_id] + 1;
+
+  sim_process_t *owner = sim->processes[owner_id - 1];
+  std::vector<uint32_t> &needed = sim->causality[owner_id];
+  size_t width = needed.size() - 1; // without the owner itself
+  size_t column = 0;
+  for (uint32_t dependency : needed) {
+    if (dependency == owner_id) {
+      continue;
+    }
+    uint32_t required =
+        owner->broadcast_clocks[(packet_uid - 1) * width + column++];
+    in_order = in_order && up_to[dependency] >= required;
+  }
+
+  if (!in_order) {
+    sim->violations++;
+  }
+  up_to[owner_id] = std::max(up_to[owner_id], packet_uid);
+}
+
+// Same layout as a config file given to da_proc
+static void build_causality(simulation_t *sim) {
+  for (uint32_t id = 1; id <= sim->config.processes; id++) {
+    std::vector<uint32_t> dependencies = {id};
+    if (sim->config.deps == "chain" && id > 1) {
+      dependencies.push_back(id - 1);
+    } else if (sim->config.deps == "all") {
+      for (uint32_t other = 1; other <= sim->config.processes; other++) {
+        if (other != id) {
+          dependencies.push_back(other);
+        }
+      }
+    } else if (sim->config.deps != "none" && sim->config.deps != "chain") {
+      throw std::runtime_error("unknown dependencies: " + sim->config.deps);
+    }
+    for (uint32_t dependency : dependencies) {
+      sim->causality[id].push_back(dependency);
+      sim->reverse_causality[dependency].push_back(id);
+    }
+  }
+}
+
+static void build_processes(simulation_t *sim) {
+  uint32_t n = sim->config.processes;
+  for (uint32_t id = 1; id <= n; id++) {
+    node_t *node = new node_t;
+    node->id = id;
+    node->ip = 0;
+    node->port = 0;
+    sim->nodes.push_back(node);
+  }
+  sim->group_node.id = MULTICAST_NODE_ID;
+
+  std::uniform_int_distribution<int64_t> phase(0, TICK_US * 1000);
+  for (uint32_t index = 0; index < n; index++) {
+    sim_process_t *process =
+        new sim_process_t(sim->nodes[index], &sim->nodes, sim->config);
+    tcp_handler_t *h = &process->handler;
+    process->delivered.deliverable = &process->deliverable;
+    process->delivered.causality = &sim->causality;
+    process->delivered.reverse_causality = &sim->reverse_causality;
+
+    h->sockfd = -1;
+    h->multicast_sockfd = -1;
+    h->group_node = &sim->group_node;
+    h->finito = &sim->finito;
+    h->current_node = sim->nodes[index];
+    h->nodes = &sim->nodes;
+    h->delivered = &process->delivered;
+    h->detector = &process->detector;
+    h->fec = &process->fec;
+    h->fragments = &process->fragments;
+    h->gso = &process->gso;
+    h->overlay = &process->overlay;
+    h->uring = &process->uring;
+    h->pipeline = &sim->pipeline;
+    h->reliability = sim->config.reliability;
+    h->gaps = &process->gaps;
+    h->sent_log = &process->sent_log;
+    h->sending_queue = &process->sending_queue;
+    h->retrans_queue = &process->retrans_queue;
+    h->broadcasted_queue = &process->broadcasted_queue;
+    h->broadcast_seq = 0;
+    h->channel_id = 0;
+    h->channels = nullptr;
+    h->simulated_link = [sim, index](node_t *receiver, payload_t *payload) {
+      return transmit(sim, index, receiver, payload);
+    };
+    set_delivery_callback(h, [sim, process, index](OwnerID owner_id,
+                                                   PacketID packet_uid,
+                                                   const char *, size_t) {
+      check_delivery(sim, process, owner_id, packet_uid);
+      if (index + 1 == sim->config.crash || owner_id == sim->config.crash) {
+        return; // only the live processes have to deliver
+      }
+      sim_process_t *owner = sim->processes[owner_id - 1];
+      sim->latencies_ms.push_back(
+          duration<double, std::milli>(
+              sim->now - owner->broadcast_times[packet_uid - 1])
+              .count());
+      process->deliveries++;
+      sim->deliveries++;
+    });
+    process->cpu_free_at = sim->now;
+    process->link_free_at = sim->now;
+    sim->processes.push_back(process);
+
+    // timers start out of phase, as the threads of separate processes would
+    steady_clock::time_point first = sim->now + nanoseconds(phase(sim->random));
+    schedule(sim, first, EVENT_TICK, index);
+    schedule(sim, first + milliseconds(HEARTBEAT_INTERVAL_MS),
+             EVENT_HEARTBEAT, index);
+    if (RELAY_SUPPRESSION) {
+      schedule(sim, first + milliseconds(DIGEST_INTERVAL_MS), EVENT_DIGEST,
+               index);
+    }
+  }
+}
+
+static double peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_maxrss);
+}
+
+static double percentile(std::vector<double> &sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(fraction * static_cast<double>(
+                                                    sorted.size() - 1));
+  return sorted[index];
+}
+
+static void report(simulation_t *sim, double wall_s, double setup_rss_kb) {
+  uint32_t n = sim->config.processes;
+  uint64_t messages =
+      static_cast<uint64_t>(sim->config.senders) * sim->config.messages;
+  uint64_t total_datagrams = 0, total_bytes = 0;
+  for (uint32_t kind = 0; kind < KINDS; kind++) {
+    total_datagrams += sim->datagrams[kind];
+    total_bytes += sim->bytes[kind];
+  }
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "Processes " << n << ", " << messages << " messages from "
+            << sim->config.senders << " senders, dependencies "
+            << sim->config.deps << ", overlay "
+            << OVERLAY_NAMES[sim->config.overlay] << ", reliability "
+            << (sim->config.reliability == RELIABILITY_NACK ? "nack" : "ack")
+            << "\n";
+  std::cout << "Virtual time "
+            << duration<double>(sim->now - sim->start).count()
+            << " s, wall time " << wall_s << " s, " << sim->events_run
+            << " events\n";
+  std::cout << "Delivered " << sim->deliveries << " of "
+            << sim->expected_deliveries << "\n";
+
+  double per_message = static_cast<double>(total_datagrams) /
+                       static_cast<double>(std::max<uint64_t>(messages, 1));
+  std::cout << "Datagrams " << total_datagrams << " (" << per_message
+            << " per message, " << per_message / n
+            << " per message and process), " << total_bytes / KILOBYTE
+            << " KB on the wire, lost " << sim->lost << ", overflowed "
+            << sim->overflowed << ", reordered " << sim->reordered << "\n";
+  std::cout << "Deliveries out of FIFO or causal order: " << sim->violations
+            << "\n";
+  for (uint32_t kind = 0; kind < KINDS; kind++) {
+    std::cout << "  " << std::setw(9) << KIND_NAMES[kind] << " "
+              << std::setw(12) << sim->datagrams[kind] << " datagrams "
+              << std::setw(10) << sim->bytes[kind] / KILOBYTE << " KB\n";
+  }
+
+  std::vector<double> &latencies = sim->latencies_ms;
+  std::sort(latencies.begin(), latencies.end());
+  double sum = 0;
+  for (double latency : latencies) {
+    sum += latency;
+  }
+  std::cout << "Delivery latency ms: mean "
+            << sum / static_cast<double>(std::max<size_t>(latencies.size(), 1))
+            << ", p50 " << percentile(latencies, 0.5) << ", p99 "
+            << percentile(latencies, 0.99) << ", max "
+            << (latencies.empty() ? 0 : latencies.back()) << "\n";
+
+  uint32_t peak_sending = 0, peak_retrans = 0;
+  uint64_t busiest = 0;
+  for (sim_process_t *process : sim->processes) {
+    peak_sending = std::max(peak_sending, process->peak_sending);
+    peak_retrans = std::max(peak_retrans, process->peak_retrans);
+    busiest = std::max(busiest, process->payload_sends);
+  }
+  std::cout << "Data and relays sent per message: "
+            << static_cast<double>(sim->datagrams[KIND_DATA] +
+                                   sim->datagrams[KIND_RELAY]) /
+                   static_cast<double>(std::max<uint64_t>(messages, 1)) / n
+            << " by the average process, "
+            << static_cast<double>(busiest) /
+                   static_cast<double>(std::max<uint64_t>(messages, 1))
+            << " by the busiest\n";
+  double rss_kb = peak_rss_kb();
+  std::cout << "Memory per process: " << setup_rss_kb / n << " KB at start, "
+            << rss_kb / n << " KB at peak; deepest sending queue "
+            << peak_sending << ", retransmission queue " << peak_retrans
+            << "\n";
+}
+
+// Whether every live process saw every message of the live ones stable and
+// keeps nothing for them anymore, but a bounded log for the crashed one
+static bool report_settled(simulation_t *sim) {
+  PacketID lag = 0;
+  size_t logged = 0, parked = 0, queued = 0;
+  for (uint32_t index = 0; index < sim->config.processes; index++) {
+    if (index + 1 == sim->config.crash) {
+      continue;
+    }
+    sim_process_t *process = sim->processes[index];
+    for (uint32_t owner = 1; owner <= sim->config.senders; owner++) {
+      if (owner == sim->config.crash) {
+        continue;
+      }
+      PacketID frontier = process->delivered.stable_frontier(owner);
+      lag = std::max(lag, sim->config.messages + 1 -
+                              std::min(frontier, sim->config.messages + 1));
+    }
+    logged = std::max(logged, process->sent_log.size());
+    parked = std::max(parked, process->detector.parked_count());
+    queued = std::max<size_t>(queued, process->retrans_queue.size());
+  }
+
+  std::cout << "After settling: stable frontier behind by " << lag
+            << " packets at most; at most " << logged << " logged, "
+            << parked << " parked and " << queued
+            << " queued retransmissions per process\n";
+  return lag == 0 && logged <= SENT_LOG_LIMIT && parked == 0 && queued == 0;
+}
+
+static void usage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [--processes N] [--messages M] [--senders S] [--rate R]\n"
+               "  [--deps none|chain|all] [--latency US] [--jitter US]\n"
+               "  [--bandwidth MBPS] [--loss P] [--buffer KB]\n"
+               "  [--cpu-datagram US] [--cpu-byte NS]\n"
+               "  [--overlay off|tree|gossip] [--fanout K]\n"
+               "  [--reliability ack|nack] [--limit S] [--seed X]\n"
+               "  [--crash ID] [--crash-at S] [--settle S] [--reorder P]\n";
+  exit(2);
+}
+
+static void parse_args(int argc, char **argv, sim_config_t &config) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 == argc) {
+      usage(argv[0]);
+    }
+    std::string value = argv[++i];
+    if (arg == "--processes") {
+      config.processes = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--messages") {
+      config.messages = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--senders") {
+      config.senders = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--rate") {
+      config.rate = std::stod(value);
+    } else if (arg == "--deps") {
+      config.deps = value;
+    } else if (arg == "--latency") {
+      config.latency_us = std::stod(value);
+    } else if (arg == "--jitter") {
+      config.jitter_us = std::stod(value);
+    } else if (arg == "--bandwidth") {
+      config.bandwidth_mbps = std::stod(value);
+    } else if (arg == "--loss") {
+      config.loss = std::stod(value);
+    } else if (arg == "--buffer") {
+      config.buffer_kb = std::stod(value);
+    } else if (arg == "--cpu-datagram") {
+      config.cpu_datagram_us = std::stod(value);
+    } else if (arg == "--cpu-byte") {
+      config.cpu_byte_ns = std::stod(value);
+    } else if (arg == "--overlay") {
+      config.overlay = Overlay::parse_mode(value);
+    } else if (arg == "--fanout") {
+      config.fanout = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--reliability" && (value == "ack" || value == "nack")) {
+      config.reliability = value == "nack" ? RELIABILITY_NACK : RELIABILITY_ACK;
+    } else if (arg == "--limit") {
+      config.limit_s = std::stod(value);
+    } else if (arg == "--seed") {
+      config.seed = std::stoull(value);
+    } else if (arg == "--crash") {
+      config.crash = static_cast<uint32_t>(std::stoul(value));
+    } else if (arg == "--crash-at") {
+      config.crash_at_s = std::stod(value);
+    } else if (arg == "--settle") {
+      config.settle_s = std::stod(value);
+    } else if (arg == "--reorder") {
+      config.reorder = std::stod(value);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (config.processes < 2 || config.rate <= 0 ||
+      config.bandwidth_mbps <= 0 || config.crash > config.processes) {
+    usage(argv[0]);
+  }
+  if (config.senders == 0 || config.senders > config.processes) {
+    config.senders = config.processes;
+  }
+}
+
+int main(int argc, char **argv) {
+  simulation_t *sim = new simulation_t;
+  parse_args(argc, argv, sim->config);
+  sim->random.seed(sim->config.seed);
+  sim->finito = false;
+  sim->start = steady_clock::now();
+  sim->now = sim->start;
+  ProtocolClock::use_virtual_time(&sim->now);
+
+  build_causality(sim);
+  build_processes(sim);
+  uint32_t live = sim->config.processes - (sim->config.crash > 0 ? 1 : 0);
+  uint32_t live_senders =
+      sim->config.senders - (sim->config.crash > 0 &&
+                                     sim->config.crash <= sim->config.senders
+                                 ? 1
+                                 : 0);
+  sim->expected_deliveries =
+      static_cast<uint64_t>(live) * live_senders * sim->config.messages;
+  double setup_rss_kb = peak_rss_kb();
+
+  steady_clock::time_point wall_start = steady_clock::now();
+  steady_clock::time_point limit =
+      sim->start + microseconds_of(sim->config.limit_s * MILLION);
+  steady_clock::time_point settled = steady_clock::time_point::max();
+  while (!sim->events.empty()) {
+    if (sim->deliveries == sim->expected_deliveries &&
+        settled == steady_clock::time_point::max()) {
+      settled = sim->now + microseconds_of(sim->config.settle_s * MILLION);
+    }
+    event_t event = *sim->events.begin();
+    if (event.time > limit || event.time > settled) {
+      break;
+    }
+    sim->events.erase(sim->events.begin());
+    sim->now = event.time;
+    sim->events_run++;
+    run_event(sim, event);
+  }
+  double wall_s = duration<double>(steady_clock::now() - wall_start).count();
+
+  report(sim, wall_s, setup_rss_kb);
+  bool complete = sim->deliveries == sim->expected_deliveries;
+  if (!complete) {
+    std::cout << "Time limit reached before every message was delivered\n";
+  }
+  if (complete && sim->config.settle_s > 0 && !report_settled(sim)) {
+    complete = false;
+  }
+  return complete && sim->violations == 0 ? 0 : 1;
+}
@@ -0,0 +1,386 @@
+// Checks the output files of a run against FIFO order, localized causal
+// order and uniform agreement. Every file is mapped in memory and scanned by
+// its own thread.
+//
+//   da_validate --config CONFIG [--correct 1,2,...] OUTPUT...
+//
+// The process id of an output file is the last number of its name, e.g.
+// proc003.output or 3.output. CONFIG is the file given to da_proc: the
+// number of messages, then per process its id followed by the processes it
+// depends on. Agreement is checked among the processes given as correct,
+// every process with an output file by default.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Violations printed per file and check, the rest are only counted
+#define REPORTED_VIOLATIONS 5
+#define MEGABYTE (1 << 20)
+
+using namespace std::chrono; // noqa
+
+typedef struct {
+  uint32_t id;
+  std::string path;
+  const char *data = nullptr;
+  size_t size = 0;
+  uint64_t lines = 0;
+  // per sender id, the number of its messages delivered
+  std::vector<uint32_t> delivered;
+  // per broadcast, how many messages of each dependency were delivered
+  // before it, in the order of `dependencies`
+  std::vector<uint32_t> clocks;
+  uint32_t broadcasts = 0;
+  uint64_t fifo_violations = 0;
+  uint64_t lcb_violations = 0;
+  uint64_t format_errors = 0;
+  std::ostringstream report;
+} process_log_t;
+
+// Dependencies of every process, indexed by id
+typedef std::vector<std::vector<uint32_t>> Dependencies;
+
+static void read_config(const char *path, Dependencies &dependencies) {
+  std::ifstream config(path);
+  if (!config) {
+    throw std::runtime_error(std::string("cannot open ") + path);
+  }
+  std::string line;
+  std::getline(config, line); // number of messages
+  while (std::getline(config, line)) {
+    std::istringstream numbers(line);
+    uint32_t id, dependency;
+    if (!(numbers >> id)) {
+      continue;
+    }
+    if (id >= dependencies.size()) {
+      dependencies.resize(id + 1);
+    }
+    while (numbers >> dependency) {
+      if (dependency != id) {
+        dependencies[id].push_back(dependency);
+      }
+      if (dependency >= dependencies.size()) {
+        dependencies.resize(dependency + 1);
+      }
+    }
+  }
+}
+
+static uint32_t id_from_path(const std::string &path) {
+  std::string name = path.substr(path.find_last_of('/') + 1);
+  size_t end = name.find_last_of("0123456789");
+  if (end == std::string::npos) {
+    throw std::runtime_error("no process id in file name " + path);
+  }
+  size_t start = name.find_last_not_of("0123456789", end);
+  start = start == std::string::npos ? 0 : start + 1;
+  return static_cast<uint32_t>(
+      std::stoul(name.substr(start, end - start + 1)));
+}
+
+static void map_file(process_log_t *log) {
+  int fd = open(log->path.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd < 0 || fstat(fd, &info) < 0) {
+    throw std::runtime_error("cannot open " + log->path);
+  }
+  log->size = static_cast<size_t>(info.st_size);
+  if (log->size > 0) {
+    void *data = mmap(nullptr, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("cannot map " + log->path);
+    }
+    madvise(data, log->size, MADV_SEQUENTIAL);
+    log->data = static_cast<const char *>(data);
+  }
+  close(fd);
+}
+
+// Reads the next decimal number after spaces, false if there is none
+static inline bool scan_number(const char *&cursor, const char *end,
+                               uint32_t &value) {
+  while (cursor < end && *cursor == ' ') {
+    cursor++;
+  }
+  if (cursor == end || *cursor < '0' || *cursor > '9') {
+    return false;
+  }
+  uint64_t number = 0;
+  while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+    number = number * 10 + static_cast<uint64_t>(*cursor - '0');
+    cursor++;
+  }
+  value = static_cast<uint32_t>(number);
+  return number <= UINT32_MAX;
+}
+
+// Calls `on_broadcast(line, seq)` and `on_delivery(line, sender, seq)` for
+// every line, other lines are malformed and reported by the first pass
+template <typename B, typename D>
+static void scan_log(process_log_t *log, bool first_pass, B on_broadcast,
+                     D on_delivery) {
+  const char *cursor = log->data;
+  const char *end = log->data + log->size;
+  uint64_t line = 0;
+
+  while (cursor < end) {
+    const char *line_end = static_cast<const char *>(
+        memchr(cursor, '\n', static_cast<size_t>(end - cursor)));
+    if (line_end == nullptr) {
+      line_end = end; // the last line may be cut short by a crash
+    }
+    line++;
+
+    uint32_t sender, seq;
+    char kind = *cursor++;
+    if (kind == 'b' && scan_number(cursor, line_end, seq)) {
+      on_broadcast(line, seq);
+    } else if (kind == 'd' && scan_number(cursor, line_end, sender) &&
+               scan_number(cursor, line_end, seq) &&
+               sender < log->delivered.size()) {
+      on_delivery(line, sender, seq);
+    } else if (first_pass && line_end != end) {
+      if (log->format_errors++ < REPORTED_VIOLATIONS)
+        log->report << log->path << ":" << line << ": malformed line\n";
+    }
+    cursor = line_end + 1;
+  }
+  log->lines = line;
+}
+
+// First pass: broadcast and FIFO order, and the dependency clock of every
+// broadcast. A process logs a broadcast along with the snapshot of its clock
+// and writes each batch broadcasts first, so a broadcast never comes after a
+// delivery it did not depend on. It may come before deliveries it did depend
+// on: the check errs on the weak side and never reports a false violation
+static void check_fifo(process_log_t *log, const Dependencies &dependencies) {
+  const std::vector<uint32_t> &own = dependencies[log->id];
+  std::vector<uint32_t> &delivered = log->delivered;
+
+  scan_log(
+      log, true,
+      [&](uint64_t line, uint32_t seq) {
+        if (seq != log->broadcasts + 1 &&
+            log->fifo_violations++ < REPORTED_VIOLATIONS)
+          log->report << log->path << ":" << line << ": broadcast " << seq
+                      << ", expected " << log->broadcasts + 1 << "\n";
+        log->broadcasts++;
+        for (uint32_t dependency : own) {
+          log->clocks.push_back(delivered[dependency]);
+        }
+      },
+      [&](uint64_t line, uint32_t sender, uint32_t seq) {
+        uint32_t &count = delivered[sender];
+        if (seq != count + 1 && log->fifo_violations++ < REPORTED_VIOLATIONS)
+          log->report << log->path << ":" << line << ": delivered " << sender
+                      << " " << seq << ", expected " << sender << " "
+                      << count + 1 << "\n";
+        count = std::max(count, seq);
+      });
+}
+
+// Second pass: every delivery follows the deliveries its sender depended on
+// when it broadcast the message
+static void check_lcb(process_log_t *log, const Dependencies &dependencies,
+                      const std::vector<process_log_t *> &logs) {
+  std::vector<uint32_t> delivered(logs.size(), 0);
+
+  scan_log(
+      log, false, [](uint64_t, uint32_t) {},
+      [&](uint64_t line, uint32_t sender, uint32_t seq) {
+        process_log_t *sender_log = logs[sender];
+        const std::vector<uint32_t> &needed = dependencies[sender];
+        if (sender_log != nullptr && seq >= 1 &&
+            seq <= sender_log->broadcasts) {
+          const uint32_t *clock =
+              sender_log->clocks.data() + (seq - 1) * needed.size();
+          for (size_t i = 0; i < needed.size(); i++) {
+            uint32_t have = delivered[needed[i]];
+            if (have < clock[i] &&
+                log->lcb_violations++ < REPORTED_VIOLATIONS)
+              log->report << log->path << ":" << line << ": delivered "
+                          << sender << " " << seq << " after " << have
+                          << " messages of " << needed[i] << ", needs "
+                          << clock[i] << "\n";
+          }
+        }
+        uint32_t &count = delivered[sender];
+        count = std::max(count, seq);
+      });
+}
+
+// Runs `check` on every log, one thread per core
+template <typename F>
+static void parallel_for(std::vector<process_log_t *> &logs, F check) {
+  std::atomic<size_t> next = 0;
+  size_t workers = std::min<size_t>(
+      logs.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < workers; i++) {
+    threads.emplace_back([&]() {
+      for (size_t index = next++; index < logs.size(); index = next++) {
+        check(logs[index]);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+// A message delivered by any process is delivered by every correct one. With
+// FIFO order this compares the number of delivered messages of each sender
+static uint64_t check_agreement(const std::vector<process_log_t *> &logs,
+                                const std::vector<uint32_t> &correct) {
+  // per sender, the most messages delivered and by whom
+  std::vector<uint32_t> most(logs.size(), 0);
+  std::vector<uint32_t> by(logs.size(), 0);
+  for (process_log_t *log : logs) {
+    for (size_t sender = 0; log != nullptr && sender < logs.size(); sender++) {
+      if (log->delivered[sender] > most[sender]) {
+        most[sender] = log->delivered[sender];
+        by[sender] = log->id;
+      }
+    }
+  }
+
+  uint64_t violations = 0;
+  for (uint32_t id : correct) {
+    for (size_t sender = 0; sender < logs.size(); sender++) {
+      uint32_t count = logs[id]->delivered[sender];
+      if (count < most[sender] &&
+          violations++ < REPORTED_VIOLATIONS * correct.size())
+        std::cout << "process " << id << " delivered " << count
+                  << " messages of " << sender << ", process " << by[sender]
+                  << " delivered " << most[sender] << "\n";
+    }
+  }
+  return violations;
+}
+
+static void usage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " --config CONFIG [--correct ID,...] OUTPUT...\n";
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *config_path = nullptr;
+  std::vector<uint32_t> correct;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--config" && i + 1 < argc) {
+      config_path = argv[++i];
+    } else if (arg == "--correct" && i + 1 < argc) {
+      std::istringstream ids(argv[++i]);
+      std::string id;
+      while (std::getline(ids, id, ',')) {
+        correct.push_back(static_cast<uint32_t>(std::stoul(id)));
+      }
+    } else if (arg.rfind("--", 0) == 0) {
+      usage(argv[0]);
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (config_path == nullptr || paths.empty()) {
+    usage(argv[0]);
+  }
+
+  steady_clock::time_point start = steady_clock::now();
+  Dependencies dependencies;
+  read_config(config_path, dependencies);
+
+  std::vector<process_log_t *> order;
+  size_t ids = dependencies.size();
+  for (std::string &path : paths) {
+    process_log_t *log = new process_log_t;
+    log->path = path;
+    log->id = id_from_path(path);
+    ids = std::max<size_t>(ids, log->id + 1);
+    map_file(log);
+    order.push_back(log);
+  }
+
+  // from here on every table is indexed by process id
+  dependencies.resize(ids);
+  std::vector<process_log_t *> logs(ids, nullptr);
+  for (process_log_t *log : order) {
+    if (logs[log->id] != nullptr) {
+      throw std::runtime_error("two output files for process " +
+                               std::to_string(log->id));
+    }
+    logs[log->id] = log;
+    log->delivered.assign(ids, 0);
+  }
+  if (correct.empty()) {
+    for (process_log_t *log : order) {
+      correct.push_back(log->id);
+    }
+  }
+  for (uint32_t id : correct) {
+    if (id >= ids || logs[id] == nullptr) {
+      throw std::runtime_error("no output file for process " +
+                               std::to_string(id));
+    }
+  }
+
+  parallel_for(order,
+               [&](process_log_t *log) { check_fifo(log, dependencies); });
+  steady_clock::time_point fifo_done = steady_clock::now();
+  parallel_for(order, [&](process_log_t *log) {
+    check_lcb(log, dependencies, logs);
+  });
+  steady_clock::time_point lcb_done = steady_clock::now();
+
+  uint64_t lines = 0, bytes = 0, fifo = 0, lcb = 0, malformed = 0;
+  for (process_log_t *log : order) {
+    std::cout << log->report.str();
+    lines += log->lines;
+    bytes += log->size;
+    fifo += log->fifo_violations;
+    lcb += log->lcb_violations;
+    malformed += log->format_errors;
+  }
+  uint64_t agreement = check_agreement(logs, correct);
+  steady_clock::time_point done = steady_clock::now();
+
+  double seconds = duration<double>(done - start).count();
+  std::cout << "Checked " << lines << " lines (" << bytes / MEGABYTE
+            << " MB) of " << order.size() << " processes in " << seconds
+            << " s: fifo "
+            << duration<double>(fifo_done - start).count() << " s, lcb "
+            << duration<double>(lcb_done - fifo_done).count() << " s, "
+            << static_cast<uint64_t>(static_cast<double>(lines) / seconds)
+            << " lines/s\n";
+  std::cout << "FIFO violations: " << fifo << "\n"
+            << "LCB violations: " << lcb << "\n"
+            << "Agreement violations: " << agreement << "\n"
+            << "Malformed lines: " << malformed << "\n";
+
+  bool ok = fifo + lcb + agreement + malformed == 0;
+  std::cout << (ok ? "Validation OK\n" : "Validation failed!\n");
+  for (process_log_t *log : order) {
+    if (log->data != nullptr) {
+      munmap(const_cast<char *>(log->data), log->size);
+    }
+    delete log;
+  }
+  return ok ? 0 : 1;
+}
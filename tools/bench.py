@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+import argparse
+import os
+import resource
+import signal
+import subprocess
+import time
+
+PROCESSES_BASE_IP = 11000
+
+
+def generate_config(directory, processes, messages, all_dependencies):
+    hostsfile = os.path.join(directory, "hosts")
+    configfile = os.path.join(directory, "config")
+
+    with open(hostsfile, "w") as hosts:
+        for i in range(1, processes + 1):
+            hosts.write("{} localhost {}\n".format(i, PROCESSES_BASE_IP + i))
+
+    with open(configfile, "w") as config:
+        config.write("{}\n".format(messages))
+        for i in range(1, processes + 1):
+            if all_dependencies:
+                everyone = range(1, processes + 1)
+                config.write("{} {}\n".format(i, " ".join(map(str, everyone))))
+            else:
+                config.write("{}\n".format(i))
+
+    return (hostsfile, configfile)
+
+
+def count_events(path):
+    broadcasts = 0
+    deliveries = 0
+    with open(path, "rb") as f:
+        for line in f:
+            if line.startswith(b"d"):
+                deliveries += 1
+            elif line.startswith(b"b"):
+                broadcasts += 1
+    return (broadcasts, deliveries)
+
+
+def udp_datagrams_sent():
+    # system wide, so other UDP traffic on the host is counted too
+    with open("/proc/net/snmp") as snmp:
+        rows = [line.split() for line in snmp if line.startswith("Udp:")]
+    return int(rows[1][rows[0].index("OutDatagrams")])
+
+
+def children_cpu_time():
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return usage.ru_utime + usage.ru_stime
+
+
+def run_once(binary, processes, messages, duration, directory, all_dependencies,
+             env):
+    cpu_start = children_cpu_time()
+    datagrams_start = udp_datagrams_sent()
+    hostsfile, configfile = generate_config(
+        directory, processes, messages, all_dependencies
+    )
+    outputs = [
+        os.path.join(directory, "proc{:03d}.output".format(pid))
+        for pid in range(1, processes + 1)
+    ]
+
+    procs = []
+    for pid in range(1, processes + 1):
+        cmd = [
+            binary,
+            "--id", str(pid),
+            "--hosts", hostsfile,
+            "--output", outputs[pid - 1],
+            configfile,
+        ]
+        procs.append(
+            subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                             env=env)
+        )
+
+    time.sleep(duration)
+
+    datagrams = udp_datagrams_sent() - datagrams_start
+    for p in procs:
+        p.send_signal(signal.SIGTERM)
+    time.sleep(2)
+    for p in procs:
+        if p.poll() is None:
+            p.kill()
+        p.wait()
+
+    broadcasts = 0
+    deliveries = 0
+    for path in outputs:
+        b, d = count_events(path)
+        broadcasts += b
+        deliveries += d
+    return (broadcasts, deliveries, children_cpu_time() - cpu_start, datagrams)
+
+
+def main(args):
+    binaries = []
+    for spec in args.binaries:
+        label, _, path = spec.partition("=")
+        binaries.append((label, os.path.abspath(path)) if path else (label, os.path.abspath(label)))
+
+    environments = {}
+    for spec in args.env:
+        label, _, assignment = spec.partition(":")
+        name, _, value = assignment.partition("=")
+        environments.setdefault(label, dict(os.environ))[name] = value
+
+    os.makedirs(args.logs, exist_ok=True)
+    print("label,processes,broadcasts,deliveries,deliveries_per_sec,cpu_sec,"
+          "datagrams,datagrams_per_delivery")
+
+    for processes in args.proc_nums:
+        for label, binary in binaries:
+            broadcasts, deliveries, cpu, datagrams = run_once(
+                binary, processes, args.m, args.duration, args.logs,
+                args.all_dependencies, environments.get(label)
+            )
+            print(
+                "{},{},{},{},{:.0f},{:.1f},{},{:.2f}".format(
+                    label, processes, broadcasts, deliveries,
+                    deliveries / args.duration, cpu, datagrams,
+                    datagrams / max(deliveries, 1)
+                ),
+                flush=True,
+            )
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Compares the delivery throughput of several da_proc builds"
+    )
+
+    parser.add_argument("binaries", nargs="+",
+                        help="da_proc builds to compare, as LABEL=PATH")
+    parser.add_argument("-l", "--logs", required=True, dest="logs",
+                        help="Directory for the hosts, config and output files")
+    parser.add_argument("-p", "--proc_nums", type=lambda s: [int(x) for x in s.split(",")],
+                        default=[3, 9, 32, 128], dest="proc_nums",
+                        help="Comma separated cluster sizes")
+    parser.add_argument("-m", type=int, default=2147483647, dest="m",
+                        help="Messages to broadcast per process")
+    parser.add_argument("-d", "--duration", type=int, default=30, dest="duration",
+                        help="Seconds each configuration runs for")
+    parser.add_argument("-a", "--all_dependencies", action="store_true",
+                        dest="all_dependencies",
+                        help="Make every process depend on all others")
+    parser.add_argument("-e", "--env", action="append", default=[], dest="env",
+                        help="Environment variable for the processes of one "
+                        "build, as LABEL:NAME=VALUE; repeatable")
+
+    main(parser.parse_args())
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Compares da_proc with and without datagram compression. With RATE set,
+# e.g. RATE=20mbit, the loopback is shaped to that bandwidth while the
+# benchmark runs (needs root). Extra arguments go to bench.py, e.g.
+#   RATE=20mbit ./bench_compression.sh -a -p 9,32 -d 10
+set -e
+
+TOOLS="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+SOURCES="$TOOLS/../template_cpp"
+WORKDIR="${BENCH_DIR:-/tmp/da_bench_compression}"
+
+mkdir -p "$WORKDIR/logs"
+for compression in 0 1; do
+  CXX="${CXX:-c++} -DWIRE_COMPRESSION=$compression" \
+    cmake -S "$SOURCES" -B "$WORKDIR/build$compression" \
+    -DCMAKE_BUILD_TYPE=Release > /dev/null
+  cmake --build "$WORKDIR/build$compression" -j"$(nproc)" > /dev/null
+done
+
+if [ -n "$RATE" ]; then
+  tc qdisc add dev lo root tbf rate "$RATE" burst 64kb latency 50ms
+  trap 'tc qdisc del dev lo root' EXIT
+fi
+
+"$TOOLS/bench.py" -l "$WORKDIR/logs" \
+  uncompressed="$WORKDIR/build0/src/da_proc" \
+  compressed="$WORKDIR/build1/src/da_proc" "$@"
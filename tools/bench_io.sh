@@ -0,0 +1,21 @@
+#!/bin/bash
+# Compares the socket and io_uring link backends: builds da_proc once with
+# each and runs bench.py on both. Extra arguments go to bench.py, e.g.
+#   ./bench_io.sh -p 3,9 -d 10
+set -e
+
+TOOLS="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+SOURCES="$TOOLS/../template_cpp"
+WORKDIR="${BENCH_DIR:-/tmp/da_bench_io}"
+
+mkdir -p "$WORKDIR/logs"
+for backend in 0 1; do
+  CXX="${CXX:-c++} -DIO_URING_BACKEND=$backend" \
+    cmake -S "$SOURCES" -B "$WORKDIR/build$backend" \
+    -DCMAKE_BUILD_TYPE=Release > /dev/null
+  cmake --build "$WORKDIR/build$backend" -j"$(nproc)" > /dev/null
+done
+
+"$TOOLS/bench.py" -l "$WORKDIR/logs" \
+  sockets="$WORKDIR/build0/src/da_proc" \
+  io_uring="$WORKDIR/build1/src/da_proc" "$@"
@@ -0,0 +1,18 @@
+#!/bin/bash
+# Compares the ACK-per-packet and NACK reliability modes of one da_proc
+# build: delivery throughput, and datagrams sent per delivery. Extra
+# arguments go to bench.py, e.g.
+#   ./bench_reliability.sh -p 9,32 -d 10
+set -e
+
+TOOLS="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+SOURCES="$TOOLS/../template_cpp"
+WORKDIR="${BENCH_DIR:-/tmp/da_bench_reliability}"
+
+mkdir -p "$WORKDIR/logs"
+cmake -S "$SOURCES" -B "$WORKDIR/build" -DCMAKE_BUILD_TYPE=Release > /dev/null
+cmake --build "$WORKDIR/build" -j"$(nproc)" > /dev/null
+
+"$TOOLS/bench.py" -l "$WORKDIR/logs" \
+  -e ack:DA_RELIABILITY=ack -e nack:DA_RELIABILITY=nack \
+  ack="$WORKDIR/build/src/da_proc" nack="$WORKDIR/build/src/da_proc" "$@"
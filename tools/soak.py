@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+
+import argparse
+import os
+import signal
+import subprocess
+import sys
+import time
+
+PROCESSES_BASE_IP = 11000
+
+
+def check_positive(value):
+    ivalue = int(value)
+    if ivalue <= 0:
+        raise argparse.ArgumentTypeError(
+            "{} is an invalid positive int value".format(value)
+        )
+    return ivalue
+
+
+def generate_config(directory, processes, messages):
+    hostsfile = os.path.join(directory, "hosts")
+    configfile = os.path.join(directory, "config")
+
+    with open(hostsfile, "w") as hosts:
+        for i in range(1, processes + 1):
+            hosts.write("{} localhost {}\n".format(i, PROCESSES_BASE_IP + i))
+
+    with open(configfile, "w") as config:
+        config.write("{}\n".format(messages))
+        for i in range(1, processes + 1):
+            config.write("{}\n".format(i))
+
+    return (hostsfile, configfile)
+
+
+def rss_kb(pid):
+    try:
+        with open("/proc/{}/status".format(pid)) as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    return int(line.split()[1])
+    except FileNotFoundError:
+        pass
+    return 0
+
+
+def start_processes(binary, processes, hostsfile, configfile, directory):
+    procs = []
+    for pid in range(1, processes + 1):
+        cmd = [
+            binary,
+            "--id", str(pid),
+            "--hosts", hostsfile,
+            "--output", os.path.join(directory, "proc{:02d}.output".format(pid)),
+            configfile,
+        ]
+        procs.append(
+            subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        )
+    return procs
+
+
+def main(args):
+    hostsfile, configfile = generate_config(args.logs, args.proc_num, args.m)
+    procs = start_processes(args.binary, args.proc_num, hostsfile, configfile, args.logs)
+    samples = []
+
+    try:
+        started = time.time()
+        print("t," + ",".join("rss_{}".format(i + 1) for i in range(len(procs))))
+
+        while time.time() - started < args.duration:
+            time.sleep(args.interval)
+            elapsed = time.time() - started
+
+            for i in range(args.crash):
+                # crash the last processes once, like stress.py does
+                if elapsed >= args.crash_after and procs[-1 - i].poll() is None:
+                    procs[-1 - i].send_signal(signal.SIGTERM)
+
+            rss = [rss_kb(p.pid) if p.poll() is None else 0 for p in procs]
+            samples.append(rss)
+            print("{:.1f},{}".format(elapsed, ",".join(map(str, rss))))
+    finally:
+        for p in procs:
+            if p.poll() is None:
+                p.send_signal(signal.SIGTERM)
+        time.sleep(1)
+        for p in procs:
+            if p.poll() is None:
+                p.kill()
+
+    # compare the second quarter with the last one, after the warm-up
+    quarter = max(len(samples) // 4, 1)
+    early = samples[quarter: 2 * quarter] or samples[:1]
+    late = samples[-quarter:]
+    grown = []
+    for i in range(len(procs)):
+        if late[-1][i] == 0:
+            continue
+        early_avg = sum(s[i] for s in early) / len(early)
+        late_avg = sum(s[i] for s in late) / len(late)
+        growth = 100.0 * (late_avg - early_avg) / max(early_avg, 1)
+        print(
+            "Process {}: RSS {:.0f} kB -> {:.0f} kB ({:+.1f}%)".format(
+                i + 1, early_avg, late_avg, growth
+            )
+        )
+        if args.max_growth is not None and growth > args.max_growth:
+            grown.append(i + 1)
+
+    if grown:
+        print("RSS grew more than {}% in processes {}".format(
+            args.max_growth, ", ".join(map(str, grown))))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Long running soak test sampling the RSS of every process"
+    )
+
+    parser.add_argument("-b", "--binary", required=True, dest="binary",
+                        help="Path to da_proc")
+    parser.add_argument("-l", "--logs", required=True, dest="logs",
+                        help="Directory for the hosts, config and output files")
+    parser.add_argument("-p", "--proc_num", required=True, type=check_positive,
+                        dest="proc_num", help="Total number of processes")
+    parser.add_argument("-m", type=check_positive, default=2147483647, dest="m",
+                        help="Messages to broadcast per process")
+    parser.add_argument("-d", "--duration", type=check_positive, default=600,
+                        dest="duration", help="Soak duration in seconds")
+    parser.add_argument("-i", "--interval", type=float, default=5.0,
+                        dest="interval", help="Sampling interval in seconds")
+    parser.add_argument("--crash", type=int, default=0, dest="crash",
+                        help="Number of processes to terminate during the run")
+    parser.add_argument("--crash-after", type=float, default=10.0,
+                        dest="crash_after", help="Seconds before crashing them")
+    parser.add_argument("--max-growth", type=float, default=None,
+                        dest="max_growth",
+                        help="Fail if the RSS of a live process grows by more "
+                        "than this many percent")
+
+    main(parser.parse_args())